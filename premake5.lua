@@ -1,3 +1,18 @@
+newoption {
+	trigger = "jit",
+	description = "Enables the baseline JIT compiler (x86-64 Linux only).",
+}
+
+newoption {
+	trigger = "opcount",
+	description = "Counts executed opcodes and instructions, see kojic --opcount.",
+}
+
+newoption {
+	trigger = "gc",
+	description = "Replaces reference counting with an incremental tracing garbage collector.",
+}
+
 solution "koji"
 	language "C"
 	configurations { "Debug", "Release" }
@@ -15,15 +30,25 @@ solution "koji"
 	configuration "vs*"
 		defines "_CRT_SECURE_NO_WARNINGS"
 
+	configuration "jit"
+		defines "KOJI_JIT"
+
+	configuration "opcount"
+		defines "KOJI_OPCOUNT"
+
+	configuration "gc"
+		defines "KOJI_GC"
+
 	project "libkoji"
 		targetname "koji"
 		kind "StaticLib"
 		files { "src/**.*" }
-		removefiles { "src/kmain.c", "src/ktests.c" }
+		removefiles { "src/kmain.c", "src/ktests.c", "src/kbench.c" }
 
 	project "kojitests"
 		kind "ConsoleApp"
-		files { "src/ktests.c", "tests/**.kj" }
+		files { "src/ktests.c", "tests/**.kj", "tests/**.c" }
+		includedirs "src"
 		links "libkoji"
 
 	project "kojic"
@@ -31,6 +56,11 @@ solution "koji"
 		files { "src/kmain.c", "./**.kj" }
 		links "libkoji"
 
+	project "kojibench"
+		kind "ConsoleApp"
+		files { "src/kbench.c", "bench/**.kj" }
+		links "libkoji"
+
 newaction {
 	trigger = "embed",
 	description = "Generates the amalgamate file koji.c for better performance and simpler distribution.",
@@ -47,8 +77,15 @@ newaction {
 			"kstring.h",
 			"klexer.h",
 			"kbytecode.h",
+			"kclosure.h",
 			"kcompiler.h",
+			"kcollect.h",
+			"kgc.h",
 			"kvm.h",
+			"kjit.h",
+			"kaot.h",
+			"kprofile.h",
+			"kslab.h",
 		}
 
 		local kojic = ""
@@ -62,7 +99,7 @@ newaction {
 		end
 
 		for k,v in pairs(os.matchfiles("src/*.c")) do
-			if v ~= "src/kmain.c"  then
+			if v ~= "src/kmain.c" and v ~= "src/kbench.c" then
 				kojic = kojic .. io.open(v):read("*all")
 			end
 		end
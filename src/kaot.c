@@ -0,0 +1,376 @@
+/*
+ * koji scripting language
+ *
+ * Copyright (C) 2017 Canio Massimo Tristano
+ *
+ * This source file is part of the koji scripting language, distributed under
+ * the MIT license. See koji.h for further licensing information.
+ */
+
+#include "kaot.h"
+#include "kbytecode.h"
+
+#include <math.h>
+#include <ctype.h>
+
+/* modules registered, shared by all states */
+static struct aot_module *aot_modules;
+
+kintern void
+aot_register(struct aot_module *module)
+{
+   module->next = aot_modules;
+   aot_modules = module;
+}
+
+static int32_t
+count_protos(struct prototype const *proto)
+{
+   int32_t n = 1;
+   for (int32_t i = 0; i < proto->nprotos; ++i)
+      n += count_protos(proto->protos[i]);
+   return n;
+}
+
+/* sets the functions of [proto] and its inner prototypes in depth first
+   order from [fns], returns the next function */
+static aot_fn_t const *
+bind_protos(struct prototype *proto, aot_fn_t const *fns)
+{
+   proto->aot = *fns++;
+   for (int32_t i = 0; i < proto->nprotos; ++i)
+      fns = bind_protos(proto->protos[i], fns);
+   return fns;
+}
+
+kintern bool
+aot_bind(struct prototype *proto)
+{
+   uint64_t hash;
+
+   if (!aot_modules)
+      return false;
+
+   hash = prototype_hash(proto);
+   for (struct aot_module *m = aot_modules; m; m = m->next) {
+      if (m->hash == hash && m->nprotos == count_protos(proto)) {
+         bind_protos(proto, m->fns);
+         return true;
+      }
+   }
+   return false;
+}
+
+/*
+ * C code generation.
+ */
+
+/* writes the C expression of the value at location [k], [index] */
+static void
+emit_loc(FILE *out, struct prototype const *proto, uint8_t k, int32_t index)
+{
+   if (!k)
+      fprintf(out, "r[%d]", index);
+   else if (value_isnum(proto->consts[index]) &&
+            isfinite(proto->consts[index].num))
+      fprintf(out, "value_num(%a)", proto->consts[index].num); /* foldable */
+   else
+      fprintf(out, "k[%d]", index);
+}
+
+/* writes the jump to instruction [pc] */
+static void
+emit_goto(FILE *out, int32_t pc)
+{
+   fprintf(out, "goto L%d;", pc);
+}
+
+/* marks in [labels] the instructions jumped to and the resume points */
+static void
+mark_labels(struct prototype const *proto, bool *labels)
+{
+   labels[0] = true;
+   for (int32_t pc = 0; pc < proto->ninstrs; ++pc) {
+      struct decoded_instr const *i = proto->code + pc;
+      switch (i->op) {
+         case OP_LOADBOOL:
+            labels[pc + 1 + i->c] = true;
+            break;
+
+         case OP_TEST:
+         case OP_TESTSET:
+         case OP_EQ:
+         case OP_LT:
+         case OP_LTE:
+            labels[pc + 1 + i->c] = labels[pc + 2] = true;
+            break;
+
+         case OP_JUMP:
+            labels[pc + 1 + i->b] = true;
+            break;
+
+         case OP_CALL:
+         case OP_MCALL:
+            labels[pc + 1] = true;
+            break;
+
+         default:
+            break;
+      }
+   }
+}
+
+static bool
+emit_instr(FILE *out, struct prototype const *proto, int32_t pc)
+{
+   static const char *ARITH_OPS[] = { "+", "-", "*", "/" };
+   static const char *ARITH_CLASSOPS[] = {
+      "CLASS_OP_ADD", "CLASS_OP_SUB", "CLASS_OP_MUL", "CLASS_OP_DIV"
+   };
+   static const char *COMPARE_OPS[] = { "==", "<", "<=" };
+
+   struct decoded_instr const *i = proto->code + pc;
+   int32_t kind;
+
+   switch (i->op) {
+      case OP_LOADNIL:
+         for (int32_t r = i->a; r < i->a + i->b; ++r)
+            fprintf(out, "aot_setnil(vm, r + %d); ", r);
+         break;
+
+      case OP_LOADBOOL:
+         fprintf(out, "aot_setbool(vm, r + %d, %s);", i->a,
+            i->b ? "true" : "false");
+         if (i->c) {
+            fprintf(out, " ");
+            emit_goto(out, pc + 1 + i->c);
+         }
+         break;
+
+      case OP_MOV:
+         fprintf(out, "vm_value_set(vm, r + %d, ", i->a);
+         emit_loc(out, proto, i->bk, i->b);
+         fprintf(out, ");");
+         break;
+
+      case OP_NEG:
+         fprintf(out, "aot_setbool(vm, r + %d, !value_tobool(", i->a);
+         emit_loc(out, proto, i->bk, i->b);
+         fprintf(out, "));");
+         break;
+
+      case OP_UNM:
+         fprintf(out, "vm_aot_unm(vm, r + %d, ", i->a);
+         emit_loc(out, proto, i->bk, i->b);
+         fprintf(out, ");");
+         break;
+
+      case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV: case OP_MOD:
+      case OP_ADDK: case OP_SUBK: case OP_MULK: case OP_DIVK: case OP_MODK:
+      case OP_KADD: case OP_KSUB: case OP_KMUL: case OP_KDIV: case OP_KMOD:
+         kind = i->op >= OP_KADD ? i->op - OP_KADD :
+                i->op >= OP_ADDK ? i->op - OP_ADDK : i->op - OP_ADD;
+         if (kind == OP_MOD - OP_ADD)
+            fprintf(out, "aot_mod(r + %d, ", i->a);
+         else
+            fprintf(out, "aot_arith(r + %d, ", i->a);
+         emit_loc(out, proto, i->bk, i->b);
+         fprintf(out, ", ");
+         emit_loc(out, proto, i->ck, i->c);
+         if (kind == OP_MOD - OP_ADD)
+            fprintf(out, ");");
+         else
+            fprintf(out, ", %s, %s);", ARITH_OPS[kind], ARITH_CLASSOPS[kind]);
+         break;
+
+      case OP_TESTSET:
+         fprintf(out, "if (value_tobool(");
+         emit_loc(out, proto, i->bk, i->b);
+         fprintf(out, ") == %d) { vm_value_set(vm, r + %d, ", i->flag, i->a);
+         emit_loc(out, proto, i->bk, i->b);
+         fprintf(out, "); ");
+         emit_goto(out, pc + 1 + i->c);
+         fprintf(out, " } ");
+         emit_goto(out, pc + 2);
+         break;
+
+      case OP_CLOSURE:
+         fprintf(out, "vm_aot_closure(vm, r + %d, frame->proto->protos[%d]);",
+            i->a, i->b);
+         break;
+
+      case OP_GETGLOB:
+         /* the global slot is resolved when the prototype is decoded */
+         fprintf(out, "vm_value_set(vm, r + %d, vm->globalvals[code[%d].b]);",
+            i->a, pc);
+         break;
+
+      case OP_SETGLOB:
+         fprintf(out, "vm_value_set(vm, vm->globalvals + code[%d].b, r[%d]);",
+            pc, i->a);
+         break;
+
+      case OP_NEWTABLE:
+         fprintf(out, "vm_aot_newtable(vm, r + %d);", i->a);
+         break;
+
+      case OP_GET:
+         fprintf(out, "vm_aot_get(vm, r + %d, ", i->a);
+         emit_loc(out, proto, i->bk, i->b);
+         fprintf(out, ", ");
+         emit_loc(out, proto, i->ck, i->c);
+         fprintf(out, ");");
+         break;
+
+      case OP_SET:
+         fprintf(out, "vm_aot_set(vm, r[%d], ", i->a);
+         emit_loc(out, proto, i->bk, i->b);
+         fprintf(out, ", ");
+         emit_loc(out, proto, i->ck, i->c);
+         fprintf(out, ");");
+         break;
+
+      case OP_TEST:
+         fprintf(out, "if (value_tobool(r[%d]) == %d) ", i->a, i->flag);
+         emit_goto(out, pc + 1 + i->c);
+         fprintf(out, " ");
+         emit_goto(out, pc + 2);
+         break;
+
+      case OP_JUMP:
+         emit_goto(out, pc + 1 + i->b);
+         break;
+
+      case OP_EQ:
+      case OP_LT:
+      case OP_LTE:
+         fprintf(out, "if (aot_compare(%s, %s, r[%d], ",
+            i->op == OP_EQ ? "OP_EQ" : i->op == OP_LT ? "OP_LT" : "OP_LTE",
+            COMPARE_OPS[i->op - OP_EQ], i->a);
+         emit_loc(out, proto, i->bk, i->b);
+         fprintf(out, ") == %d) ", i->flag);
+         emit_goto(out, pc + 1 + i->c);
+         fprintf(out, " ");
+         emit_goto(out, pc + 2);
+         break;
+
+      /* calls return to the vm if they push a frame, the vm resumes this
+         function from the following instruction once the callee returns */
+      case OP_CALL:
+         fprintf(out, "frame->pc = %d; if (vm_aot_call(vm, ", pc + 1);
+         emit_loc(out, proto, i->ck, i->c);
+         fprintf(out, ", frame->stackbase + %d, %d)) return; "
+            "r = vm->valuestack + frame->stackbase;", i->a, i->b);
+         break;
+
+      case OP_MCALL:
+         fprintf(out, "frame->pc = %d; if (vm_aot_mcall(vm, frame, %d, ",
+            pc + 1, i->a);
+         emit_loc(out, proto, i->bk, i->b);
+         fprintf(out, ", %d)) return; r = vm->valuestack + frame->stackbase;",
+            i->c);
+         break;
+
+      case OP_TAILCALL:
+         fprintf(out, "if (vm_aot_tailcall(vm, ");
+         emit_loc(out, proto, i->ck, i->c);
+         fprintf(out, ", %d, %d)) return; "
+            "r = vm->valuestack + frame->stackbase;", i->a, i->b);
+         break;
+
+      case OP_RET:
+         fprintf(out, "vm_aot_return(vm, %d, %d); return;", i->a, i->b);
+         break;
+
+      case OP_THROW:
+         fprintf(out, "vm_aot_throw(vm, ");
+         emit_loc(out, proto, i->bk, i->b);
+         fprintf(out, ");");
+         break;
+
+      case OP_DEBUG:
+         fprintf(out, "vm_aot_debug(vm, r + %d, %d);", i->a, i->b);
+         break;
+
+      default:
+         return false;
+   }
+   return true;
+}
+
+/* writes the function of [proto] with index [*index] and of its inner
+   prototypes in depth first order */
+static bool
+emit_proto(FILE *out, struct prototype *proto, int32_t *index,
+   struct koji_allocator *alloc)
+{
+   bool *labels;
+   bool ok = true;
+
+   prototype_decode(proto, alloc);
+   labels = kalloc(bool, proto->ninstrs + 1, alloc);
+   for (int32_t pc = 0; pc <= proto->ninstrs; ++pc)
+      labels[pc] = false;
+   mark_labels(proto, labels);
+
+   fprintf(out,
+      "static void\n"
+      "proto_%d(struct vm *vm, struct vm_frame *frame)\n"
+      "{\n"
+      "   struct decoded_instr const *code = frame->proto->code;\n"
+      "   union value *k = frame->proto->consts;\n"
+      "   union value *r = vm->valuestack + frame->stackbase;\n"
+      "   (void)code; (void)k; (void)r;\n\n"
+      "   switch (frame->pc) {\n", (*index)++);
+   for (int32_t pc = 0; pc < proto->ninstrs; ++pc) {
+      if (labels[pc])
+         fprintf(out, "      case %d: goto L%d;\n", pc, pc);
+   }
+   fprintf(out, "   }\n\n");
+
+   for (int32_t pc = 0; pc < proto->ninstrs && ok; ++pc) {
+      if (labels[pc])
+         fprintf(out, "L%d:\n", pc);
+      fprintf(out, "   /* %s */ ", OP_STRINGS[proto->code[pc].op]);
+      ok = emit_instr(out, proto, pc);
+      fprintf(out, "\n");
+   }
+   fprintf(out, "}\n\n");
+   kfree(labels, proto->ninstrs + 1, alloc);
+
+   for (int32_t i = 0; i < proto->nprotos && ok; ++i)
+      ok = emit_proto(out, proto->protos[i], index, alloc);
+   return ok;
+}
+
+kintern bool
+aot_emit(struct prototype *proto, const char *name, FILE *out,
+   struct koji_allocator *alloc)
+{
+   int32_t nprotos = 0;
+
+   fprintf(out, "/* generated by kojic --emit-c, do not edit */\n\n"
+      "#include \"kaot.h\"\n\n");
+   if (!emit_proto(out, proto, &nprotos, alloc))
+      return false;
+
+   fprintf(out, "static aot_fn_t const fns[] = {");
+   for (int32_t i = 0; i < nprotos; ++i)
+      fprintf(out, "%s proto_%d", i ? "," : "", i);
+   fprintf(out, " };\n\n");
+
+   fprintf(out, "static struct aot_module module = {\n"
+      "   0x%016llxull, %d, fns, NULL\n"
+      "};\n\n", (unsigned long long)prototype_hash(proto), nprotos);
+
+   /* registration, automatic where constructors are supported */
+   fprintf(out, "void\nkoji_aot_register_");
+   for (const char *c = name; *c; ++c)
+      fputc(isalnum((unsigned char)*c) ? *c : '_', out);
+   fprintf(out, "(void)\n{\n   aot_register(&module);\n}\n\n"
+      "#if defined(__GNUC__) || defined(__clang__)\n"
+      "__attribute__((constructor)) static void\n"
+      "register_module(void)\n{\n   aot_register(&module);\n}\n"
+      "#endif\n");
+   return true;
+}
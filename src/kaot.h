@@ -0,0 +1,146 @@
+/*
+ * koji scripting language - ahead-of-time compilation to C
+ *
+ * Copyright (C) 2017 Canio Massimo Tristano
+ *
+ * This source file is part of the koji scripting language, distributed under
+ * the MIT license. See koji.h for further licensing information.
+ */
+
+#pragma once
+
+#include "kplatform.h"
+#include "kvalue.h"
+#include "kclass.h"
+#include "kbytecode.h"
+#include "kvm.h"
+
+#include <stdio.h>
+
+/*
+ * A script compiled ahead-of-time to C by `kojic --emit-c`. The generated
+ * translation unit defines one function per prototype and registers the
+ * module on startup; koji_load() then runs those functions in place of the
+ * interpreter for any script whose bytecode hashes to [hash].
+ */
+struct aot_module {
+   uint64_t hash; /* prototype_hash() of the main prototype */
+   int32_t nprotos; /* number of prototypes, the main included */
+   aot_fn_t const *fns; /* function of each prototype, depth first */
+   struct aot_module *next; /* next registered module */
+};
+
+/*
+ * Registers [module] so that following koji_load() calls can use it.
+ */
+kintern void
+aot_register(struct aot_module *module);
+
+/*
+ * Sets the compiled functions of [proto] and its inner prototypes if a
+ * module compiled from the same bytecode has been registered. Returns whether
+ * [proto] has been bound.
+ */
+kintern bool
+aot_bind(struct prototype *proto);
+
+/*
+ * Writes to [out] the C translation unit compiled from the prototype [proto].
+ * The module registration function is named after [name]. Returns false if
+ * [proto] contains instructions the VM does not implement.
+ */
+kintern bool
+aot_emit(struct prototype *proto, const char *name, FILE *out,
+   struct koji_allocator *alloc);
+
+/*
+ * VM operations called by generated code, they have the same semantics as
+ * the respective interpreter instructions. Calls return whether a frame
+ * has been pushed, in which case generated code must return to the VM.
+ */
+kintern void
+vm_aot_arith(struct vm *vm, union value *dest, enum class_op_kind classop,
+   union value lhs, union value rhs);
+
+kintern void
+vm_aot_unm(struct vm *vm, union value *dest, union value val);
+
+kintern bool
+vm_aot_compare(struct vm *vm, enum opcode op, union value lhs,
+   union value rhs);
+
+kintern void
+vm_aot_get(struct vm *vm, union value *dest, union value obj, union value key);
+
+kintern void
+vm_aot_set(struct vm *vm, union value obj, union value key, union value val);
+
+kintern void
+vm_aot_newtable(struct vm *vm, union value *dest);
+
+kintern void
+vm_aot_closure(struct vm *vm, union value *dest, struct prototype *proto);
+
+kintern bool
+vm_aot_call(struct vm *vm, union value fn, int32_t argbase, int32_t nargs);
+
+kintern bool
+vm_aot_mcall(struct vm *vm, struct vm_frame *frame, int32_t a,
+   union value key, int32_t nargs);
+
+kintern bool
+vm_aot_tailcall(struct vm *vm, union value fn, int32_t a, int32_t nargs);
+
+kintern void
+vm_aot_return(struct vm *vm, int32_t a, int32_t n);
+
+kintern void
+vm_aot_throw(struct vm *vm, union value val);
+
+kintern void
+vm_aot_debug(struct vm *vm, union value *ra, int32_t n);
+
+/*
+ * Helpers of generated code, inlining the number fast paths.
+ */
+static void
+aot_setnum(struct vm *vm, union value *dest, koji_number_t num)
+{
+   vm_value_destroy(vm, *dest);
+   *dest = value_num(num);
+}
+
+static void
+aot_setbool(struct vm *vm, union value *dest, bool b)
+{
+   vm_value_destroy(vm, *dest);
+   *dest = value_bool(b);
+}
+
+static void
+aot_setnil(struct vm *vm, union value *dest)
+{
+   vm_value_destroy(vm, *dest);
+   *dest = value_nil();
+}
+
+#define aot_arith(dest, lhs, rhs, op, classop) do {\
+   union value l_ = (lhs), r_ = (rhs);\
+   if (value_isnum(l_) && value_isnum(r_))\
+      aot_setnum(vm, dest, l_.num op r_.num);\
+   else\
+      vm_aot_arith(vm, dest, classop, l_, r_);\
+} while (0)
+
+#define aot_mod(dest, lhs, rhs) do {\
+   union value l_ = (lhs), r_ = (rhs);\
+   if (value_isnum(l_) && value_isnum(r_))\
+      aot_setnum(vm, dest,\
+         (koji_number_t)((int64_t)l_.num % (int64_t)r_.num));\
+   else\
+      vm_aot_arith(vm, dest, CLASS_OP_MOD, l_, r_);\
+} while (0)
+
+#define aot_compare(opcode, op, lhs, rhs)\
+   (value_isnum(lhs) && value_isnum(rhs) ? (lhs).num op (rhs).num :\
+    vm_aot_compare(vm, opcode, lhs, rhs))
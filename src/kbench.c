@@ -0,0 +1,597 @@
+/*
+ * koji scripting language
+ *
+ * Copyright (C) 2017 Canio Massimo Tristano
+ *
+ * This source file is part of the koji scripting language, distributed under
+ * the MIT license. See koji.h for further licensing information.
+ */
+
+#include "koji.h"
+#include "kvm.h"
+#include "kbytecode.h"
+#include "ktable.h"
+#include "kstring.h"
+#include "kclosure.h"
+#include "klexer.h"
+#include "kio.h"
+#include "kslab.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef KOJI_AMALGAMATE
+struct koji_state {
+	struct koji_allocator alloc;
+	struct vm vm;
+	struct slab *slab;
+};
+#endif
+
+/*
+ * Benchmark results, in the order they are run.
+ */
+#define MAX_RESULTS 64
+
+struct result {
+   char name[64]; /* benchmark name */
+   double nsop; /* nanoseconds per operation */
+};
+
+static struct result results[MAX_RESULTS];
+static int32_t nresults;
+
+/* benchmarks are only run if their name contains this string */
+static const char *filter = "";
+
+static double
+seconds_since(clock_t begin)
+{
+   return (double)(clock() - begin) / CLOCKS_PER_SEC;
+}
+
+/*
+ * Records and reports the result of benchmark [name] that executed [ops]
+ * operations in [seconds].
+ */
+static void
+record(const char *name, double ops, double seconds)
+{
+   struct result *r = results + nresults++;
+   assert(nresults <= MAX_RESULTS);
+   snprintf(r->name, sizeof r->name, "%s", name);
+   r->nsop = seconds * 1e9 / ops;
+   printf("%-24s %12.0f ops %8.3f s %12.2f ns/op\n", name, ops, seconds,
+      r->nsop);
+}
+
+static bool
+selected(const char *name)
+{
+   return strstr(name, filter) != NULL;
+}
+
+/*
+ * Loads script [filename] and executes its main prototype [runs] times, in a
+ * state allocating from the slab allocator if [slab]. Returns the seconds
+ * elapsed or a negative number on error. The number of instructions of the
+ * main prototype is written to [ninstrs].
+ */
+static double
+run_script(const char *filename, int32_t runs, bool slab, int32_t *ninstrs)
+{
+   koji_state_t *state = slab ? koji_open_slab(NULL) : koji_open(NULL);
+   struct prototype *proto;
+   clock_t begin;
+   double seconds;
+
+   if (koji_load_file(state, filename)) {
+      printf("Compile error: %s\n", koji_string(state, -1));
+      koji_close(state);
+      return -1;
+   }
+
+   /* keep the main prototype alive across runs, each return releases the
+      reference held by its frame */
+   proto = state->vm.framestack[0].proto;
+   ++proto->refs;
+   *ninstrs = proto->ninstrs;
+
+   begin = clock();
+   for (int32_t i = 0; i < runs; ++i) {
+      if (i > 0)
+         vm_push_frame(&state->vm, proto, 0);
+      if (koji_run(state)) {
+         printf("Runtime error: %s\n", koji_string(state, -1));
+         runs = -1;
+         break;
+      }
+   }
+   seconds = seconds_since(begin);
+
+   prototype_release(proto, &state->vm.alloc);
+   koji_close(state);
+   return runs < 0 ? -1 : seconds;
+}
+
+/*
+ * Reports the time taken by each instruction of script [filename]. The script
+ * must be straight-line code (no branches) so that every instruction of the
+ * main prototype executes exactly once per run.
+ */
+static void
+bench_dispatch(const char *dir, const char *name, int32_t runs)
+{
+   char filename[256];
+   int32_t ninstrs;
+   double seconds;
+
+   if (!selected(name))
+      return;
+   snprintf(filename, sizeof filename, "%s%s", dir, name);
+   seconds = run_script(filename, runs, false, &ninstrs);
+   if (seconds >= 0)
+      record(name, (double)ninstrs * runs, seconds);
+}
+
+/*
+ * Reports the time taken by one run of script [name].
+ */
+static void
+bench_script(const char *dir, const char *name, int32_t runs)
+{
+   char filename[256];
+   int32_t ninstrs;
+   double seconds;
+
+   if (!selected(name))
+      return;
+   snprintf(filename, sizeof filename, "%s%s", dir, name);
+   seconds = run_script(filename, runs, false, &ninstrs);
+   if (seconds >= 0)
+      record(name, runs, seconds);
+}
+
+/*
+ * Reports the time taken by one run of script [name] in a state allocating
+ * from the slab allocator, to compare with the bench_script() of [name].
+ */
+static void
+bench_script_slab(const char *dir, const char *name, int32_t runs)
+{
+   char filename[256], slabname[64];
+   int32_t ninstrs;
+   double seconds;
+
+   snprintf(slabname, sizeof slabname, "%s+slab", name);
+   if (!selected(slabname))
+      return;
+   snprintf(filename, sizeof filename, "%s%s", dir, name);
+   seconds = run_script(filename, runs, true, &ninstrs);
+   if (seconds >= 0)
+      record(slabname, runs, seconds);
+}
+
+/*
+ * C microbenchmarks of the runtime building blocks.
+ */
+
+#define TABLE_KEYS 1024
+
+/* a table_set of each key in a new table, growth included; keys 0, 1, 2...
+   go to the array part, multiples of 7 to the hash part */
+static void
+bench_table_set(struct vm *vm, const char *name, int32_t stride,
+   int32_t rounds)
+{
+   struct table t;
+   clock_t begin;
+
+   if (!selected(name))
+      return;
+   begin = clock();
+   for (int32_t r = 0; r < rounds; ++r) {
+      table_init(&t, &vm->alloc, TABLE_DEFAULT_CAPACITY);
+      for (int32_t k = 0; k < TABLE_KEYS; ++k)
+         table_set(&t, vm, value_num(k * stride), value_num(r));
+      table_deinit(&t, vm);
+   }
+   record(name, (double)rounds * TABLE_KEYS, seconds_since(begin));
+}
+
+/* a table_get of each of [nkeys] present [keys] */
+static void
+bench_table_get(struct vm *vm, const char *name, union value *keys,
+   int32_t nkeys, int32_t rounds)
+{
+   struct table t;
+   koji_number_t sum = 0;
+   clock_t begin;
+
+   if (!selected(name))
+      return;
+   table_init(&t, &vm->alloc, TABLE_DEFAULT_CAPACITY);
+   for (int32_t k = 0; k < nkeys; ++k)
+      table_set(&t, vm, keys[k], value_num(k));
+
+   begin = clock();
+   for (int32_t r = 0; r < rounds; ++r) {
+      for (int32_t k = 0; k < nkeys; ++k)
+         sum += table_get(&t, vm, keys[k]).num;
+   }
+   record(name, (double)rounds * nkeys, seconds_since(begin));
+
+   table_deinit(&t, vm);
+   if (sum != (koji_number_t)rounds * nkeys * (nkeys - 1) / 2)
+      printf("%s: wrong sum\n", name);
+}
+
+static void
+bench_table_get_num(struct vm *vm, const char *name, int32_t stride,
+   int32_t rounds)
+{
+   union value keys[TABLE_KEYS];
+   for (int32_t k = 0; k < TABLE_KEYS; ++k)
+      keys[k] = value_num(k * stride);
+   bench_table_get(vm, name, keys, TABLE_KEYS, rounds);
+}
+
+static void
+bench_table_get_str(struct vm *vm, int32_t rounds)
+{
+   union value keys[TABLE_KEYS];
+   for (int32_t k = 0; k < TABLE_KEYS; ++k)
+      keys[k] = value_new_stringf(&vm->cls_string, &vm->alloc, "key_%d", k);
+   bench_table_get(vm, "table_get_str", keys, TABLE_KEYS, rounds);
+   for (int32_t k = 0; k < TABLE_KEYS; ++k)
+      vm_value_destroy(vm, keys[k]);
+}
+
+/* mean distance of the pairs of [t] from their home slot */
+static double
+table_mean_probe(struct vm *vm, struct table *t)
+{
+   uint32_t mask = (uint32_t)t->capacity - 1;
+   double sum = 0;
+   for (uint32_t i = 0; i < (uint32_t)t->capacity; ++i) {
+      if (t->ctrl[i] != TABLE_EMPTY) {
+         uint32_t home = (uint32_t)(vm_value_hash(vm, t->pairs[i].key) >> 7);
+         sum += (i - home) & mask;
+      }
+   }
+   return t->size ? sum / t->size : 0;
+}
+
+/* a table_set of a new key and a table_remove of the oldest one, keeping
+   [window] keys in the table; keys are integers plus [offset] */
+static void
+bench_table_churn(struct vm *vm, const char *name, koji_number_t offset,
+   int32_t window, int32_t ops)
+{
+   struct table t;
+   double seconds = 0;
+   int32_t next = window;
+
+   if (!selected(name))
+      return;
+   table_init(&t, &vm->alloc, TABLE_DEFAULT_CAPACITY);
+   for (int32_t k = 0; k < window; ++k)
+      table_set(&t, vm, value_num(k + offset), value_num(k));
+
+   /* memory and probe lengths must stay stable as keys churn */
+   for (int32_t step = 1; step <= 4; ++step) {
+      clock_t begin = clock();
+      for (int32_t end = next + ops / 4; next < end; ++next) {
+         table_set(&t, vm, value_num(next + offset), value_num(next));
+         table_remove(&t, vm, value_num(next - window + offset));
+      }
+      seconds += seconds_since(begin);
+      printf("   %-20s %10d ops %8d keys %10d bytes %6.2f mean probe\n",
+         name, step * (ops / 4), t.size + t.arraycount,
+         (int32_t)(t.capacity * (sizeof(struct table_pair) + 1) + TABLE_GROUP
+            + t.arraycap * sizeof(union value)),
+         table_mean_probe(vm, &t));
+   }
+   record(name, (double)(ops / 4) * 4, seconds);
+   table_deinit(&t, vm);
+}
+
+#define COLLECT_CYCLES 10000
+
+/* the steps of the cycle collector, with the budget of automatic steps,
+   freeing parent and child tables referencing each other; the steps of a
+   cycle of the tracing collector in KOJI_GC builds */
+static void
+bench_collect(struct vm *vm, int32_t rounds)
+{
+   double seconds = 0, freed = 0;
+
+   if (!selected("collect"))
+      return;
+   for (int32_t r = 0; r < rounds; ++r) {
+      clock_t begin;
+      for (int32_t i = 0; i < COLLECT_CYCLES; ++i) {
+         union value p = value_new_table(&vm->cls_table, &vm->shape_root,
+            &vm->alloc);
+         union value c = value_new_table(&vm->cls_table, &vm->shape_root,
+            &vm->alloc);
+         table_set(&((struct object_table *)value_getobjv(p))->table, vm,
+            value_shortstr("child", 5), c);
+         table_set(&((struct object_table *)value_getobjv(c))->table, vm,
+            value_shortstr("up", 2), p);
+         vm_value_destroy(vm, p);
+         vm_value_destroy(vm, c);
+      }
+      begin = clock();
+#ifdef KOJI_GC
+      do {
+         freed += gc_collect(vm, GC_DEFAULT_BUDGET);
+      } while (vm->gc.phase != GC_PAUSE);
+#else
+      while (vm->collector.nroots > 0 || vm->collector.phase != COLLECT_IDLE)
+         freed += collector_step(vm, COLLECT_DEFAULT_BUDGET);
+#endif
+      seconds += seconds_since(begin);
+   }
+   record("collect", freed, seconds);
+}
+
+#define ALLOC_WINDOW 256
+
+/* an allocation of the size of a common header and the free of the
+   allocation made [ALLOC_WINDOW] allocations before */
+static void
+bench_alloc(struct koji_allocator *alloc, const char *name, int32_t ops)
+{
+   static const int32_t sizes[] = {
+      sizeof(struct string) + 8,
+      sizeof(struct string) + sizeof(struct rope),
+      sizeof(struct object_table),
+      sizeof(struct string) + sizeof(struct slice),
+      sizeof(struct closure),
+   };
+   void *blocks[ALLOC_WINDOW] = { NULL };
+   int32_t nsizes = sizeof sizes / sizeof *sizes;
+   clock_t begin;
+
+   if (!selected(name))
+      return;
+   begin = clock();
+   for (int32_t i = 0; i < ops; ++i) {
+      int32_t slot = i % ALLOC_WINDOW;
+      if (blocks[slot])
+         alloc->free(blocks[slot], sizes[(i - ALLOC_WINDOW) % nsizes],
+            alloc->user);
+      blocks[slot] = alloc->alloc(sizes[i % nsizes], alloc->user);
+   }
+   for (int32_t i = ops - ALLOC_WINDOW; i < ops; ++i)
+      alloc->free(blocks[i % ALLOC_WINDOW], sizes[i % nsizes], alloc->user);
+   record(name, ops, seconds_since(begin));
+}
+
+/* murmur2 of a [len] bytes key */
+static void
+bench_murmur2(int32_t len, int32_t rounds)
+{
+   char name[32], key[256];
+   uint64_t hash = 0;
+   clock_t begin;
+
+   snprintf(name, sizeof name, "murmur2_%d", len);
+   if (!selected(name))
+      return;
+   for (int32_t i = 0; i < len; ++i)
+      key[i] = (char)('a' + i % 26);
+
+   begin = clock();
+   for (int32_t r = 0; r < rounds; ++r)
+      hash = murmur2(key, len, hash);
+   record(name, rounds, seconds_since(begin));
+   if (hash == 0)
+      printf("%s: unexpected hash\n", name);
+}
+
+static void
+lex_issue(struct sourceloc sloc, const char *message, void *user)
+{
+   (void)sloc;
+   (void)user;
+   printf("Lexer error: %s\n", message);
+}
+
+/* lex_scan of every token of script [filename], read to memory */
+static void
+bench_lex_scan(const char *filename, int32_t rounds)
+{
+   struct koji_allocator *alloc = default_alloc();
+   struct issue_handler issues;
+   char *source;
+   long size;
+   double ntokens = 0;
+   clock_t begin;
+   FILE *file;
+
+   if (!selected("lex_scan"))
+      return;
+   file = fopen(filename, "rb");
+   if (!file) {
+      printf("cannot open file '%s'.\n", filename);
+      return;
+   }
+   fseek(file, 0, SEEK_END);
+   size = ftell(file);
+   fseek(file, 0, SEEK_SET);
+   source = malloc(size + 1);
+   source[fread(source, 1, size, file)] = '\0';
+   fclose(file);
+
+   issues.user = NULL;
+   issues.handle = lex_issue;
+
+   begin = clock();
+   for (int32_t r = 0; r < rounds; ++r) {
+      const char *stream = source;
+      struct koji_source src;
+      struct lex_info info;
+      struct lex lex;
+      source_string_open(&src, filename, &stream);
+      info.alloc = *alloc;
+      info.issue_handler = &issues;
+      info.source = &src;
+      if (setjmp(issues.error_jmpbuf)) {
+         lex_deinit(&lex);
+         break;
+      }
+      lex_init(&lex, &info);
+      for (++ntokens; lex.tok != tok_eos; ++ntokens)
+         lex_scan(&lex);
+      lex_deinit(&lex);
+   }
+   record("lex_scan", ntokens, seconds_since(begin));
+   free(source);
+}
+
+/*
+ * Writes the results to [filename] as JSON.
+ */
+static bool
+write_json(const char *filename)
+{
+   FILE *file = fopen(filename, "w");
+   if (!file)
+      return false;
+   fprintf(file, "{\n   \"benchmarks\": [\n");
+   for (int32_t i = 0; i < nresults; ++i)
+      fprintf(file, "      { \"name\": \"%s\", \"ns_per_op\": %.4f }%s\n",
+         results[i].name, results[i].nsop, i + 1 < nresults ? "," : "");
+   fprintf(file, "   ]\n}\n");
+   fclose(file);
+   return true;
+}
+
+/*
+ * Compares the results against the baseline JSON written by write_json() to
+ * [filename]. Returns the number of benchmarks slower than the baseline by
+ * more than [threshold] percent, or -1 if the baseline cannot be read.
+ */
+static int32_t
+compare_baseline(const char *filename, double threshold)
+{
+   FILE *file = fopen(filename, "r");
+   char line[256], name[64];
+   double nsop;
+   int32_t regressions = 0;
+
+   if (!file)
+      return -1;
+
+   printf("\n%-24s %12s %12s %8s\n", "benchmark", "baseline", "current",
+      "delta");
+   while (fgets(line, sizeof line, file)) {
+      if (sscanf(line, " { \"name\": \"%63[^\"]\", \"ns_per_op\": %lf", name,
+         &nsop) != 2)
+         continue;
+      for (int32_t i = 0; i < nresults; ++i) {
+         double delta;
+         if (strcmp(results[i].name, name) != 0)
+            continue;
+         delta = (results[i].nsop - nsop) * 100 / nsop;
+         regressions += delta > threshold;
+         printf("%-24s %12.2f %12.2f %+7.1f%%%s\n", name, nsop,
+            results[i].nsop, delta, delta > threshold ? "  REGRESSION" : "");
+      }
+   }
+   fclose(file);
+   return regressions;
+}
+
+static void
+usage(void)
+{
+   printf("usage: kojibench [--json <file>] [--baseline <file>] "
+          "[--threshold <percent>] [<filter>]\n");
+}
+
+int32_t main(int32_t argc, char **argv)
+{
+   const char *json = NULL, *baseline = NULL;
+   double threshold = 10;
+
+   for (int32_t i = 1; i < argc; ++i) {
+      if (strcmp(argv[i], "--json") == 0 && i + 1 < argc)
+         json = argv[++i];
+      else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc)
+         baseline = argv[++i];
+      else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc)
+         threshold = atof(argv[++i]);
+      else if (argv[i][0] != '-')
+         filter = argv[i];
+      else
+         return usage(), 1;
+   }
+
+#define DIR "../bench/"
+   /* scripts */
+   bench_dispatch(DIR, "dispatch.kj", 2000000);
+   bench_script(DIR, "arith.kj", 2000);
+   bench_script(DIR, "booleans.kj", 2000000);
+   bench_script(DIR, "fields.kj", 1000000);
+   bench_script(DIR, "tables.kj", 5000);
+   bench_script(DIR, "strings.kj", 5000);
+   bench_script(DIR, "concat.kj", 100);
+   bench_script_slab(DIR, "tables.kj", 5000);
+   bench_script_slab(DIR, "strings.kj", 5000);
+   bench_script_slab(DIR, "concat.kj", 100);
+   bench_script(DIR, "globals.kj", 1000000);
+   bench_script(DIR, "calls.kj", 10000);
+   bench_script(DIR, "tailcalls.kj", 10000);
+   bench_script(DIR, "moves.kj", 20000);
+
+   /* runtime building blocks */
+   {
+      koji_state_t *state = koji_open(NULL);
+      bench_table_set(&state->vm, "table_set", 7, 5000);
+      bench_table_set(&state->vm, "table_set_array", 1, 5000);
+      bench_table_get_num(&state->vm, "table_get_num", 7, 10000);
+      bench_table_get_num(&state->vm, "table_get_array", 1, 10000);
+      bench_table_get_str(&state->vm, 10000);
+      bench_table_churn(&state->vm, "table_churn", 0.5, 1000, 4000000);
+      bench_table_churn(&state->vm, "table_churn_int", 0, 1000, 4000000);
+      bench_collect(&state->vm, 20);
+      koji_close(state);
+   }
+   {
+      struct slab slab;
+      struct koji_allocator alloc;
+      slab_init(&slab, default_alloc());
+      alloc = slab_allocator(&slab);
+      bench_alloc(default_alloc(), "alloc_default", 20000000);
+      bench_alloc(&alloc, "alloc_slab", 20000000);
+      slab_deinit(&slab);
+   }
+   bench_murmur2(8, 20000000);
+   bench_murmur2(64, 10000000);
+   bench_lex_scan(DIR "dispatch.kj", 20000);
+#undef DIR
+
+   if (json && !write_json(json)) {
+      printf("cannot write file '%s'.\n", json);
+      return 1;
+   }
+
+   if (baseline) {
+      int32_t regressions = compare_baseline(baseline, threshold);
+      if (regressions < 0) {
+         printf("cannot read baseline '%s'.\n", baseline);
+         return 1;
+      }
+      if (regressions > 0) {
+         printf("\n%d benchmark(s) regressed more than %.1f%%.\n", regressions,
+            threshold);
+         return 1;
+      }
+   }
+   return 0;
+}
@@ -10,6 +10,7 @@
 #include "kbytecode.h"
 #include "kvalue.h"
 #include "kstring.h"
+#include "kjit.h"
 
 #include <string.h>
 #include <stdio.h>
@@ -34,10 +35,19 @@ static const enum op_format OP_FORMATS[] = {
    OP_FORMAT_A_B_C, /* OP_DIV */
    OP_FORMAT_A_B_C, /* OP_MOD */
    OP_FORMAT_A_B_C, /* OP_POW */
+   OP_FORMAT_A_B_C, /* OP_ADDK */
+   OP_FORMAT_A_B_C, /* OP_SUBK */
+   OP_FORMAT_A_B_C, /* OP_MULK */
+   OP_FORMAT_A_B_C, /* OP_DIVK */
+   OP_FORMAT_A_B_C, /* OP_MODK */
+   OP_FORMAT_A_B_C, /* OP_KADD */
+   OP_FORMAT_A_B_C, /* OP_KSUB */
+   OP_FORMAT_A_B_C, /* OP_KMUL */
+   OP_FORMAT_A_B_C, /* OP_KDIV */
+   OP_FORMAT_A_B_C, /* OP_KMOD */
    OP_FORMAT_A_B_C, /* OP_TESTSET */
    OP_FORMAT_A_BX, /* OP_CLOSURE */
    OP_FORMAT_A_BX, /* OP_GETGLOB */
-   OP_FORMAT_A_BX, /* OP_SETGLOB */
    OP_FORMAT_A_BX, /* OP_NEWTABLE */
    OP_FORMAT_A_B_C, /* OP_GET */
    OP_FORMAT_UNKNOWN, /* OP_THIS */
@@ -47,7 +57,9 @@ static const enum op_format OP_FORMATS[] = {
    OP_FORMAT_A_B_C, /* OP_LT */
    OP_FORMAT_A_B_C, /* OP_LTE */
    OP_FORMAT_A_B_C, /* OP_CALL */
-   OP_FORMAT_UNKNOWN, /* OP_MCALL */
+   OP_FORMAT_A_B_C, /* OP_MCALL */
+   OP_FORMAT_A_B_C, /* OP_TAILCALL */
+   OP_FORMAT_A_BX, /* OP_SETGLOB */
    OP_FORMAT_A_B_C, /* OP_SET */
    OP_FORMAT_A_B,  /* OP_RET */
    OP_FORMAT_A_BX, /* OP_THROW */
@@ -58,22 +70,231 @@ kintern struct prototype *
 prototype_new(int32_t nconsts, int32_t ninstrs, int32_t nprotos,
    struct koji_allocator *alloc)
 {
-   int instrs_offs = sizeof(struct prototype) + sizeof(union value) * nconsts;
-   int protos_offs = instrs_offs + sizeof(instr_t) * ninstrs;
-   int size = protos_offs;
+   /* child prototype pointers come before the instructions to keep them
+      aligned */
+   int protos_offs = sizeof(struct prototype) + sizeof(union value) * nconsts;
+   int instrs_offs = protos_offs + sizeof(struct prototype *) * nprotos;
+   int size = instrs_offs + sizeof(instr_t) * ninstrs;
    assert(size <= UINT16_MAX);
 
-   struct prototype *proto = alloc->alloc(size, &alloc->alloc);
+   struct prototype *proto = alloc->alloc(size, alloc->user);
    proto->refs = 1;
    proto->size = (uint16_t)size;
    proto->ninstrs = ninstrs;
    proto->nconsts = nconsts;
    proto->nprotos = nprotos;
    proto->instrs = (void *)((char *)proto + instrs_offs);
+   proto->code = NULL;
+   proto->caches = NULL;
    proto->protos = (void *)((char *)proto + protos_offs);
+   proto->source = value_nil();
+   proto->line = 0;
+   proto->nlines = 0;
+   proto->lines = NULL;
+   proto->aot = NULL;
+#ifdef KOJI_JIT
+   proto->hotness = 0;
+   proto->jit = NULL;
+#endif
+#ifdef KOJI_OPCOUNT
+   proto->counts = NULL;
+#endif
+#ifdef KOJI_PROFILER
+   proto->profiled = false;
+#endif
+#ifdef KOJI_GC
+   proto->gcepoch = 0;
+#endif
    return proto;
 }
 
+kintern int32_t
+prototype_line(struct prototype const *proto, int32_t pc)
+{
+   /* find the last entry starting at or before [pc] */
+   int32_t lo = 0, hi = proto->nlines;
+   while (hi - lo > 1) {
+      int32_t mid = (lo + hi) / 2;
+      if (proto->lines[mid].pc <= pc)
+         lo = mid;
+      else
+         hi = mid;
+   }
+   return lo < hi ? proto->lines[lo].line : 0;
+}
+
+/*
+ * Splits location [loc] into the index returned and the base selector written
+ * to [base].
+ */
+static int32_t
+decode_loc(int32_t loc, uint8_t *base)
+{
+   *base = loc < 0;
+   return loc < 0 ? -loc - 1 : loc;
+}
+
+kintern void
+prototype_decode(struct prototype *proto, struct koji_allocator *alloc)
+{
+   if (proto->code)
+      return;
+
+   proto->code = kalloc(struct decoded_instr, proto->ninstrs, alloc);
+   bool needs_caches = false;
+
+   for (int32_t i = 0; i < proto->ninstrs; ++i) {
+      instr_t instr = proto->instrs[i];
+      struct decoded_instr *d = proto->code + i;
+      d->op = (uint8_t)decode_op(instr);
+      d->bk = d->ck = d->flag = 0;
+      d->a = decode_A(instr);
+      d->b = decode_B(instr);
+      d->c = decode_C(instr);
+
+      switch (decode_op(instr)) {
+         /* A, Bx with Bx a location */
+         case OP_MOV:
+         case OP_NEG:
+         case OP_UNM:
+         case OP_GETGLOB:
+         case OP_SETGLOB:
+         case OP_THROW:
+            d->b = decode_loc(decode_Bx(instr), &d->bk);
+            break;
+
+         /* A, Bx with Bx a count, flag, index or offset */
+         case OP_LOADNIL:
+         case OP_CLOSURE:
+         case OP_JUMP:
+         case OP_RET:
+         case OP_DEBUG:
+            d->b = decode_Bx(instr);
+            break;
+
+         /* A, B, C with both B and C locations */
+         case OP_ADD:
+         case OP_SUB:
+         case OP_MUL:
+         case OP_DIV:
+         case OP_MOD:
+         case OP_POW:
+            d->b = decode_loc(decode_B(instr), &d->bk);
+            d->c = decode_loc(decode_C(instr), &d->ck);
+            break;
+
+         /* A, B, C with B a register and C a number constant; if A is B
+            then the target is known to hold a number when the operation
+            takes the fast path */
+         case OP_ADDK:
+         case OP_SUBK:
+         case OP_MULK:
+         case OP_DIVK:
+         case OP_MODK:
+            d->b = decode_loc(decode_B(instr), &d->bk);
+            d->c = decode_loc(decode_C(instr), &d->ck);
+            assert(!d->bk && d->ck);
+            d->flag = d->a == d->b;
+            break;
+
+         /* A, B, C with B a number constant and C a register, same as above
+            with A matching C */
+         case OP_KADD:
+         case OP_KSUB:
+         case OP_KMUL:
+         case OP_KDIV:
+         case OP_KMOD:
+            d->b = decode_loc(decode_B(instr), &d->bk);
+            d->c = decode_loc(decode_C(instr), &d->ck);
+            assert(d->bk && !d->ck);
+            d->flag = d->a == d->c;
+            break;
+
+         /* test A, Bx fused with the following jump */
+         case OP_TEST:
+            assert(decode_op(proto->instrs[i + 1]) == OP_JUMP);
+            d->flag = (uint8_t)decode_Bx(instr);
+            d->b = 0;
+            d->c = decode_Bx(proto->instrs[i + 1]) + 1;
+            break;
+
+         /* A, B, C with B a location fused with the following jump */
+         case OP_TESTSET:
+         case OP_EQ:
+         case OP_LT:
+         case OP_LTE:
+            assert(decode_op(proto->instrs[i + 1]) == OP_JUMP);
+            d->b = decode_loc(decode_B(instr), &d->bk);
+            d->flag = (uint8_t)decode_C(instr);
+            d->c = decode_Bx(proto->instrs[i + 1]) + 1;
+            break;
+
+         /* A, B, C with C a location */
+         case OP_CALL:
+         case OP_TAILCALL:
+            d->c = decode_loc(decode_C(instr), &d->ck);
+            break;
+
+         /* A, B, C with B a location */
+         case OP_MCALL:
+            d->b = decode_loc(decode_B(instr), &d->bk);
+            break;
+
+         /* A, B, C with both B and C locations, quickened by the VM if the
+            key is a constant */
+         case OP_GET:
+            d->b = decode_loc(decode_B(instr), &d->bk);
+            d->c = decode_loc(decode_C(instr), &d->ck);
+            needs_caches |= d->ck && const_isstring(proto->consts[d->c]);
+            break;
+
+         case OP_SET:
+            d->b = decode_loc(decode_B(instr), &d->bk);
+            d->c = decode_loc(decode_C(instr), &d->ck);
+            needs_caches |= d->bk && const_isstring(proto->consts[d->b]);
+            break;
+
+         default:
+            break;
+      }
+   }
+
+   /* the inline caches of quickened instructions, a pair index is always
+      validated before use so any initial one will do */
+   if (needs_caches) {
+      proto->caches = kalloc(struct inline_cache, proto->ninstrs, alloc);
+      for (int32_t i = 0; i < proto->ninstrs; ++i) {
+         proto->caches[i].shape = NULL;
+         proto->caches[i].slot = 0;
+      }
+   }
+}
+
+kintern uint64_t
+prototype_hash(struct prototype const *proto)
+{
+   uint64_t header[] = { proto->nargs, proto->nregs, proto->nconsts,
+      proto->nprotos };
+   uint64_t hash = murmur2(header, sizeof header, 0);
+   hash = murmur2(proto->instrs, proto->ninstrs * sizeof(instr_t), hash);
+
+   /* strings by content, anything else by value */
+   for (int32_t i = 0; i < proto->nconsts; ++i) {
+      union value k = proto->consts[i];
+      if (value_isobj(k)) {
+         struct string *str = value_getobjv(k);
+         hash = murmur2(str->chars, str->len, hash);
+      }
+      else {
+         hash = murmur2(&k.bits, sizeof k.bits, hash);
+      }
+   }
+
+   for (int32_t i = 0; i < proto->nprotos; ++i)
+      hash = mix64(hash ^ prototype_hash(proto->protos[i]));
+   return hash;
+}
+
 kintern void
 prototype_release(struct prototype *proto, struct koji_allocator *alloc)
 {
@@ -86,7 +307,23 @@ prototype_release(struct prototype *proto, struct koji_allocator *alloc)
       for (int32_t i = 0, n = proto->nconsts; i < n; ++i)
          const_destroy(proto->consts[i], alloc);
 
-      alloc->free(proto, proto->size, alloc);
+      const_destroy(proto->source, alloc);
+      if (proto->lines)
+         kfree(proto->lines, proto->nlines, alloc);
+      if (proto->code)
+         kfree(proto->code, proto->ninstrs, alloc);
+      if (proto->caches)
+         kfree(proto->caches, proto->ninstrs, alloc);
+#ifdef KOJI_JIT
+      if (proto->jit)
+         jit_release(proto->jit, alloc);
+#endif
+#ifdef KOJI_OPCOUNT
+      if (proto->counts)
+         kfree(proto->counts, proto->ninstrs, alloc);
+#endif
+
+      alloc->free(proto, proto->size, alloc->user);
    }
 }
 
@@ -154,9 +391,8 @@ prototype_dump(struct prototype const *proto, int32_t index, int32_t level)
          if (value_isnum(cnst)) {
             printf("%f", cnst.num);
          }
-         else if (value_isobj(cnst)) {
-            struct string *str = value_getobjv(cnst);
-            printf("\"%s\"", &str->chars);
+         else if (const_isstring(cnst)) {
+            printf("\"%s\"", value_string_chars(&cnst));
          }
       }
 
@@ -14,7 +14,8 @@
 
 /*
  * Enumeration that lists all Virtual Machine opcodes
- * Note: If this list is modified, update opcode formats in 'bytecode.c' too.
+ * Note: If this list is modified, update opcode formats in 'bytecode.c' and
+ * the dispatch table in 'kvm.c' too.
  */
 enum opcode {
   /* operations that write into R(A) */
@@ -29,10 +30,20 @@ enum opcode {
    OP_DIV,      /* div A, B, C      ; R(A) = R(B) / R(C) */
    OP_MOD,      /* mod A, B, C      ; R(A) = R(B) % R(C) */
    OP_POW,      /* pow A, B, C      ; R(A) = pow(R(B), R(C)) */
+   OP_ADDK,     /* addk A, B, C     ; R(A) = R(B) + K(C), K(C) a number */
+   OP_SUBK,     /* subk A, B, C     ; R(A) = R(B) - K(C), K(C) a number */
+   OP_MULK,     /* mulk A, B, C     ; R(A) = R(B) * K(C), K(C) a number */
+   OP_DIVK,     /* divk A, B, C     ; R(A) = R(B) / K(C), K(C) a number */
+   OP_MODK,     /* modk A, B, C     ; R(A) = R(B) % K(C), K(C) a number */
+   OP_KADD,     /* kadd A, B, C     ; R(A) = K(B) + R(C), K(B) a number */
+   OP_KSUB,     /* ksub A, B, C     ; R(A) = K(B) - R(C), K(B) a number */
+   OP_KMUL,     /* kmul A, B, C     ; R(A) = K(B) * R(C), K(B) a number */
+   OP_KDIV,     /* kdiv A, B, C     ; R(A) = K(B) / R(C), K(B) a number */
+   OP_KMOD,     /* kmod A, B, C     ; R(A) = K(B) % R(C), K(B) a number */
    OP_TESTSET,  /* testset A, B, C  ; if R(B) == (bool)C then
                                           R(A) = R(B) else jump 1 */
    OP_CLOSURE,  /* closure A, Bx    ; R(A) = closure for prototype Bx */
-   OP_GETGLOB,  /* getglob A, Bx    ; get global val with key R(Bx) into R(A)*/
+   OP_GETGLOB,  /* getglob A, Bx    ; get global val with key K(Bx) into R(A)*/
    OP_NEWTABLE, /* newtable A       ; creates a new table in R(A) */
    OP_GET,      /* get A, B, C      ; R(A) = R(B)[R(C)] */
    OP_THIS,     /* this A           ; R(A) = this */
@@ -47,22 +58,38 @@ enum opcode {
    OP_LTE,      /* lte A, B, C       ; if (R(A) <= R(B)) == (bool)C
                                           then nothing else jump 1 */
    OP_CALL,     /* call A, B, C      ; call object R(C) with B arguments
-                                          starting at R(A) */
+                                          starting at R(A), result in R(A) */
    OP_MCALL,    /* mcall A, B, C     ; call object R(A - 1) method with name
-                                          R(B) with C arguments from R(A) on */
-   OP_SETGLOB,  /* setglob A, Bx     ; set global val R(A) with key R(Bx) */
+                                          R(B) with C arguments from R(A) on,
+                                          result in R(A) */
+   OP_TAILCALL, /* tailcall A, B, C  ; call like call A, B, C, then return
+                                          the result reusing the current
+                                          frame */
+   OP_SETGLOB,  /* setglob A, Bx     ; set global val R(A) with key K(Bx) */
    OP_SET,      /* set A, B, C       ; R(A)[R(B)] = R(C) */
    OP_RET,      /* ret A, B          ; return values R(A), ..., R(B)*/
    OP_THROW,    /* throw A           ; throws an error with R(A) msg string */
    OP_DEBUG,    /* debug A, Bx       ; (temp) prints Bx registers from R(A) */
+
+   /* decoded only operations: never emitted by the compiler, the VM rewrites
+      decoded instructions to these. Table accesses are quickened after their
+      first execution, global accesses resolved on prototype decoding */
+   OP_TGETK,    /* tgetk A, B, C     ; R(A) = R(B)[K(C)], K(C) a string */
+   OP_TSETK,    /* tsetk A, B, C     ; R(A)[K(B)] = R(C), K(B) a string */
+   OP_GETGSLOT, /* getgslot A, Bx    ; R(A) = global value at slot Bx */
+   OP_SETGSLOT, /* setgslot A, Bx    ; global value at slot Bx = R(A) */
+   OP_JIT,      /* jit               ; runs native code from this instruction */
 };
 
 static const char *OP_STRINGS[] = {
     "loadnil",  "loadbool", "mov",   "neg",   "unm",     "add",     "sub",
-    "mul",      "div",      "mod",   "pow",   "testset", "closure", "getglob",
-    "newtable", "get",   "this",  "test",    "jump",    "eq",      "lt",
-    "lte",      "call",  "mcall", "setglob", "set",     "ret",     "throw",
-    "debug",
+    "mul",      "div",      "mod",   "pow",   "addk",    "subk",    "mulk",
+    "divk",     "modk",     "kadd",  "ksub",  "kmul",    "kdiv",    "kmod",
+    "testset",  "closure",  "getglob", "newtable", "get", "this",   "test",
+    "jump",     "eq",       "lt",    "lte",   "call",    "mcall",   "tailcall",
+    "setglob",
+    "set",      "ret",      "throw", "debug", "tgetk",   "tsetk",   "getgslot",
+    "setgslot", "jit",
 };
 
 /* Type of a single instruction, always a 32bit long */
@@ -177,10 +204,73 @@ replace_C(instr_t *i, int32_t C)
    *i = (*i & 0x7FFFFF) | (C << 23);
 }
 
+/*
+ * A pre-decoded instruction. Packed [instr_t]s remain the canonical form
+ * produced by the compiler, but the VM executes this form instead: fields are
+ * plain integers so the interpreter loop does no shifting, masking or sign
+ * testing. Operands that may reference either a register or a constant (the
+ * negative locations) are split into a non-negative index [b] or [c] and a
+ * base selector [bk] or [ck] which is 0 for the frame registers and 1 for the
+ * prototype constants. Arguments that are not locations (counts, flags and
+ * jump offsets) are stored verbatim.
+ * Tests and comparisons (test, testset, eq, lt and lte) are always followed
+ * by the jump they conditionally take. Decoding fuses the pair: the test
+ * value moves to [flag] and [c] holds the pc increment to apply when the
+ * branch is taken (the jump offset plus one to step over the jump itself), so
+ * the VM never has to fetch the jump.
+ * Table accesses with a constant key (get with K(C), set with K(B)) are
+ * quickened by the VM the first time they find a table: the instruction is
+ * rewritten in place to tgetk or tsetk, which remember in [proto->caches] at
+ * the instruction index where the key was last found: the slot of the key in
+ * the shape of the last table seen in shape mode, or the index of its pair in
+ * the last table seen in dictionary mode.
+ * Global accesses are resolved when the VM decodes a prototype: getglob and
+ * setglob become getgslot and setgslot with [b] the slot of the global.
+ */
+struct decoded_instr {
+   uint8_t op;   /* the opcode */
+   uint8_t bk;   /* base of operand B: 0 registers, 1 constants */
+   uint8_t ck;   /* base of operand C: 0 registers, 1 constants */
+   uint8_t flag; /* test value of tests and comparisons, whether the target
+                    of a numeric constant operation is its register operand */
+   int32_t a;    /* argument A */
+   int32_t b;   /* argument B or Bx */
+   int32_t c;   /* argument C */
+};
+
 /* prototype */
 
+struct vm;
+struct vm_frame;
+struct shape;
+
+/*
+ * Inline cache of a quickened table access. While [shape] matches the one of
+ * a table in shape mode, the key is in [slot] of the table slots, or absent if
+ * it is -1. If [shape] is NULL, [slot] is the pair index of the key in the
+ * last table accessed in dictionary mode and must be validated before use.
+ */
+struct inline_cache {
+   struct shape *shape;
+   int32_t slot;
+};
+
+/*
+ * Signature of the ahead-of-time compiled C function of a prototype. It runs
+ * [frame] from [frame->pc] and returns when the frame returns, or when it
+ * pushes a new frame after saving in [frame->pc] where to resume from.
+ */
+typedef void (*aot_fn_t) (struct vm *vm, struct vm_frame *frame);
+
 /*
+ * An entry of the line table of a prototype: instructions from [pc] up to the
+ * [pc] of the next entry were compiled from source line [line].
  */
+struct lineinfo {
+   int32_t pc;
+   int32_t line;
+};
+
 struct prototype {
    int32_t refs;
    uint16_t size;
@@ -190,7 +280,28 @@ struct prototype {
    uint16_t nconsts;
    uint16_t nprotos;
    instr_t *instrs;
+   struct decoded_instr *code; /* decoded [instrs], built on first execution */
+   struct inline_cache *caches; /* per instruction inline caches, NULL if none
+                                   needed */
    struct prototype **protos;
+   union value source; /* name of the source compiled from, nil if unknown */
+   int32_t line; /* source line of the definition, 0 for the main prototype */
+   int32_t nlines; /* number of entries in [lines] */
+   struct lineinfo *lines; /* line table, one entry per change of line */
+   aot_fn_t aot; /* ahead-of-time compiled function, NULL if interpreted */
+#ifdef KOJI_JIT
+   int32_t hotness; /* number of times the prototype has been entered */
+   struct jit_code *jit; /* native code, NULL until the prototype is hot */
+#endif
+#ifdef KOJI_OPCOUNT
+   uint64_t *counts; /* executions of each instruction, NULL until executed */
+#endif
+#ifdef KOJI_PROFILER
+   bool profiled; /* whether the running profiler holds a reference to it */
+#endif
+#ifdef KOJI_GC
+   uint32_t gcepoch; /* last collector cycle that marked the constants */
+#endif
    union value consts[];
 };
 
@@ -200,6 +311,28 @@ kintern struct prototype *
 prototype_new(int32_t nconsts, int32_t ninstrs, int32_t nprotos,
    struct koji_allocator *alloc);
 
+/*
+ * Returns the source line instruction [pc] of [proto] was compiled from, or 0
+ * if unknown. It only reads [proto] so it is safe to call from a signal
+ * handler.
+ */
+kintern int32_t
+prototype_line(struct prototype const *proto, int32_t pc);
+
+/*
+ * Builds the decoded instruction array [proto->code] from [proto->instrs]
+ * if not built yet.
+ */
+kintern void
+prototype_decode(struct prototype *proto, struct koji_allocator *alloc);
+
+/*
+ * Returns a hash of the bytecode of [proto] and its inner prototypes,
+ * identifying the code ahead-of-time compiled from it.
+ */
+kintern uint64_t
+prototype_hash(struct prototype const *proto);
+
 /*
  */
 kintern void
@@ -103,6 +103,10 @@ class_init_default(struct class *cls, struct class *class_cls,
 	cls->operator[CLASS_OP_HASH] = class_op_hash_default;
 	cls->operator[CLASS_OP_GET] = class_op_invalid;
 	cls->operator[CLASS_OP_SET] = class_op_invalid;
+#ifdef KOJI_GC
+   cls->object.color = GC_BLACK;
+   cls->gc = NULL; /* set by the VM */
+#endif
    ++class_cls->object.refs;
 }
 
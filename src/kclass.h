@@ -12,6 +12,7 @@
 #include "kvalue.h"
 
 struct vm;
+struct gc;
 
 /*
  * Supported class operator enum.
@@ -67,6 +68,9 @@ struct class {
 	const char *name;
 	class_dtor_t dtor;
 	class_op_t operator[CLASS_OP_COUNT_];
+#ifdef KOJI_GC
+   struct gc *gc; /* the collector instances are linked to */
+#endif
 };
 
 /*
@@ -0,0 +1,71 @@
+/*
+ * koji scripting language
+ * 
+ * Copyright (C) 2017 Canio Massimo Tristano
+ * 
+ * This source file is part of the koji scripting language, distributed under
+ * the MIT license. See koji.h for further licensing information.
+ */
+
+#include "kclosure.h"
+#include "kbytecode.h"
+#include "kvm.h"
+
+kintern union value
+value_new_closure(struct class *cls_closure, struct koji_allocator *alloc,
+   struct prototype *proto)
+{
+   struct closure *closure = kalloc(struct closure, 1, alloc);
+   ++cls_closure->object.refs;
+   closure->object.refs = 1;
+   closure->object.class = cls_closure;
+   closure->proto = proto;
+   ++proto->refs;
+#ifdef KOJI_GC
+   gc_link(cls_closure->gc, &closure->object);
+#endif
+   return value_obj(closure);
+}
+
+static void
+closure_dtor(struct vm *vm, struct object *obj)
+{
+   struct closure *closure = (struct closure *)obj;
+   prototype_release(closure->proto, &vm->alloc);
+   kfree(closure, 1, &vm->alloc);
+}
+
+kintern void
+class_closure_init(struct class *cls_closure, struct class *cls_builtin)
+{
+   class_init_default(cls_closure, cls_builtin, "closure");
+   cls_closure->dtor = closure_dtor;
+}
+
+kintern union value
+value_new_native(struct class *cls_native, struct koji_allocator *alloc,
+   native_fn_t fn)
+{
+   struct native *native = kalloc(struct native, 1, alloc);
+   ++cls_native->object.refs;
+   native->object.refs = 1;
+   native->object.class = cls_native;
+   native->fn = fn;
+#ifdef KOJI_GC
+   gc_link(cls_native->gc, &native->object);
+#endif
+   return value_obj(native);
+}
+
+static void
+native_dtor(struct vm *vm, struct object *obj)
+{
+   kfree((struct native *)obj, 1, &vm->alloc);
+}
+
+kintern void
+class_native_init(struct class *cls_native, struct class *cls_builtin)
+{
+   class_init_default(cls_native, cls_builtin, "native");
+   cls_native->dtor = native_dtor;
+}
@@ -0,0 +1,68 @@
+/*
+ * koji scripting language
+ * 
+ * Copyright (C) 2017 Canio Massimo Tristano
+ * 
+ * This source file is part of the koji scripting language, distributed under
+ * the MIT license. See koji.h for further licensing information.
+ */
+
+#pragma once
+
+#include "kvalue.h"
+#include "kclass.h"
+
+struct prototype;
+
+/*
+ * A koji closure object, i.e. a callable function value instantiated from a
+ * prototype.
+ */
+struct closure {
+   struct object object;
+   struct prototype *proto; /* the prototype this closure executes */
+};
+
+/*
+ * Signature of native functions callable by scripts. [args] points to the
+ * [nargs] call arguments and the function returns the call result.
+ */
+typedef union value (*native_fn_t) (struct vm *vm, union value *args,
+   int32_t nargs);
+
+/*
+ * A koji native function object, i.e. a callable function value implemented
+ * in C.
+ */
+struct native {
+   struct object object;
+   native_fn_t fn; /* the native function */
+};
+
+/*
+ * Creates a new closure object of prototype [proto] and returns it in a value.
+ * The closure holds a reference to [proto].
+ */
+kintern union value
+value_new_closure(struct class *cls_closure, struct koji_allocator *alloc,
+   struct prototype *proto);
+
+/*
+ * Initializes the closure class.
+ */
+kintern void
+class_closure_init(struct class *cls_closure, struct class *cls_builtin);
+
+/*
+ * Creates a new native function object of function [fn] and returns it in a
+ * value.
+ */
+kintern union value
+value_new_native(struct class *cls_native, struct koji_allocator *alloc,
+   native_fn_t fn);
+
+/*
+ * Initializes the native function class.
+ */
+kintern void
+class_native_init(struct class *cls_native, struct class *cls_builtin);
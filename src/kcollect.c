@@ -0,0 +1,391 @@
+/*
+ * koji scripting language - cycle collector
+ *
+ * Copyright (C) 2017 Canio Massimo Tristano
+ *
+ * This source file is part of the koji scripting language, distributed under
+ * the MIT license. See koji.h for further licensing information.
+ */
+
+#include "kcollect.h"
+#include "kvm.h"
+
+/*
+ * What collect_children() does with each table referenced by a table.
+ */
+enum collect_op {
+   COLLECT_OP_COUNT, /* add it to the collection, count the reference */
+   COLLECT_OP_UNCOUNT, /* uncount the reference if it is in the collection */
+   COLLECT_OP_LIVE, /* color it live and visit it if gray */
+   COLLECT_OP_UNLINK, /* clear the reference if it is garbage */
+};
+
+static void
+collect_push(struct vm *vm, int32_t index)
+{
+   struct collector *c = &vm->collector;
+   *array_push(&c->stack, &c->nstack, &c->stacklen, &vm->alloc, int32_t, 1) =
+      index;
+}
+
+/*
+ * Adds black table [t] to the running collection, gray and with no reference
+ * counted.
+ */
+static void
+collect_add(struct vm *vm, struct object_table *t)
+{
+   struct collector *c = &vm->collector;
+
+   t->color = COLLECT_GRAY;
+   t->counted = false;
+   t->internal = 0;
+   t->index = c->ntables;
+   *array_push(&c->tables, &c->ntables, &c->tableslen, &vm->alloc,
+      struct object_table *, 1) = t;
+}
+
+/*
+ * Colors gray table [t] live and pushes it to the stack of the tables to
+ * visit.
+ */
+static void
+collect_live(struct vm *vm, struct object_table *t)
+{
+   t->color = COLLECT_LIVE;
+   collect_push(vm, t->index);
+}
+
+/*
+ * Applies [op] to the table [val] points to, if it does.
+ */
+static void
+collect_edge(struct vm *vm, union value *val, enum collect_op op)
+{
+   struct object_table *t;
+
+   if (!value_isobj(*val))
+      return;
+   t = value_getobjv(*val);
+   if (t->object.class != &vm->cls_table)
+      return;
+
+   switch (op) {
+      case COLLECT_OP_COUNT:
+         if (t->color == COLLECT_BLACK)
+            collect_add(vm, t);
+         ++t->internal;
+         break;
+      case COLLECT_OP_UNCOUNT:
+         if (t->color != COLLECT_BLACK)
+            --t->internal;
+         break;
+      case COLLECT_OP_LIVE:
+         if (t->color == COLLECT_GRAY)
+            collect_live(vm, t);
+         break;
+      case COLLECT_OP_UNLINK:
+         if (t->color == COLLECT_GARBAGE)
+            *val = value_nil();
+         break;
+   }
+}
+
+/*
+ * Applies [op] to the keys and values of table [t] that are tables.
+ */
+static void
+collect_children(struct vm *vm, struct object_table *t, enum collect_op op)
+{
+   struct table *tbl = &t->table;
+
+   for (int32_t i = 0; i < tbl->arraysize; ++i)
+      collect_edge(vm, tbl->array + i, op);
+   if (tbl->shape) {
+      for (int32_t i = 0; i < tbl->shape->nkeys; ++i)
+         collect_edge(vm, tbl->slots + i, op);
+   }
+   for (int32_t i = 0; i < tbl->capacity; ++i) {
+      collect_edge(vm, &tbl->pairs[i].key, op);
+      collect_edge(vm, &tbl->pairs[i].value, op);
+   }
+}
+
+/*
+ * Visits the table on top of the stack, coloring live the gray tables it
+ * references. Returns the number of tables visited.
+ */
+static int32_t
+collect_propagate(struct vm *vm)
+{
+   struct collector *c = &vm->collector;
+   struct object_table *t = c->tables[c->stack[--c->nstack]];
+
+   /* tables freed since they were pushed are left NULL */
+   if (!t)
+      return 0;
+   collect_children(vm, t, COLLECT_OP_LIVE);
+   return 1;
+}
+
+/*
+ * Checks again the tables listed, all at once as the VM may have taken
+ * references to them since they were scanned: those referenced from outside
+ * the collection and what they reach are live, the rest is garbage and is
+ * moved out of the tables of the collection. Returns the number of tables
+ * visited.
+ */
+static int32_t
+collect_verify(struct vm *vm)
+{
+   struct collector *c = &vm->collector;
+   int32_t visited = 0;
+
+   for (int32_t i = 0; i < c->nlisted; ++i) {
+      struct object_table *t = c->tables[c->listed[i]];
+      ++visited;
+      if (!t || t->color != COLLECT_GRAY)
+         continue;
+      assert(t->object.refs >= t->internal);
+      if (t->object.refs > t->internal) {
+         collect_live(vm, t);
+         while (c->nstack > 0)
+            visited += collect_propagate(vm);
+      }
+   }
+
+   for (int32_t i = 0; i < c->nlisted; ++i) {
+      struct object_table *t = c->tables[c->listed[i]];
+      if (!t || t->color != COLLECT_GRAY)
+         continue;
+      t->color = COLLECT_GARBAGE;
+      c->tables[t->index] = NULL;
+      *array_push(&c->garbage, &c->ngarbage, &c->garbagelen, &vm->alloc,
+         struct object_table *, 1) = t;
+   }
+   c->nlisted = 0;
+   return visited;
+}
+
+/*
+ * Visits the next table for the phase of the running collection, moving on
+ * to the next phase once it is done. Returns the number of tables visited.
+ */
+static int32_t
+collect_advance(struct vm *vm)
+{
+   struct collector *c = &vm->collector;
+   struct object_table *t;
+
+   switch (c->phase) {
+      case COLLECT_IDLE:
+         /* take the candidates buffered so far */
+         c->phase = COLLECT_MARK;
+         c->ntake = c->nroots;
+         c->cursor = 0;
+         return 0;
+
+      case COLLECT_MARK:
+         /* count the references of the tables added, then take a candidate
+            and add it if it is not in the collection already */
+         if (c->cursor < c->ntables) {
+            t = c->tables[c->cursor++];
+            if (!t || t->counted)
+               return 0;
+            t->counted = true;
+            collect_children(vm, t, COLLECT_OP_COUNT);
+            return 1;
+         }
+         if (c->ntake > 0 && c->nroots > 0) {
+            --c->ntake;
+            t = c->roots[--c->nroots];
+            t->root = -1;
+            if (t->color == COLLECT_BLACK)
+               collect_add(vm, t);
+            return 1;
+         }
+         c->phase = COLLECT_SCAN;
+         c->cursor = 0;
+         return 0;
+
+      case COLLECT_SCAN:
+         /* tables with references not counted are referenced from outside
+            the collection, color live what they reach */
+         if (c->nstack > 0)
+            return collect_propagate(vm);
+         if (c->cursor < c->ntables) {
+            t = c->tables[c->cursor++];
+            if (!t || t->color != COLLECT_GRAY)
+               return 0;
+            assert(t->object.refs >= t->internal);
+            if (t->object.refs > t->internal)
+               collect_live(vm, t);
+            return 1;
+         }
+         c->phase = COLLECT_LIST;
+         c->cursor = 0;
+         return 0;
+
+      case COLLECT_LIST:
+         if (c->cursor < c->ntables) {
+            t = c->tables[c->cursor];
+            if (t && t->color == COLLECT_GRAY)
+               *array_push(&c->listed, &c->nlisted, &c->listedlen,
+                  &vm->alloc, int32_t, 1) = c->cursor;
+            ++c->cursor;
+            return 1;
+         }
+         c->phase = COLLECT_UNLINK;
+         c->cursor = 0;
+         return collect_verify(vm);
+
+      case COLLECT_UNLINK:
+         /* references between garbage tables are counted in [internal] but
+            not by the tables, clear them before destroying the tables */
+         if (c->cursor < c->ngarbage) {
+            collect_children(vm, c->garbage[c->cursor++], COLLECT_OP_UNLINK);
+            return 1;
+         }
+         c->phase = COLLECT_FREE;
+         c->cursor = 0;
+         return 0;
+
+      case COLLECT_FREE:
+         /* destroy each table like any other, releasing what else it
+            references */
+         if (c->cursor < c->ngarbage) {
+            t = c->garbage[c->cursor++];
+            t->color = COLLECT_BLACK;
+            t->counted = false;
+            t->object.refs = 1;
+            vm_object_unref(vm, &t->object);
+            ++c->nfreed;
+            return 1;
+         }
+         c->ngarbage = 0;
+         c->phase = COLLECT_RESET;
+         c->cursor = 0;
+         return 0;
+
+      case COLLECT_RESET:
+         if (c->cursor < c->ntables) {
+            t = c->tables[c->cursor++];
+            if (!t)
+               return 0;
+            t->color = COLLECT_BLACK;
+            t->counted = false;
+            return 1;
+         }
+         c->ntables = 0;
+         c->phase = COLLECT_IDLE;
+         return 0;
+   }
+   return 0;
+}
+
+kintern void
+collector_init(struct collector *c)
+{
+   c->phase = COLLECT_IDLE;
+   c->roots = NULL;
+   c->nroots = c->rootslen = 0;
+   c->ntake = 0;
+   c->tables = NULL;
+   c->ntables = c->tableslen = 0;
+   c->cursor = 0;
+   c->stack = NULL;
+   c->nstack = c->stacklen = 0;
+   c->listed = NULL;
+   c->nlisted = c->listedlen = 0;
+   c->garbage = NULL;
+   c->ngarbage = c->garbagelen = 0;
+   c->budget = COLLECT_DEFAULT_BUDGET;
+   c->nvisited = 0;
+   c->nfreed = 0;
+}
+
+kintern void
+collector_deinit(struct vm *vm)
+{
+   struct collector *c = &vm->collector;
+
+   for (int32_t i = 0; i < c->nroots; ++i)
+      c->roots[i]->root = -1;
+   for (int32_t i = 0; i < c->ntables; ++i) {
+      if (c->tables[i]) {
+         c->tables[i]->color = COLLECT_BLACK;
+         c->tables[i]->counted = false;
+      }
+   }
+   if (c->roots)
+      kfree(c->roots, c->rootslen, &vm->alloc);
+   if (c->tables)
+      kfree(c->tables, c->tableslen, &vm->alloc);
+   if (c->stack)
+      kfree(c->stack, c->stacklen, &vm->alloc);
+   if (c->listed)
+      kfree(c->listed, c->listedlen, &vm->alloc);
+   if (c->garbage)
+      kfree(c->garbage, c->garbagelen, &vm->alloc);
+   collector_init(c);
+}
+
+kintern void
+collector_candidate(struct vm *vm, struct object_table *t)
+{
+   struct collector *c = &vm->collector;
+
+   if (t->root >= 0)
+      return;
+   t->root = c->nroots;
+   *array_push(&c->roots, &c->nroots, &c->rootslen, &vm->alloc,
+      struct object_table *, 1) = t;
+}
+
+kintern void
+collector_forget(struct vm *vm, struct object_table *t)
+{
+   struct collector *c = &vm->collector;
+   struct object_table *last;
+
+   if (t->counted)
+      collector_uncount(vm, t);
+   if (t->color != COLLECT_BLACK)
+      c->tables[t->index] = NULL;
+
+   if (t->root < 0)
+      return;
+   last = c->roots[--c->nroots];
+   c->roots[t->root] = last;
+   last->root = t->root;
+   t->root = -1;
+}
+
+kintern void
+collector_uncount(struct vm *vm, struct object_table *t)
+{
+   t->counted = false;
+   collect_children(vm, t, COLLECT_OP_UNCOUNT);
+}
+
+kintern int32_t
+collector_step(struct vm *vm, int32_t budget)
+{
+   struct collector *c = &vm->collector;
+   uint64_t nfreed = c->nfreed;
+   int64_t visited = 0;
+   bool ran = false;
+
+   /* a step ends with the collection it runs, a full collection goes on
+      until no candidate is left, freeing garbage buffers the tables it
+      referenced */
+   while (budget <= 0 || visited < budget) {
+      if (c->phase == COLLECT_IDLE && (c->nroots == 0 || (budget > 0 && ran)))
+         break;
+      ran = true;
+      visited += collect_advance(vm);
+   }
+
+   c->nvisited += (uint64_t)visited;
+   return (int32_t)(c->nfreed - nfreed);
+}
@@ -0,0 +1,173 @@
+/*
+ * koji scripting language - cycle collector
+ *
+ * Copyright (C) 2017 Canio Massimo Tristano
+ *
+ * This source file is part of the koji scripting language, distributed under
+ * the MIT license. See koji.h for further licensing information.
+ */
+
+#pragma once
+
+#include "kplatform.h"
+#include "ktable.h"
+
+struct vm;
+
+/*
+ * Minimum number of candidate roots buffered that makes the VM start a
+ * collection when it next creates a table. A collection only starts once
+ * there is a candidate for every COLLECT_RATIO tables alive as well, so that
+ * the tables visited by collections stay proportional to the candidates.
+ */
+#define COLLECT_THRESHOLD 256
+#define COLLECT_RATIO 2
+
+/*
+ * Default number of tables visited by the steps the VM runs, see
+ * [struct collector].
+ */
+#define COLLECT_DEFAULT_BUDGET 1024
+
+/*
+ * Colors of tables during a collection. Tables not in the running collection
+ * are black.
+ */
+enum collect_color {
+   COLLECT_BLACK, /* not in the running collection */
+   COLLECT_GRAY, /* in the collection, not found live yet */
+   COLLECT_LIVE, /* referenced from outside the collection, directly or not */
+   COLLECT_GARBAGE, /* only referenced by garbage, about to be freed */
+};
+
+/*
+ * Phases of a collection, see [struct collector].
+ */
+enum collect_phase {
+   COLLECT_IDLE, /* no collection running */
+   COLLECT_MARK, /* taking candidates and counting references */
+   COLLECT_SCAN, /* finding the tables referenced from outside */
+   COLLECT_LIST, /* listing the tables not found live */
+   COLLECT_UNLINK, /* clearing the references between garbage tables */
+   COLLECT_FREE, /* freeing the garbage */
+   COLLECT_RESET, /* coloring the tables of the collection black again */
+};
+
+/*
+ * A trial deletion cycle collector of tables (after Bacon and Rajan,
+ * "Concurrent cycle collection in reference counted systems"). Tables whose
+ * count is decremented to non-zero are buffered as candidate roots of a
+ * garbage cycle. A collection takes the candidates buffered when it starts
+ * and runs in steps of a budget of tables visited, the VM running between
+ * them:
+ * - mark: the tables reachable from the candidates join the collection and
+ *   the references each holds to tables of the collection are counted in
+ *   their [internal] count, their own count is left untouched;
+ * - scan: tables whose count exceeds [internal] are referenced from outside
+ *   the collection, they and the tables they reach are live;
+ * - list: the tables not found live are listed. A single step then checks
+ *   them again, as the VM may have taken references to them since they were
+ *   scanned, and the ones still only referenced by each other are garbage;
+ * - unlink and free: the garbage clears its references to other garbage, then
+ *   each table is destroyed like any other, releasing what else it references;
+ * - reset: the tables left are colored black.
+ * The VM changes the references held by tables of the collection by storing
+ * into them, which calls collector_barrier() first, and by destroying them,
+ * which calls collector_forget(): the references of the table are then no
+ * longer counted, making what it references look referenced from outside,
+ * which is conservative. Steps thus visit about their budget of tables, but
+ * for the check of the tables listed, which takes time proportional to the
+ * garbage found and what it references, as freeing it would. Collections
+ * start once the candidates buffered are a fraction of the tables alive, see
+ * collector_due(), so that the tables they visit, live ones included, stay
+ * proportional to the candidates taken.
+ */
+struct collector {
+   enum collect_phase phase; /* phase of the running collection */
+   struct object_table **roots; /* buffered candidate roots */
+   int32_t nroots; /* number of buffered candidates */
+   int32_t rootslen; /* capacity of the [roots] array */
+   int32_t ntake; /* candidates still to take by the running collection */
+   struct object_table **tables; /* tables of the collection, NULL if freed */
+   int32_t ntables; /* number of tables of the collection */
+   int32_t tableslen; /* capacity of the [tables] array */
+   int32_t cursor; /* index of the next table visited by the phase */
+   int32_t *stack; /* indices of the tables left to visit */
+   int32_t nstack; /* number of tables left to visit */
+   int32_t stacklen; /* capacity of the [stack] array */
+   int32_t *listed; /* indices of the tables not found live by the scan */
+   int32_t nlisted; /* number of tables listed */
+   int32_t listedlen; /* capacity of the [listed] array */
+   struct object_table **garbage; /* garbage found by the collection */
+   int32_t ngarbage; /* number of garbage tables */
+   int32_t garbagelen; /* capacity of the [garbage] array */
+   int32_t budget; /* tables visited by automatic steps, 0 disables them */
+   uint64_t nvisited; /* number of tables visited */
+   uint64_t nfreed; /* number of tables freed */
+};
+
+/*
+ * Initializes [c] empty, with the default budget.
+ */
+kintern void
+collector_init(struct collector *c);
+
+/*
+ * Frees the buffers of the collector of [vm]. Garbage left is not freed, see
+ * collector_step().
+ */
+kintern void
+collector_deinit(struct vm *vm);
+
+/*
+ * Buffers table [t], whose count has just been decremented to non-zero, as a
+ * candidate root of a garbage cycle.
+ */
+kintern void
+collector_candidate(struct vm *vm, struct object_table *t);
+
+/*
+ * Removes table [t], about to be freed, from the candidate buffer and from the
+ * running collection.
+ */
+kintern void
+collector_forget(struct vm *vm, struct object_table *t);
+
+/*
+ * Stops counting the references from table [t] to tables of the running
+ * collection, see collector_barrier().
+ */
+kintern void
+collector_uncount(struct vm *vm, struct object_table *t);
+
+/*
+ * Write barrier, to be called before storing a value into table [t]: the
+ * references [t] holds are no longer counted if they have been.
+ */
+static void
+collector_barrier(struct vm *vm, struct object_table *t)
+{
+   if (t->counted)
+      collector_uncount(vm, t);
+}
+
+/*
+ * Returns whether the VM should run a step of the collector: a collection is
+ * running, or enough candidates are buffered to start one. [ntables] is the
+ * number of tables alive.
+ */
+static bool
+collector_due(struct collector const *c, int32_t ntables)
+{
+   return c->phase != COLLECT_IDLE || (c->nroots >= COLLECT_THRESHOLD &&
+      c->nroots >= ntables / COLLECT_RATIO);
+}
+
+/*
+ * Runs a step of the collector visiting about [budget] tables, starting a
+ * collection if none is running and candidates are buffered. If [budget] is
+ * not positive, collections run to completion until the candidate buffer is
+ * empty. Returns the number of tables freed.
+ */
+kintern int32_t
+collector_step(struct vm *vm, int32_t budget);
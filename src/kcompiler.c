@@ -74,8 +74,13 @@ struct protoinfo {
 struct compiler {
    struct lex lex; /* the lexer used to scan tokens from input source */
    struct class *cls_string; /* string class */
+   struct string_set *strings; /* set string constants are interned in */
    instr_t *instrs;  /* buffer array of prototype instructions */
    int32_t instrs_len; /* capacity of the instrs buffer */
+   int32_t *lines; /* source line of each instruction in [instrs] */
+   int32_t lines_len; /* capacity of the lines buffer */
+   int32_t line; /* line of the last token scanned past */
+   union value source; /* name of the source, shared by all prototypes */
    union value *consts; /* buffer of constants of this prototype */
    int32_t consts_len;   /* capacity of the consts buffer */
    struct prototype **protos; /* array of child prototypes */
@@ -300,6 +305,15 @@ loc_is_const(loc_t l)
    return l < 0;
 }
 
+/*
+ * Returns whether [l] is the location of a number constant.
+ */
+static bool
+loc_is_numconst(struct compiler *c, loc_t l)
+{
+   return loc_is_const(l) && value_isnum(c->consts[c->pi.consts_beg - l - 1]);
+}
+
 /*
  * Returns whether [l] is a temporary location, i.e. neither a constant nor a
  * local.
@@ -471,6 +485,8 @@ peek(struct compiler *c, token_t tok)
 static token_t
 lex(struct compiler *c)
 {
+   /* the lexer location is past the end of the lookahead token */
+   c->line = c->lex.sourceloc.line;
    return lex_scan(&c->lex);
 }
 
@@ -648,12 +664,22 @@ static void
 emit(struct compiler *c, instr_t instr)
 {
    /* if instruction has target, update the current prototype total number of
-      used registers */
-   if (op_has_target(decode_op(instr)))
+      used registers. Calls also write their result to R(A). */
+   enum opcode op = decode_op(instr);
+   if (op_has_target(op) || op == OP_CALL || op == OP_MCALL
+      || op == OP_TAILCALL)
       c->pi.nregs = max_i32(c->pi.nregs, decode_A(instr) + 1);
 
    *array_push(&c->instrs, &c->pi.instrs_end, &c->instrs_len, &c->lex.alloc, loc_t, 1)
       = instr;
+
+   /* record the instruction line, the lines buffer follows the instructions
+      buffer length */
+   if (c->lines_len < c->instrs_len) {
+      c->lines = krealloc(c->lines, c->lines_len, c->instrs_len, &c->lex.alloc);
+      c->lines_len = c->instrs_len;
+   }
+   c->lines[c->pi.instrs_end - 1] = c->line;
 }
 
 /*
@@ -727,19 +753,19 @@ const_fetch_num(struct compiler *c, loc_t target_hint, koji_number_t num)
    union value value = value_num(num);
    int32_t constidx;
 
-   for (int32_t i = 0; i < c->pi.consts_end; ++i) {
+   for (int32_t i = c->pi.consts_beg; i < c->pi.consts_end; ++i) {
       if (c->consts[i].bits == value.bits) {
-         constidx = i; /* constant already existent */
+         constidx = i - c->pi.consts_beg; /* constant already existent */
          goto done;
       }
    }
 
    /* constant not found, add it */
-   union value *cnst = array_seq_push(&c->consts, &c->pi.consts_end,
-      &c->lex.alloc, union value, 1);
+   union value *cnst = array_push(&c->consts, &c->pi.consts_end,
+      &c->consts_len, &c->lex.alloc, union value, 1);
    
    *cnst = value;
-   constidx = (int32_t)(cnst - c->consts);
+   constidx = (int32_t)(cnst - c->consts) - c->pi.consts_beg;
 
 done:
    return expr_const(c, target_hint, constidx);
@@ -756,36 +782,30 @@ const_fetch_str(struct compiler *c, loc_t target_hint, const char *chars,
    union value *cnst;
    int32_t constidx;
 
-   for (int32_t i = 0; i < c->pi.consts_end; ++i) {
+   for (int32_t i = c->pi.consts_beg; i < c->pi.consts_end; ++i) {
       cnst = c->consts + i;
 
       /* is i-th cnst a string and do the strings match? if so, no need to
          add a new constant */
-      if (!value_isobj(*cnst))
-         continue;
-
-      struct string *string = value_getobjv(*cnst);
-      if (string->object.class != c->cls_string)
+      if (!const_isstring(*cnst))
          continue;
 
-      if (string->len == len && memcmp(string->chars, chars, len) == 0) {
-         constidx = i;
+      if (value_string_len(*cnst) == len
+          && memcmp(value_string_chars(cnst), chars, len) == 0) {
+         constidx = i - c->pi.consts_beg;
          goto done;
       }
    }
 
    /* cnst not found, push the new cnst to the array */
-   cnst = array_seq_push(&c->consts, &c->pi.consts_end, &c->lex.alloc, union value,
-                         1);
-
-   /* create a new string */
-   *cnst = value_new_string(c->cls_string, &c->lex.alloc, len);
+   cnst = array_push(&c->consts, &c->pi.consts_end, &c->consts_len,
+      &c->lex.alloc, union value, 1);
 
-   struct string *string = value_getobjv(*cnst);
-   memcpy(string->chars, chars, len + 1);
-   assert(string->chars[len] == 0);
+   /* string constants are interned, so that equal constants of different
+      prototypes are the same string */
+   *cnst = string_intern(c->strings, chars, len);
 
-   constidx = (int32_t)(cnst - c->consts);
+   constidx = (int32_t)(cnst - c->consts) - c->pi.consts_beg;
 
 done:
    return expr_const(c, target_hint, constidx);
@@ -1030,9 +1050,14 @@ expr_compile_binary(struct compiler *c, struct sourceloc op_sloc,
       }
       else {
          /* the binary operation is not a comparison but an arithmetic
-            operation, emit the appropriate instruction */
-         emit(c, encode_ABC(BINOP_TO_OPCODE[op], c->pi.temp, lhs.val.loc,
-            rhs.val.loc));
+            operation, emit the appropriate instruction, choosing the variant
+            specialized for a number constant operand if there is one */
+         enum opcode opcode = BINOP_TO_OPCODE[op];
+         if (loc_is_numconst(c, rhs.val.loc) && !loc_is_const(lhs.val.loc))
+            opcode = OP_ADDK + (opcode - OP_ADD);
+         else if (loc_is_numconst(c, lhs.val.loc) && !loc_is_const(rhs.val.loc))
+            opcode = OP_KADD + (opcode - OP_ADD);
+         emit(c, encode_ABC(opcode, c->pi.temp, lhs.val.loc, rhs.val.loc));
          lhs = expr_loc(c->pi.temp);
       }
 
@@ -1200,19 +1225,16 @@ expr_close(struct compiler *c, struct expr_state *es, struct expr expr,
             setting to this location, we can simply replace the A operand of
             all those instructions to [to] and optimize out the 'move'
             instruction */
-         if (loc_is_temp(c, targetloc)) {
-            /* first check whether last instruction targets old location, if so
-               update it with the new desired location */
-            instr_t *instr = &c->instrs[c->pi.instrs_end - 1];
-            if (op_has_target(decode_op(*instr)) && decode_A(*instr)
-               == targetloc) {
-              /* target matches result expression target register? if so,
-                 replace it with [to] */
-               replace_A(instr, target_hint);
-            }
+         instr_t *instr = &c->instrs[c->pi.instrs_end - 1];
+         if (loc_is_temp(c, targetloc) && op_has_target(decode_op(*instr))
+            && decode_A(*instr) == targetloc) {
+            /* last instruction targets the old location, update it with the
+               new desired location */
+            replace_A(instr, target_hint);
          }
          else {
-            /* we could not optimize out the move instruction, emit it */
+            /* we could not optimize out the move instruction (e.g. the
+               temporary holds a call result), emit it */
             emit(c, encode_ABx(OP_MOV, target_hint, targetloc));
          }
 
@@ -1347,15 +1369,45 @@ scan_id(struct compiler *c, loc_t target_hint)
    return expr;
 }
 
+/*
+ * Builds the line table of [p] from the lines of its instructions, starting
+ * at [c->lines + begin].
+ */
+static void
+build_lines(struct compiler *c, struct prototype *p, int32_t begin)
+{
+   int32_t *lines = c->lines + begin;
+   int32_t n = 0;
+
+   for (int32_t pc = 0; pc < p->ninstrs; ++pc)
+      n += pc == 0 || lines[pc] != lines[pc - 1];
+   if (n == 0)
+      return;
+
+   p->lines = kalloc(struct lineinfo, n, &c->lex.alloc);
+   for (int32_t pc = 0; pc < p->ninstrs; ++pc) {
+      if (pc == 0 || lines[pc] != lines[pc - 1]) {
+         p->lines[p->nlines].pc = pc;
+         p->lines[p->nlines++].line = lines[pc];
+      }
+   }
+}
+
 static void
-push_prototype(struct compiler *c, int32_t nargs, struct protoinfo const *pi)
+push_prototype(struct compiler *c, int32_t nargs, int32_t line,
+   struct protoinfo const *pi)
 {
    int32_t ninstrs = c->pi.instrs_end - c->pi.instrs_beg;
    int32_t nconsts = c->pi.consts_end - c->pi.consts_beg;
    int32_t nprotos = c->pi.protos_end - c->pi.protos_beg;
    struct prototype *p = prototype_new(nconsts, ninstrs, nprotos, &c->lex.alloc);
    p->nargs = nargs;
-   p->nregs = c->pi.nregs;
+   p->line = line;
+   p->source = c->source;
+   if (value_isobj(c->source))
+      ++value_getobj(c->source)->refs;
+   build_lines(c, p, c->pi.instrs_beg);
+   p->nregs = max_i32(c->pi.nregs, nargs); /* args may be left unused */
    memcpy(p->instrs, c->instrs + c->pi.instrs_beg, ninstrs * sizeof(*c->instrs));
    memcpy(p->consts, c->consts + c->pi.consts_beg, nconsts * sizeof(*c->consts));
    memcpy(p->protos, c->protos + c->pi.protos_beg, nprotos * sizeof(*c->protos));
@@ -1374,17 +1426,15 @@ parse_ref_or_call(struct compiler *c, struct expr_state *es)
 
    /* identifier refers to local variable? */
    loc_t temp = c->pi.temp;
-   struct expr val;
+   struct expr val, name = expr_nil();
    struct local *local = local_fetch(c, c->lex.tokstr);
 
    if (local) {
       val = expr_loc(local->loc);
    }
    else {
-      /* then it must be a global */
-      val = const_fetch_str(c, c->pi.temp, c->lex.tokstr, c->lex.tokstrlen);
-      emit(c, encode_ABx(OP_GETGLOB, c->pi.temp, val.val.loc));
-      val = expr_loc(c->pi.temp++);
+      /* then it must be a global, fetch its name but defer the load */
+      name = const_fetch_str(c, c->pi.temp, c->lex.tokstr, c->lex.tokstrlen);
    }
 
    lex(c); /* eat the id */
@@ -1394,7 +1444,8 @@ parse_ref_or_call(struct compiler *c, struct expr_state *es)
       int nargs = 0;
       loc_t firstarg = c->pi.temp;
 
-      /* compile arguments starting from firstarg */
+      /* compile arguments starting from firstarg, the callee frame overlaps
+         them and leaves the result in firstarg */
       if (!accept(c, ')')) {
          do {
             parse_exprto(c, c->pi.temp++, true);
@@ -1403,14 +1454,62 @@ parse_ref_or_call(struct compiler *c, struct expr_state *es)
          expect(c, ')');
       }
 
+      /* load a global callee past the arguments so that the call result
+         lands in the first free temporary */
+      if (!local) {
+         emit(c, encode_ABx(OP_GETGLOB, c->pi.temp, name.val.loc));
+         val = expr_loc(c->pi.temp);
+      }
+
       emit(c, encode_ABC(OP_CALL, firstarg, nargs, val.val.loc));
       val = expr_loc(firstarg);
    }
+   else if (!local) {
+      emit(c, encode_ABx(OP_GETGLOB, c->pi.temp, name.val.loc));
+      val = expr_loc(c->pi.temp);
+   }
 
    c->pi.temp = temp;
    return val;
 }
 
+/*
+ * Parses the arguments of a call to method [key] of object [obj] and compiles
+ * the call. Returns an expression with the location of the result.
+ */
+static struct expr
+compile_method_call(struct compiler *c, struct expr obj, struct expr key)
+{
+   loc_t temp = c->pi.temp;
+   loc_t self = c->pi.temp;
+   int32_t nargs = 0;
+
+   /* the object goes right before the arguments, make sure it doesn't
+      overwrite the key if this was moved to a register */
+   if (!loc_is_const(key.val.loc) && key.val.loc >= self)
+      self = key.val.loc + 1;
+   if (obj.val.loc != self)
+      emit(c, encode_ABx(OP_MOV, self, obj.val.loc));
+   c->pi.temp = self + 1;
+
+   expect(c, '(');
+   if (!accept(c, ')')) {
+      do {
+         parse_exprto(c, c->pi.temp++, true);
+         ++nargs;
+      } while (accept(c, ','));
+      expect(c, ')');
+   }
+
+   emit(c, encode_ABC(OP_MCALL, self + 1, key.val.loc, nargs));
+
+   /* move the result from the first argument register to the first free
+      temporary */
+   c->pi.temp = temp;
+   emit(c, encode_ABx(OP_MOV, temp, self + 1));
+   return expr_loc(temp);
+}
+
 /*
  * Parses and returns a subexpression like "(a + 2)".
  */
@@ -1447,6 +1546,7 @@ static struct expr
 parse_closure(struct compiler *c)
 {
    assert(peek(c, kw_func));
+   int32_t line = c->lex.sourceloc.line;
    lex(c);
 
    /* save current prototype state */
@@ -1475,10 +1575,11 @@ parse_closure(struct compiler *c)
    parse_prototype_body(c);
    expect(c, '}');
 
-   push_prototype(c, nargs, &bak);
+   push_prototype(c, nargs, line, &bak);
 
    /* turn the prototype into a closure at this point */
-   emit(c, encode_ABx(OP_CLOSURE, c->pi.temp, c->pi.protos_end - 1));
+   emit(c, encode_ABx(OP_CLOSURE, c->pi.temp,
+      c->pi.protos_end - c->pi.protos_beg - 1));
    return expr_loc(c->pi.temp);
 }
 
@@ -1621,6 +1722,11 @@ parse_primary_expr(struct compiler *c, struct expr_state *es)
 
             c->pi.temp = temps;
 
+            if (peek(c, '(')) {
+               expr = compile_method_call(c, expr, key);
+               continue;
+            }
+
             emit(c, encode_ABC(OP_GET, c->pi.temp, expr.val.loc, key.val.loc));
 
             expr = expr_loc(c->pi.temp);
@@ -1718,6 +1824,20 @@ parse_binary_expr_rhs(struct compiler *c, struct expr_state *es,
    }
 }
 
+/*
+ * Returns whether the last instruction emitted in the current prototype loads
+ * a global to location [loc].
+ */
+static bool
+last_instr_is_global_load(struct compiler *c, loc_t loc)
+{
+   instr_t instr;
+   if (c->pi.instrs_end == c->pi.instrs_beg)
+      return false;
+   instr = c->instrs[c->pi.instrs_end - 1];
+   return decode_op(instr) == OP_GETGLOB && decode_A(instr) == loc;
+}
+
 /*
  * Parses and returns a subexpression, a sequence of primary expressions
  * separated by binary operators. This function takes an explicit, existing
@@ -1743,6 +1863,15 @@ parse_expr(struct compiler *c, struct expr_state *es)
 
       switch (lhs.type) {
          case EXPR_LOCATION:
+            /* if lhs is a global just loaded to a temporary, replace the load
+               with a store of the rhs to the global */
+            if (last_instr_is_global_load(c, lhs.val.loc)) {
+               instr_t load = c->instrs[--c->pi.instrs_end];
+               parse_exprto(c, lhs.val.loc, true);
+               emit(c, encode_ABx(OP_SETGLOB, lhs.val.loc, decode_Bx(load)));
+               return lhs;
+            }
+
             /* check the location is a valid assignable, i.e. neither a cnst
                nor a temporary */
             if (loc_is_const(lhs.val.loc) || loc_is_temp(c, lhs.val.loc)) {
@@ -1926,6 +2055,23 @@ parse_stmt_return(struct compiler *c)
    assert(peek(c, kw_return));
    lex(c);
    struct expr retval = parse_exprto(c, c->pi.temp, false);
+
+   /* returned values must be in registers */
+   if (loc_is_const(retval.val.loc)) {
+      emit(c, encode_ABx(OP_MOV, c->pi.temp, retval.val.loc));
+      retval = expr_loc(c->pi.temp);
+   }
+
+   /* if the returned value is the result of the call just emitted, make it a
+      tail call. The return is still emitted as other branches of the
+      expression (e.g. `return a || f()`) may jump to it. */
+   if (c->pi.instrs_end > c->pi.instrs_beg) {
+      instr_t *last = &c->instrs[c->pi.instrs_end - 1];
+      if (decode_op(*last) == OP_CALL && decode_A(*last) == retval.val.loc)
+         *last = encode_ABC(OP_TAILCALL, decode_A(*last), decode_B(*last),
+            decode_C(*last));
+   }
+
    emit(c, encode_ABx(OP_RET, retval.val.loc, 1));
    expect_endofstmt(c);
 }
@@ -2046,7 +2192,7 @@ parse_module(struct compiler *c)
    expect(c, tok_eos);
 
    struct protoinfo pi = { 0 };
-   push_prototype(c, 0, &pi);
+   push_prototype(c, 0, 0, &pi);
 }
 
 kintern koji_result_t
@@ -2070,8 +2216,14 @@ compile(struct compile_info *info, struct prototype **proto)
    /* finish setting up compiler state */
    scratch_init(&comp);
    comp.cls_string = info->cls_string;
+   comp.strings = info->strings;
    comp.instrs_len = 512;
    comp.instrs = kalloc(instr_t, comp.instrs_len, &info->alloc);
+   comp.lines_len = comp.instrs_len;
+   comp.lines = kalloc(int32_t, comp.lines_len, &info->alloc);
+   comp.line = 1;
+   comp.source = value_new_stringf(info->cls_string, &info->alloc, "%s",
+      info->source->name);
    comp.consts_len = 256;
    comp.consts = kalloc(union value, comp.consts_len, &info->alloc);
    comp.protos_len = 16;
@@ -2088,6 +2240,10 @@ cleanup:
    for (int32_t i = 0; i < comp.pi.protos_end; ++i)
       prototype_release(comp.protos[i], &info->alloc);
    kfree(comp.instrs, comp.instrs_len, &info->alloc);
+   if (comp.lines)
+      kfree(comp.lines, comp.lines_len, &info->alloc);
+   if (value_isobj(comp.source))
+      const_destroy(comp.source, &info->alloc);
    kfree(comp.consts, comp.consts_len, &info->alloc);
    kfree(comp.protos, comp.protos_len, &info->alloc);
    scratch_deinit(&comp);
@@ -23,6 +23,7 @@ struct compile_info {
    uint8_t *scratch_beg; /* beginning of the scratch memory buffer */
    uint8_t *scratch_end; /* end of the scratch memory buffer */
 	struct class *cls_string; /* pointer to the str class */
+   struct string_set *strings; /* set string constants are interned in */
 };
 
 /*
@@ -0,0 +1,307 @@
+/*
+ * koji scripting language - tracing garbage collector
+ *
+ * Copyright (C) 2017 Canio Massimo Tristano
+ *
+ * This source file is part of the koji scripting language, distributed under
+ * the MIT license. See koji.h for further licensing information.
+ */
+
+#include "kgc.h"
+#include "kvm.h"
+#include "kclosure.h"
+#include "kprofile.h"
+
+#ifdef KOJI_GC
+
+kintern void
+gc_push_gray(struct gc *gc, struct object *obj)
+{
+   obj->color = GC_GRAY;
+   *array_push(&gc->gray, &gc->ngray, &gc->graylen, &gc->alloc,
+      struct object *, 1) = obj;
+}
+
+/*
+ * Marks the object [val] points to, if it does and it has not been reached
+ * yet. Strings that reference no other string are colored black right away.
+ */
+static void
+gc_mark(struct vm *vm, union value val)
+{
+   struct object *obj;
+
+   if (!value_isobj(val))
+      return;
+   obj = value_getobj(val);
+   if (obj->color != vm->gc.white)
+      return;
+   if (obj->class == &vm->cls_string) {
+      struct string *s = (struct string *)obj;
+      if ((s->kind == STRING_ROPE && s->chars) || (s->kind == STRING_SLICE
+          && !((struct slice *)(s + 1))->parent) || s->kind == STRING_FLAT) {
+         obj->color = GC_BLACK;
+         return;
+      }
+   }
+   gc_push_gray(&vm->gc, obj);
+}
+
+/*
+ * Marks the keys and values of table [t].
+ */
+static void
+gc_mark_table(struct vm *vm, struct table *t)
+{
+   for (int32_t i = 0; i < t->arraysize; ++i)
+      gc_mark(vm, t->array[i]);
+   if (t->shape) {
+      for (int32_t i = 0; i < t->shape->nkeys; ++i)
+         gc_mark(vm, t->slots[i]);
+   }
+   for (int32_t i = 0; i < t->capacity; ++i) {
+      gc_mark(vm, t->pairs[i].key);
+      gc_mark(vm, t->pairs[i].value);
+   }
+}
+
+/*
+ * Marks the constants and the source name of [proto] and of its children,
+ * unless already marked by the running cycle.
+ */
+static void
+gc_mark_proto(struct vm *vm, struct prototype *proto)
+{
+   if (proto->gcepoch == vm->gc.epoch)
+      return;
+   proto->gcepoch = vm->gc.epoch;
+   for (int32_t i = 0; i < proto->nconsts; ++i)
+      gc_mark(vm, proto->consts[i]);
+   gc_mark(vm, proto->source);
+   for (int32_t i = 0; i < proto->nprotos; ++i)
+      gc_mark_proto(vm, proto->protos[i]);
+}
+
+/*
+ * Marks the keys of [shape] and of the shapes it transitions to.
+ */
+static void
+gc_mark_shape(struct vm *vm, struct shape *shape)
+{
+   gc_mark(vm, shape->key);
+   for (int32_t i = 0; i < shape->nchildren; ++i)
+      gc_mark_shape(vm, shape->children[i]);
+}
+
+/*
+ * Marks the roots: the value stack, the globals and the prototypes of the
+ * frames, along with the prototypes the VM keeps alive for its counters and
+ * the profiler.
+ */
+static void
+gc_mark_roots(struct vm *vm)
+{
+   for (int32_t i = 0; i < vm->valuesp; ++i)
+      gc_mark(vm, vm->valuestack[i]);
+   for (int32_t i = 0; i < vm->framesp; ++i)
+      gc_mark_proto(vm, vm->framestack[i].proto);
+   gc_mark_table(vm, &vm->globals);
+   for (int32_t i = 0; i < vm->nglobals; ++i)
+      gc_mark(vm, vm->globalvals[i]);
+#ifdef KOJI_OPCOUNT
+   for (int32_t i = 0; i < vm->ncounted; ++i)
+      gc_mark_proto(vm, vm->counted[i]);
+#endif
+#ifdef KOJI_PROFILER
+   if (vm->profiler) {
+      for (int32_t i = 0; i < vm->profiler->nprotos; ++i)
+         gc_mark_proto(vm, vm->profiler->protos[i]);
+   }
+#endif
+}
+
+/*
+ * Colors black gray object [obj], marking the objects it references.
+ */
+static void
+gc_blacken(struct vm *vm, struct object *obj)
+{
+   obj->color = GC_BLACK;
+   if (obj->class == &vm->cls_table) {
+      gc_mark_table(vm, &((struct object_table *)obj)->table);
+   }
+   else if (obj->class == &vm->cls_string) {
+      struct string *s = (struct string *)obj;
+      struct rope *rope = (struct rope *)(s + 1);
+      struct slice *slice = (struct slice *)(s + 1);
+      if (s->kind == STRING_ROPE) {
+         gc_mark(vm, rope->left);
+         gc_mark(vm, rope->right);
+      }
+      else if (s->kind == STRING_SLICE && slice->parent) {
+         gc_mark(vm, value_obj(slice->parent));
+      }
+   }
+   else if (obj->class == &vm->cls_closure) {
+      gc_mark_proto(vm, ((struct closure *)obj)->proto);
+   }
+}
+
+/*
+ * Starts a cycle marking the roots.
+ */
+static void
+gc_start(struct vm *vm)
+{
+   struct gc *gc = &vm->gc;
+   ++gc->epoch;
+   gc->phase = GC_MARK;
+   gc_mark_roots(vm);
+}
+
+/*
+ * Ends the mark phase: marks the roots again along with the shape keys and
+ * everything reachable from them, drops the dead strings from the set of
+ * interned strings and swaps the whites to begin sweeping.
+ */
+static void
+gc_atomic(struct vm *vm)
+{
+   struct gc *gc = &vm->gc;
+
+   gc_mark_roots(vm);
+   gc_mark_shape(vm, &vm->shape_root);
+   while (gc->ngray > 0)
+      gc_blacken(vm, gc->gray[--gc->ngray]);
+
+   string_set_sweep(&vm->strings, gc->white);
+   gc->white ^= 1;
+   gc->phase = GC_SWEEP;
+   gc->sweep = &gc->objects;
+}
+
+/*
+ * Frees or whitens the next [budget] objects of the list, all the remaining
+ * ones if [budget] is not positive, and ends the cycle once at the end of the
+ * list.
+ */
+static void
+gc_sweep(struct vm *vm, int32_t budget)
+{
+   struct gc *gc = &vm->gc;
+   uint8_t dead = gc->white ^ 1;
+
+   for (int32_t n = 0; *gc->sweep && (budget <= 0 || n < budget); ++n) {
+      struct object *obj = *gc->sweep;
+      if (obj->color == dead) {
+         *gc->sweep = obj->gcnext;
+         --gc->nobjects;
+         ++gc->nfreed;
+         obj->class->dtor(vm, obj);
+      }
+      else {
+         obj->color = gc->white;
+         gc->sweep = &obj->gcnext;
+      }
+   }
+
+   if (!*gc->sweep) {
+      gc->phase = GC_PAUSE;
+      gc->sweep = NULL;
+      gc->threshold = max_i32(GC_MIN_THRESHOLD, gc->nobjects * 2);
+   }
+}
+
+/*
+ * Runs a step of [budget] objects marked or swept, starting a cycle if none
+ * is running. A step that empties the gray stack also runs the atomic step
+ * that ends the mark phase. If [budget] is not positive, the step runs the
+ * cycle to its end.
+ */
+static void
+gc_step(struct vm *vm, int32_t budget)
+{
+   struct gc *gc = &vm->gc;
+   int32_t n = 0;
+
+   if (gc->phase == GC_PAUSE)
+      gc_start(vm);
+
+   if (gc->phase == GC_MARK) {
+      for (; gc->ngray > 0 && (budget <= 0 || n < budget); ++n)
+         gc_blacken(vm, gc->gray[--gc->ngray]);
+      if (gc->ngray > 0)
+         return;
+      gc_atomic(vm);
+      if (budget > 0 && n >= budget)
+         return;
+   }
+
+   gc_sweep(vm, budget > 0 ? budget - n : 0);
+}
+
+kintern void
+gc_init(struct gc *gc, struct koji_allocator *alloc)
+{
+   gc->objects = NULL;
+   gc->sweep = NULL;
+   gc->gray = NULL;
+   gc->ngray = gc->graylen = 0;
+   gc->alloc = *alloc;
+   gc->white = GC_WHITE0;
+   gc->phase = GC_PAUSE;
+   gc->epoch = 0;
+   gc->nobjects = 0;
+   gc->threshold = GC_MIN_THRESHOLD;
+   gc->debt = 0;
+   gc->budget = GC_DEFAULT_BUDGET;
+   gc->nfreed = 0;
+}
+
+kintern void
+gc_deinit(struct vm *vm)
+{
+   struct gc *gc = &vm->gc;
+
+   while (gc->objects) {
+      struct object *obj = gc->objects;
+      gc->objects = obj->gcnext;
+      obj->class->dtor(vm, obj);
+   }
+   if (gc->gray)
+      kfree(gc->gray, gc->graylen, &gc->alloc);
+   gc_init(gc, &gc->alloc);
+}
+
+kintern int32_t
+gc_collect(struct vm *vm, int32_t budget)
+{
+   struct gc *gc = &vm->gc;
+   uint64_t nfreed = gc->nfreed;
+
+   if (budget > 0) {
+      gc_step(vm, budget);
+   }
+   else {
+      /* objects that died after the running cycle started are only found
+         by the next one */
+      if (gc->phase != GC_PAUSE)
+         gc_step(vm, 0);
+      gc_step(vm, 0);
+   }
+   return (int32_t)(gc->nfreed - nfreed);
+}
+
+kintern void
+gc_check(struct vm *vm)
+{
+   struct gc *gc = &vm->gc;
+
+   gc->debt = 0;
+   if (gc->budget <= 0
+       || (gc->phase == GC_PAUSE && gc->nobjects < gc->threshold))
+      return;
+   gc_step(vm, gc->budget);
+}
+
+#endif
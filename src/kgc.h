@@ -0,0 +1,147 @@
+/*
+ * koji scripting language - tracing garbage collector
+ *
+ * Copyright (C) 2017 Canio Massimo Tristano
+ *
+ * This source file is part of the koji scripting language, distributed under
+ * the MIT license. See koji.h for further licensing information.
+ */
+
+#pragma once
+
+#include "kplatform.h"
+#include "kvalue.h"
+
+#ifdef KOJI_GC
+
+struct vm;
+
+/*
+ * Number of objects created between two steps of the collector run by the
+ * VM.
+ */
+#define GC_STEP_ALLOCS 256
+
+/*
+ * Default number of objects marked or swept by the steps the VM runs.
+ */
+#define GC_DEFAULT_BUDGET 1024
+
+/*
+ * Minimum number of objects that starts a collection cycle. A cycle starts
+ * when the objects are twice as many as those left by the previous one.
+ */
+#define GC_MIN_THRESHOLD 4096
+
+/*
+ * Object colors. Objects not reached yet by the running cycle have the
+ * current white, the other white is the one of the objects found dead that
+ * the sweep is freeing.
+ */
+enum gc_color {
+   GC_WHITE0,
+   GC_WHITE1,
+   GC_GRAY, /* reached, the objects it references still to mark */
+   GC_BLACK, /* reached along with the objects it references */
+};
+
+/*
+ * Phases of a collection cycle.
+ */
+enum gc_phase {
+   GC_PAUSE, /* no cycle is running */
+   GC_MARK, /* marking the objects reachable from the roots */
+   GC_SWEEP, /* freeing the objects found dead */
+};
+
+/*
+ * An incremental tri-color mark and sweep collector, the memory manager of
+ * VMs built with KOJI_GC defined in place of reference counting: values are
+ * copied around without touching the objects they point to.
+ * Objects are linked in a list as they are created. A cycle colors gray the
+ * roots (the value stack, the globals, the constants of the prototypes of
+ * the frames and closures, the keys of the shapes) then, step by step, marks
+ * black gray objects and gray the objects they reference. As scripts keep
+ * running between steps, a table stored into after being marked black is
+ * colored gray again (write barrier); registers and globals are not guarded
+ * by a barrier and are marked again in the atomic step that ends the mark
+ * phase. The strings interned that have not been reached are then removed
+ * from the set of interned strings, and the whites swapped: the objects
+ * still white are dead and the sweep steps through the list to free them,
+ * whitening the others for the next cycle. Objects created during a cycle
+ * have the current white, which the sweep never frees.
+ */
+struct gc {
+   struct object *objects; /* all objects, the most recent first */
+   struct object **sweep; /* link to the next object to sweep */
+   struct object **gray; /* stack of gray objects */
+   int32_t ngray; /* number of gray objects */
+   int32_t graylen; /* capacity of the [gray] stack */
+   struct koji_allocator alloc; /* allocator of the [gray] stack */
+   uint8_t white; /* the current white */
+   uint8_t phase; /* the cycle phase, a [gc_phase] */
+   uint32_t epoch; /* number of cycles started, marks reached prototypes */
+   int32_t nobjects; /* number of objects in the list */
+   int32_t threshold; /* number of objects that starts a cycle */
+   int32_t debt; /* objects created since the last step */
+   int32_t budget; /* objects marked or swept per step, 0 disables steps */
+   uint64_t nfreed; /* number of objects freed */
+};
+
+/*
+ * Adds new object [obj] to the objects of [gc].
+ */
+static void
+gc_link(struct gc *gc, struct object *obj)
+{
+   assert(gc);
+   obj->color = gc->white;
+   obj->gcnext = gc->objects;
+   gc->objects = obj;
+   ++gc->nobjects;
+   ++gc->debt;
+}
+
+kintern void
+gc_push_gray(struct gc *gc, struct object *obj);
+
+/*
+ * Write barrier, to be called before storing a value into [obj]: colors the
+ * object gray again if it has been marked already.
+ */
+static void
+gc_barrier(struct gc *gc, struct object *obj)
+{
+   if (obj->color == GC_BLACK && gc->phase == GC_MARK)
+      gc_push_gray(gc, obj);
+}
+
+/*
+ * Initializes [gc] with no objects, allocating from [alloc].
+ */
+kintern void
+gc_init(struct gc *gc, struct koji_allocator *alloc);
+
+/*
+ * Frees all the objects of the collector of [vm].
+ */
+kintern void
+gc_deinit(struct vm *vm);
+
+/*
+ * Marks or sweeps about [budget] objects, starting a cycle if none is
+ * running, or runs a full cycle after finishing the one running if [budget]
+ * is not positive. Returns the number of objects freed.
+ */
+kintern int32_t
+gc_collect(struct vm *vm, int32_t budget);
+
+/*
+ * Runs a step of the collector of [vm] if enough objects have been created
+ * since the last one, starting a cycle once the objects reach the threshold.
+ * Must only be called where every object in use is reachable from the roots.
+ */
+kintern void
+gc_check(struct vm *vm);
+
+#endif
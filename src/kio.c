@@ -22,7 +22,7 @@ source_file_read(FILE *file)
 static int32_t
 source_string_read(const char **str)
 {
-   if (*str == 0)
+   if (**str == 0)
       return KOJI_EOF;
    return *(*str)++;
 }
@@ -0,0 +1,564 @@
+/*
+ * koji scripting language
+ *
+ * Copyright (C) 2017 Canio Massimo Tristano
+ *
+ * This source file is part of the koji scripting language, distributed under
+ * the MIT license. See koji.h for further licensing information.
+ */
+
+#include "kjit.h"
+
+#ifdef KOJI_JIT
+
+#include "kvm.h"
+
+#include <string.h>
+#include <sys/mman.h>
+
+/*
+ * A template JIT: each compiled instruction is translated to a fixed sequence
+ * of machine code, stitched one after the other in instruction order. Native
+ * code keeps the register base in rbx, the constant base in r12, the vm in r13
+ * and the NaN box mask in r14 and is entered through a table of per
+ * instruction addresses. Operands are checked to be numbers inline, otherwise
+ * the VM slow path is called so that compiled instructions never bail out.
+ * When control reaches an instruction that is not compiled, native code
+ * returns its pc to the interpreter.
+ */
+
+/* upper bound of the machine code size of the prologue and one instruction */
+#define JIT_MAX_PROLOGUE_SIZE 64
+#define JIT_MAX_INSTR_SIZE 256
+
+/* minimum number of consecutive instructions compiled */
+#define JIT_MIN_RUN 2
+
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14,
+   R15 };
+
+/* the registers pinned by native code */
+#define REGS RBX
+#define CONSTS R12
+#define VM R13
+#define NANMASK R14
+
+/* condition codes of jcc and setcc */
+enum { CC_E = 0x4, CC_NE = 0x5, CC_AE = 0x3, CC_A = 0x7, CC_NP = 0xb };
+
+/* sse2 scalar double operation of each arithmetic operator but mod */
+static const uint8_t SSE_ARITH[] = { 0x58, 0x5c, 0x59, 0x5e };
+
+struct emitter {
+   uint8_t *code;
+   int32_t len;
+};
+
+/*
+ * A jump to the native code of the instruction at [pc], patched once all
+ * instructions are emitted.
+ */
+struct fixup {
+   int32_t at;
+   int32_t pc;
+};
+
+static void
+emit8(struct emitter *e, uint8_t byte)
+{
+   e->code[e->len++] = byte;
+}
+
+static void
+emit32(struct emitter *e, uint32_t u32)
+{
+   memcpy(e->code + e->len, &u32, sizeof u32);
+   e->len += sizeof u32;
+}
+
+static void
+emit64(struct emitter *e, uint64_t u64)
+{
+   memcpy(e->code + e->len, &u64, sizeof u64);
+   e->len += sizeof u64;
+}
+
+static void
+emit_rex(struct emitter *e, bool wide, int32_t reg, int32_t rm)
+{
+   uint8_t rex = 0x40 | wide << 3 | (reg >= R8) << 2 | (rm >= R8);
+   if (rex != 0x40)
+      emit8(e, rex);
+}
+
+/* 64 bit [opcode] between [reg] and memory at [base] + [disp] */
+static void
+emit_mem(struct emitter *e, uint8_t opcode, int32_t reg, int32_t base,
+   int32_t disp)
+{
+   emit_rex(e, true, reg, base);
+   emit8(e, opcode);
+   emit8(e, 0x80 | (reg & 7) << 3 | (base & 7));
+   if ((base & 7) == RSP)
+      emit8(e, 0x24); /* sib byte, no index */
+   emit32(e, disp);
+}
+
+/* 64 bit [opcode] with [dst] the r/m operand and [src] the reg one */
+static void
+emit_rr(struct emitter *e, uint8_t opcode, int32_t dst, int32_t src)
+{
+   emit_rex(e, true, src, dst);
+   emit8(e, opcode);
+   emit8(e, 0xc0 | (src & 7) << 3 | (dst & 7));
+}
+
+/* sse2 [opcode] between xmm or general purpose registers below r8 */
+static void
+emit_sse(struct emitter *e, uint8_t prefix, bool wide, uint8_t opcode,
+   int32_t reg, int32_t rm)
+{
+   emit8(e, prefix);
+   if (wide)
+      emit8(e, 0x48);
+   emit8(e, 0x0f);
+   emit8(e, opcode);
+   emit8(e, 0xc0 | reg << 3 | rm);
+}
+
+static void
+emit_mov_imm32(struct emitter *e, int32_t reg, int32_t imm)
+{
+   emit_rex(e, false, 0, reg);
+   emit8(e, 0xb8 + (reg & 7));
+   emit32(e, imm);
+}
+
+static void
+emit_mov_imm64(struct emitter *e, int32_t reg, uint64_t imm)
+{
+   emit_rex(e, true, 0, reg);
+   emit8(e, 0xb8 + (reg & 7));
+   emit64(e, imm);
+}
+
+/*
+ * Emits a jump with condition [cc] or unconditional if negative. Returns the
+ * offset following the jump, to be passed to patch_jump().
+ */
+static int32_t
+emit_jump(struct emitter *e, int32_t cc)
+{
+   if (cc < 0) {
+      emit8(e, 0xe9);
+   }
+   else {
+      emit8(e, 0x0f);
+      emit8(e, 0x80 | cc);
+   }
+   emit32(e, 0);
+   return e->len;
+}
+
+static void
+patch_jump(struct emitter *e, int32_t at, int32_t target)
+{
+   int32_t rel = target - at;
+   memcpy(e->code + at - 4, &rel, sizeof rel);
+}
+
+/* jumps if the value in [reg] is not a number */
+static int32_t
+emit_jump_ifnotnum(struct emitter *e, int32_t reg)
+{
+   emit_rr(e, 0x89, RCX, reg);     /* mov rcx, reg */
+   emit_rr(e, 0x21, RCX, NANMASK); /* and rcx, r14 */
+   emit_rr(e, 0x39, RCX, NANMASK); /* cmp rcx, r14 */
+   return emit_jump(e, CC_E);
+}
+
+/* jumps if the tag of the value in [reg] is [tag] */
+static int32_t
+emit_jump_iftag(struct emitter *e, int32_t reg, uint64_t tag, int32_t cc)
+{
+   emit_rr(e, 0x89, RCX, reg); /* mov rcx, reg */
+   emit8(e, 0x48);             /* shr rcx, 48 */
+   emit8(e, 0xc1);
+   emit8(e, 0xe9);
+   emit8(e, 48);
+   emit8(e, 0x81);             /* cmp ecx, tag >> 48 */
+   emit8(e, 0xf9);
+   emit32(e, (uint32_t)(tag >> 48));
+   return emit_jump(e, cc);
+}
+
+static void
+emit_call(struct emitter *e, void *fn)
+{
+   emit_mov_imm64(e, RAX, (uint64_t)(uintptr_t)fn);
+   emit8(e, 0xff); /* call rax */
+   emit8(e, 0xd0);
+}
+
+/* calls VM slow path [fn] of instruction [i] compiled from [op] */
+static void
+emit_call_slow(struct emitter *e, void *fn, struct decoded_instr const *i,
+   int32_t op)
+{
+   emit_rr(e, 0x89, RDI, VM);
+   emit_rr(e, 0x89, RSI, REGS);
+   emit_rr(e, 0x89, RDX, CONSTS);
+   emit_mov_imm64(e, RCX, (uint64_t)(uintptr_t)i);
+   emit_mov_imm32(e, R8, op);
+   emit_call(e, fn);
+}
+
+/* loads the value at location [k], [index] into [reg] */
+static void
+emit_load(struct emitter *e, int32_t reg, uint8_t k, int32_t index)
+{
+   emit_mem(e, 0x8b, reg, k ? CONSTS : REGS, index * sizeof(union value));
+}
+
+/* returns whether location [k], [index] is known to hold a number */
+static bool
+is_number(struct prototype const *proto, uint8_t k, int32_t index)
+{
+   return k && value_isnum(proto->consts[index]);
+}
+
+/*
+ * Compiler state of a prototype.
+ */
+struct jit_compiler {
+   struct emitter e;
+   struct prototype *proto;
+   int32_t epilogue; /* offset of the shared epilogue */
+   int32_t *offsets; /* offset of each instruction, -1 if not compiled */
+   struct fixup *fixups;
+   int32_t nfixups;
+};
+
+/* returns control to the interpreter at instruction [pc] */
+static void
+emit_exit(struct jit_compiler *c, int32_t pc)
+{
+   emit_mov_imm32(&c->e, RAX, pc);
+   patch_jump(&c->e, emit_jump(&c->e, -1), c->epilogue);
+}
+
+/* continues execution from instruction [pc] */
+static void
+emit_goto(struct jit_compiler *c, int32_t pc)
+{
+   if (c->offsets[pc] >= 0) {
+      struct fixup *f = c->fixups + c->nfixups++;
+      f->at = emit_jump(&c->e, -1);
+      f->pc = pc;
+   }
+   else {
+      emit_exit(c, pc);
+   }
+}
+
+/* branches to [pc] + 1 + [offset] if eax equals [flag], or skips the fused
+   jump at [pc] + 1 otherwise */
+static void
+emit_branch(struct jit_compiler *c, int32_t pc, int32_t offset, uint8_t flag)
+{
+   struct emitter *e = &c->e;
+   int32_t taken;
+   emit8(e, 0x83); /* cmp eax, flag */
+   emit8(e, 0xf8);
+   emit8(e, flag);
+   taken = emit_jump(e, CC_E);
+   emit_goto(c, pc + 2);
+   patch_jump(e, taken, e->len);
+   emit_goto(c, pc + 1 + offset);
+}
+
+static void
+compile_arith(struct jit_compiler *c, struct decoded_instr const *i, int32_t op)
+{
+   struct emitter *e = &c->e;
+   int32_t kind = op >= OP_KADD ? op - OP_KADD :
+                  op >= OP_ADDK ? op - OP_ADDK : op - OP_ADD;
+   int32_t slow[3], nslow = 0, done;
+
+   emit_load(e, RAX, i->bk, i->b);
+   if (!is_number(c->proto, i->bk, i->b))
+      slow[nslow++] = emit_jump_ifnotnum(e, RAX);
+   emit_load(e, RDX, i->ck, i->c);
+   if (!is_number(c->proto, i->ck, i->c))
+      slow[nslow++] = emit_jump_ifnotnum(e, RDX);
+
+   emit_sse(e, 0x66, true, 0x6e, 0, RAX); /* movq xmm0, rax */
+   emit_sse(e, 0x66, true, 0x6e, 1, RDX); /* movq xmm1, rdx */
+   if (kind == OP_MOD - OP_ADD) {
+      emit_sse(e, 0xf2, true, 0x2c, RAX, 0); /* cvttsd2si rax, xmm0 */
+      emit_sse(e, 0xf2, true, 0x2c, RCX, 1); /* cvttsd2si rcx, xmm1 */
+      emit8(e, 0x48); /* cqo */
+      emit8(e, 0x99);
+      emit8(e, 0x48); /* idiv rcx */
+      emit8(e, 0xf7);
+      emit8(e, 0xf9);
+      emit_sse(e, 0xf2, true, 0x2a, 0, RDX); /* cvtsi2sd xmm0, rdx */
+   }
+   else {
+      emit_sse(e, 0xf2, false, SSE_ARITH[kind], 0, 1);
+   }
+
+   /* an object in the target must be released, leave it to the slow path */
+   if (op < OP_ADDK || !i->flag) {
+      emit_load(e, RCX, 0, i->a);
+      slow[nslow++] = emit_jump_iftag(e, RCX, BITS_TAG_OBJECT, CC_E);
+   }
+   emit_sse(e, 0x66, true, 0x7e, 0, RAX); /* movq rax, xmm0 */
+   emit_mem(e, 0x89, RAX, REGS, i->a * sizeof(union value));
+   done = emit_jump(e, -1);
+
+   for (int32_t s = 0; s < nslow; ++s)
+      patch_jump(e, slow[s], e->len);
+   emit_call_slow(e, (void *)vm_jit_arith, i, op);
+   patch_jump(e, done, e->len);
+}
+
+static void
+compile_compare(struct jit_compiler *c, struct decoded_instr const *i,
+   int32_t pc, int32_t op)
+{
+   struct emitter *e = &c->e;
+   int32_t slow[2], nslow = 0, done;
+
+   emit_load(e, RAX, 0, i->a);
+   slow[nslow++] = emit_jump_ifnotnum(e, RAX);
+   emit_load(e, RDX, i->bk, i->b);
+   if (!is_number(c->proto, i->bk, i->b))
+      slow[nslow++] = emit_jump_ifnotnum(e, RDX);
+
+   emit_sse(e, 0x66, true, 0x6e, 0, RAX); /* movq xmm0, rax */
+   emit_sse(e, 0x66, true, 0x6e, 1, RDX); /* movq xmm1, rdx */
+   if (op == OP_EQ) {
+      /* equal and ordered, NaN never equals */
+      emit_sse(e, 0x66, false, 0x2e, 0, 1); /* ucomisd xmm0, xmm1 */
+      emit8(e, 0x0f); /* sete al */
+      emit8(e, 0x90 | CC_E);
+      emit8(e, 0xc0);
+      emit8(e, 0x0f); /* setnp cl */
+      emit8(e, 0x90 | CC_NP);
+      emit8(e, 0xc1);
+      emit8(e, 0x20); /* and al, cl */
+      emit8(e, 0xc8);
+   }
+   else {
+      /* a < b as b > a (a <= b as b >= a), false if unordered */
+      emit_sse(e, 0x66, false, 0x2e, 1, 0); /* ucomisd xmm1, xmm0 */
+      emit8(e, 0x0f); /* seta al / setae al */
+      emit8(e, 0x90 | (op == OP_LT ? CC_A : CC_AE));
+      emit8(e, 0xc0);
+   }
+   emit8(e, 0x0f); /* movzx eax, al */
+   emit8(e, 0xb6);
+   emit8(e, 0xc0);
+   done = emit_jump(e, -1);
+
+   for (int32_t s = 0; s < nslow; ++s)
+      patch_jump(e, slow[s], e->len);
+   emit_call_slow(e, (void *)vm_jit_compare, i, op);
+   patch_jump(e, done, e->len);
+
+   emit_branch(c, pc, i->c, i->flag);
+}
+
+static void
+compile_test(struct jit_compiler *c, struct decoded_instr const *i,
+   int32_t pc)
+{
+   struct emitter *e = &c->e;
+   int32_t slow, done;
+
+   /* booleans inline, anything else through the vm */
+   emit_load(e, RAX, 0, i->a);
+   slow = emit_jump_iftag(e, RAX, BITS_TAG_BOOLEAN, CC_NE);
+   emit8(e, 0x83); /* and eax, 1 */
+   emit8(e, 0xe0);
+   emit8(e, 0x01);
+   done = emit_jump(e, -1);
+
+   patch_jump(e, slow, e->len);
+   emit_mem(e, 0x8d, RDI, REGS, i->a * sizeof(union value)); /* lea */
+   emit_call(e, (void *)vm_jit_tobool);
+   patch_jump(e, done, e->len);
+
+   emit_branch(c, pc, i->c, i->flag);
+}
+
+static bool
+is_compiled(enum opcode op)
+{
+   return (op >= OP_ADD && op <= OP_MOD) || (op >= OP_ADDK && op <= OP_KMOD) ||
+      op == OP_EQ || op == OP_LT || op == OP_LTE || op == OP_TEST ||
+      op == OP_JUMP;
+}
+
+/* tests and comparisons, the following jump is fused with them */
+static bool
+is_fused(enum opcode op)
+{
+   return op == OP_EQ || op == OP_LT || op == OP_LTE || op == OP_TEST;
+}
+
+static void
+emit_prologue(struct jit_compiler *c, void **entries)
+{
+   static const uint8_t PUSHES[] = {
+      0x55,       /* push rbp */
+      0x53,       /* push rbx */
+      0x41, 0x54, /* push r12 */
+      0x41, 0x55, /* push r13 */
+      0x41, 0x56, /* push r14 */
+   };
+   static const uint8_t POPS[] = {
+      0x41, 0x5e, /* pop r14 */
+      0x41, 0x5d, /* pop r13 */
+      0x41, 0x5c, /* pop r12 */
+      0x5b,       /* pop rbx */
+      0x5d,       /* pop rbp */
+      0xc3,       /* ret */
+   };
+   struct emitter *e = &c->e;
+
+   /* five pushes realign the stack to 16 bytes for slow path calls */
+   memcpy(e->code + e->len, PUSHES, sizeof PUSHES);
+   e->len += sizeof PUSHES;
+   emit_rr(e, 0x89, REGS, RDI);
+   emit_rr(e, 0x89, CONSTS, RSI);
+   emit_rr(e, 0x89, VM, RCX);
+   emit_mov_imm64(e, NANMASK, BITS_NAN_MASK);
+
+   /* jump to the entry of instruction pc */
+   emit8(e, 0x48); /* movsxd rdx, edx */
+   emit8(e, 0x63);
+   emit8(e, 0xd2);
+   emit_mov_imm64(e, RAX, (uint64_t)(uintptr_t)entries);
+   emit8(e, 0xff); /* jmp [rax + rdx * 8] */
+   emit8(e, 0x24);
+   emit8(e, 0xd0);
+
+   c->epilogue = e->len;
+   memcpy(e->code + e->len, POPS, sizeof POPS);
+   e->len += sizeof POPS;
+}
+
+kintern bool
+jit_compile(struct vm *vm, struct prototype *proto)
+{
+   struct koji_allocator *alloc = &vm->alloc;
+   struct decoded_instr *code = proto->code;
+   int32_t ninstrs = proto->ninstrs;
+   struct jit_compiler c;
+   struct jit_code *jit;
+   int32_t ncompiled = 0;
+   size_t size;
+   void *mem;
+
+   /* entering and leaving native code costs more than interpreting a single
+      instruction, only compile runs of at least JIT_MIN_RUN instructions
+      (jumps fused with a test excluded) */
+   c.offsets = kalloc(int32_t, ninstrs, alloc);
+   for (int32_t pc = 0, begin = 0, weight = 0; pc <= ninstrs; ++pc) {
+      if (pc < ninstrs && is_compiled(code[pc].op)) {
+         weight += !(pc > begin && is_fused(code[pc - 1].op));
+         continue;
+      }
+      for (int32_t k = begin; k < pc; ++k)
+         c.offsets[k] = weight >= JIT_MIN_RUN ? 0 : -1;
+      ncompiled += weight >= JIT_MIN_RUN ? pc - begin : 0;
+      if (pc < ninstrs)
+         c.offsets[pc] = -1;
+      begin = pc + 1;
+      weight = 0;
+   }
+
+   size = JIT_MAX_PROLOGUE_SIZE + (size_t)JIT_MAX_INSTR_SIZE * ncompiled;
+   size = (size + 4095) & ~(size_t)4095;
+   if (ncompiled == 0 || (mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+      kfree(c.offsets, ninstrs, alloc);
+      return false;
+   }
+
+   jit = kalloc(struct jit_code, 1, alloc);
+   jit->mem = mem;
+   jit->size = (int32_t)size;
+   jit->ninstrs = ninstrs;
+   jit->entries = kalloc(void *, ninstrs, alloc);
+
+   c.e.code = mem;
+   c.e.len = 0;
+   c.proto = proto;
+   c.fixups = kalloc(struct fixup, ncompiled * 2, alloc);
+   c.nfixups = 0;
+
+   emit_prologue(&c, jit->entries);
+
+   for (int32_t pc = 0; pc < ninstrs; ++pc) {
+      struct decoded_instr const *i = code + pc;
+      if (c.offsets[pc] < 0)
+         continue;
+      c.offsets[pc] = c.e.len;
+
+      switch (i->op) {
+         case OP_EQ:
+         case OP_LT:
+         case OP_LTE:
+            compile_compare(&c, i, pc, i->op);
+            break;
+
+         case OP_TEST:
+            compile_test(&c, i, pc);
+            break;
+
+         case OP_JUMP:
+            emit_goto(&c, pc + 1 + i->b);
+            break;
+
+         default:
+            compile_arith(&c, i, i->op);
+            if (pc + 1 < ninstrs && c.offsets[pc + 1] < 0)
+               emit_exit(&c, pc + 1);
+            break;
+      }
+      assert(c.e.len - c.offsets[pc] <= JIT_MAX_INSTR_SIZE);
+   }
+
+   for (int32_t f = 0; f < c.nfixups; ++f)
+      patch_jump(&c.e, c.fixups[f].at, c.offsets[c.fixups[f].pc]);
+
+   /* enter native code from the interpreter at any compiled instruction */
+   for (int32_t pc = 0; pc < ninstrs; ++pc) {
+      jit->entries[pc] = NULL;
+      if (c.offsets[pc] >= 0) {
+         jit->entries[pc] = (uint8_t *)mem + c.offsets[pc];
+         code[pc].op = OP_JIT;
+      }
+   }
+
+   kfree(c.fixups, ncompiled * 2, alloc);
+   kfree(c.offsets, ninstrs, alloc);
+
+   mprotect(mem, size, PROT_READ | PROT_EXEC);
+   jit->fn = (jit_fn_t)mem;
+   proto->jit = jit;
+   return true;
+}
+
+kintern void
+jit_release(struct jit_code *jit, struct koji_allocator *alloc)
+{
+   munmap(jit->mem, jit->size);
+   kfree(jit->entries, jit->ninstrs, alloc);
+   kfree(jit, 1, alloc);
+}
+
+#endif
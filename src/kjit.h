@@ -0,0 +1,86 @@
+/*
+ * koji scripting language - baseline JIT compiler
+ *
+ * Copyright (C) 2017 Canio Massimo Tristano
+ *
+ * This source file is part of the koji scripting language, distributed under
+ * the MIT license. See koji.h for further licensing information.
+ */
+
+#pragma once
+
+#include "kplatform.h"
+#include "kbytecode.h"
+
+#ifdef KOJI_JIT
+
+struct vm;
+
+/*
+ * Number of times a prototype must be entered before it is compiled to
+ * native code.
+ */
+#ifndef KOJI_JIT_THRESHOLD
+#define KOJI_JIT_THRESHOLD 64
+#endif
+
+/*
+ * Signature of the native code of a prototype. It executes the prototype
+ * instructions from [pc] on with registers [regs] and constants [consts],
+ * and returns the pc of the first instruction reached that has not been
+ * compiled and that the interpreter must execute.
+ */
+typedef int32_t (*jit_fn_t) (union value *regs, union value *consts,
+   int32_t pc, struct vm *vm);
+
+/*
+ * The native code of a prototype.
+ */
+struct jit_code {
+   jit_fn_t fn; /* native entry point */
+   void *mem; /* executable memory mapping */
+   int32_t size; /* size in bytes of [mem] */
+   int32_t ninstrs; /* number of instructions of the prototype */
+   void **entries; /* native address of each compiled instruction */
+};
+
+/*
+ * Compiles the decoded instructions of [proto] to native code. The compiled
+ * instructions of [proto->code] are rewritten to OP_JIT, so the interpreter
+ * enters the native code when reaching any of them. Numeric arithmetic,
+ * comparisons, tests and jumps are compiled, every other instruction is left
+ * to the interpreter. Returns false if [proto] could not be compiled.
+ */
+kintern bool
+jit_compile(struct vm *vm, struct prototype *proto);
+
+/*
+ * Releases native code [jit].
+ */
+kintern void
+jit_release(struct jit_code *jit, struct koji_allocator *alloc);
+
+/*
+ * Slow paths called by native code, implemented by the VM. They execute
+ * instruction [i], compiled from opcode [op], when its operands are not
+ * numbers (or its target holds an object) with the same semantics as the
+ * interpreter.
+ */
+kintern void
+vm_jit_arith(struct vm *vm, union value *regs, union value *consts,
+   struct decoded_instr const *i, int32_t op);
+
+/*
+ * Returns the result of comparison instruction [i] of opcode [op].
+ */
+kintern int32_t
+vm_jit_compare(struct vm *vm, union value *regs, union value *consts,
+   struct decoded_instr const *i, int32_t op);
+
+/*
+ * Returns value [val] converted to bool.
+ */
+kintern int32_t
+vm_jit_tobool(union value const *val);
+
+#endif
@@ -7,16 +7,205 @@
 
 #include "koji.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Compiles script [filename] to C file [cfilename], or to [filename].c if
+ * NULL.
+ */
+static int
+emit_c(koji_state_t *state, const char *filename, const char *cfilename)
+{
+	char buffer[1024];
+
+	if (!cfilename) {
+		snprintf(buffer, sizeof buffer, "%s.c", filename);
+		cfilename = buffer;
+	}
+
+	if (koji_emit_c(state, filename, cfilename)) {
+		printf("%s\n", koji_string(state, -1));
+		koji_pop(state, 1);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Counters collected by opcount(), opcode totals and instruction counts.
+ */
+struct opcounts {
+	struct koji_opcount *ops, *instrs;
+	int nops, ninstrs, instrslen;
+	unsigned long long total;
+};
+
+static void
+collect_opcount(struct koji_opcount const *count, void *user)
+{
+	struct opcounts *c = user;
+
+	if (count->pc < 0) {
+		c->ops = realloc(c->ops, sizeof *c->ops * (c->nops + 1));
+		c->ops[c->nops++] = *count;
+		c->total += count->count;
+		return;
+	}
+	if (c->ninstrs == c->instrslen) {
+		c->instrslen = c->instrslen ? c->instrslen * 2 : 64;
+		c->instrs = realloc(c->instrs, sizeof *c->instrs * c->instrslen);
+	}
+	c->instrs[c->ninstrs++] = *count;
+}
+
+static int
+compare_opcount(const void *lhs, const void *rhs)
+{
+	unsigned long long l = ((struct koji_opcount const *)lhs)->count;
+	unsigned long long r = ((struct koji_opcount const *)rhs)->count;
+	return l < r ? 1 : l > r ? -1 : 0;
+}
+
+/*
+ * Runs script [filename] and prints how many times each opcode and the
+ * [top] most executed instructions have been executed.
+ */
+static int
+opcount(koji_state_t *state, const char *filename, int top)
+{
+	struct opcounts c = { 0 };
+
+	if (koji_load_file(state, filename) || koji_run(state)) {
+		printf("%s\n", koji_string(state, -1));
+		koji_pop(state, 1);
+		return 1;
+	}
+
+	if (!koji_stats(state, collect_opcount, &c)) {
+		printf("opcode counters not available, build with KOJI_OPCOUNT.\n");
+		return 1;
+	}
+
+	qsort(c.ops, c.nops, sizeof *c.ops, compare_opcount);
+	qsort(c.instrs, c.ninstrs, sizeof *c.instrs, compare_opcount);
+
+	printf("%-10s %14s %7s\n", "opcode", "count", "%");
+	for (int i = 0; i < c.nops; ++i)
+		printf("%-10s %14llu %6.2f%%\n", c.ops[i].op, c.ops[i].count,
+		       c.ops[i].count * 100.0 / c.total);
+	printf("%-10s %14llu\n\n", "total", c.total);
+
+	printf("%5s %5s %-10s %14s %7s\n", "proto", "pc", "opcode", "count", "%");
+	for (int i = 0; i < c.ninstrs && i < top; ++i)
+		printf("%5d %5d %-10s %14llu %6.2f%%\n", c.instrs[i].proto,
+		       c.instrs[i].pc, c.instrs[i].op, c.instrs[i].count,
+		       c.instrs[i].count * 100.0 / c.total);
+
+	free(c.ops);
+	free(c.instrs);
+	return 0;
+}
+
+/*
+ * Runs script [filename] sampling its call stack every millisecond and
+ * writes the collapsed stacks to [out], or to [filename].folded if NULL.
+ */
+static int
+profile(koji_state_t *state, const char *filename, const char *out)
+{
+	char buffer[1024];
+
+	if (!out) {
+		snprintf(buffer, sizeof buffer, "%s.folded", filename);
+		out = buffer;
+	}
+
+	if (koji_load_file(state, filename) || koji_profile_start(state, 1000))
+		goto error;
+	if (koji_run(state)) {
+		printf("%s\n", koji_string(state, -1));
+		koji_pop(state, 1);
+	}
+	if (koji_profile_stop(state, out))
+		goto error;
+	return 0;
+
+error:
+	printf("%s\n", koji_string(state, -1));
+	koji_pop(state, 1);
+	return 1;
+}
+
+static void
+print_slab_class(struct koji_slab_class const *c, void *user)
+{
+	(void)user;
+	if (c->size)
+		printf("%5d %6d %8d %14llu %14llu\n", c->size, c->pages, c->live,
+		       c->allocs, c->frees);
+	else
+		printf("%5s %6s %8d %14llu %14llu\n", "large", "-", c->live,
+		       c->allocs, c->frees);
+}
+
+/*
+ * Runs script [filename] in a state allocating from the slab allocator and
+ * prints the counters of each size class.
+ */
+static int
+slab(const char *filename)
+{
+	koji_state_t *state = koji_open_slab(0);
+	int result = 0;
+
+	if (koji_load_file(state, filename) || koji_run(state)) {
+		printf("%s\n", koji_string(state, -1));
+		koji_pop(state, 1);
+		result = 1;
+	}
+
+	printf("%5s %6s %8s %14s %14s\n", "size", "pages", "live", "allocs",
+	       "frees");
+	koji_slab_stats(state, print_slab_class, NULL);
+	koji_close(state);
+	return result;
+}
 
 int main(int argc, char** argv)
 {
 	if (argc < 2) {
-		printf("usage: koji <filename>\n");
+		printf("usage: koji <filename>\n"
+		       "       koji --emit-c <filename> [<output>]\n"
+		       "       koji --opcount <filename>\n"
+		       "       koji --profile <filename> [<output>]\n"
+		       "       koji --slab <filename>\n");
 		return 0;
 	}		
 
+	if (strcmp(argv[1], "--slab") == 0)
+		return argc < 3 ? 1 : slab(argv[2]);
+
 	koji_state_t *state = koji_open(0);
 
+	if (strcmp(argv[1], "--emit-c") == 0) {
+		int result = argc < 3 ? 1 : emit_c(state, argv[2], argc > 3 ? argv[3] : 0);
+		koji_close(state);
+		return result;
+	}
+
+	if (strcmp(argv[1], "--profile") == 0) {
+		int result = argc < 3 ? 1 : profile(state, argv[2], argc > 3 ? argv[3] : 0);
+		koji_close(state);
+		return result;
+	}
+
+	if (strcmp(argv[1], "--opcount") == 0) {
+		int result = argc < 3 ? 1 : opcount(state, argv[2], 20);
+		koji_close(state);
+		return result;
+	}
+
 	if (koji_load_file(state, argv[1]))
 		goto error;
 
@@ -77,6 +77,15 @@ typedef struct koji_state koji_state_t;
 KOJI_API koji_state_t *
 koji_open(struct koji_allocator *alloc);
 
+/*
+ * Opens a state like koji_open() whose small allocations, object headers and
+ * small arrays mostly, are served by a slab allocator with a free list per
+ * size class. The slab requests pages to [alloc] and only returns them when
+ * the state is closed, see koji_slab_stats().
+ */
+KOJI_API koji_state_t *
+koji_open_slab(struct koji_allocator *alloc);
+
 KOJI_API void
 koji_close(koji_state_t*);
 
@@ -89,6 +98,15 @@ koji_load_string(koji_state_t *, const char *source);
 KOJI_API koji_result_t
 koji_load_file(koji_state_t *, const char *filename);
 
+/*
+ * Compiles script [filename] ahead-of-time to the C translation unit
+ * [cfilename]. Linked with the program along with libkoji, the translation
+ * unit registers itself and koji_load() then runs the script compiled instead
+ * of interpreting it.
+ */
+KOJI_API koji_result_t
+koji_emit_c(koji_state_t *, const char *filename, const char *cfilename);
+
 KOJI_API koji_result_t
 koji_run(koji_state_t *);
 
@@ -98,6 +116,13 @@ koji_push_string(koji_state_t *, const char *source, int len);
 KOJI_API void
 koji_push_stringf(koji_state_t *, const char *format, ...);
 
+/*
+ * Returns the null terminated characters of the string at [offset] in the
+ * stack, NULL if the value there is not a string. The characters of strings
+ * of up to 5 characters are stored in the stack slot itself: they are only
+ * valid until the string is popped or the stack grows, as values are pushed
+ * or scripts run. Longer ones are valid as long as the string is referenced.
+ */
 KOJI_API const char *
 koji_string(koji_state_t *, int offset);
 
@@ -107,4 +132,99 @@ koji_string_length(koji_state_t *, int offset);
 KOJI_API void
 koji_pop(koji_state_t *, int n);
 
+/*
+ * Runs a step of the cycle collector, which frees the tables only referenced
+ * by each other. A collection runs in steps and frees the garbage it finds
+ * once complete: the step visits about [budget] tables, starting a collection
+ * if none is running, or runs collections until all the garbage is freed if
+ * [budget] is not positive. Returns the number of tables freed.
+ * Libraries built with KOJI_GC replace reference counting with a tracing
+ * collector: the step marks or sweeps about [budget] objects of any kind, or
+ * runs a full collection, and returns the number of objects freed. Values
+ * popped from the stack are then only valid until the next step.
+ */
+KOJI_API int
+koji_collect(koji_state_t *, int budget);
+
+/*
+ * Sets the number of tables visited by the collector steps the state runs
+ * while executing scripts, 1024 by default, or the number of objects marked
+ * or swept by the steps of the tracing collector of KOJI_GC builds. Smaller
+ * budgets make shorter pauses, 0 disables automatic collection. A step of each
+ * collection of the cycle collector checks again at once the tables it did
+ * not find live, taking time proportional to them, mostly garbage.
+ */
+KOJI_API void
+koji_collect_budget(koji_state_t *, int budget);
+
+/*
+ * Starts sampling the call stack of the scripts run by the state every
+ * [interval] microseconds of CPU time. Only one state per process can be
+ * profiled at a time and the profiler uses the SIGPROF signal, it is not
+ * available on targets without it.
+ */
+KOJI_API koji_result_t
+koji_profile_start(koji_state_t *, int interval);
+
+/*
+ * Stops profiling and writes the samples taken to file [filename] as collapsed
+ * stacks, the input format of flame graph tools: one line per distinct stack,
+ * frames from the outermost separated by ';', followed by the sample count.
+ */
+KOJI_API koji_result_t
+koji_profile_stop(koji_state_t *, const char *filename);
+
+/*
+ * An execution counter reported by koji_stats(): either the total of opcode
+ * [op] ([proto] and [pc] are -1) or the count of instruction [pc] of
+ * prototype [proto], prototypes being numbered in order of first execution.
+ */
+struct koji_opcount {
+   const char *op; /* the opcode name */
+   int proto; /* the prototype number, -1 for opcode totals */
+   int pc; /* the instruction index, -1 for opcode totals */
+   unsigned long long count; /* number of executions */
+};
+
+typedef void (*koji_opcount_fn_t) (struct koji_opcount const *, void *user);
+
+/*
+ * Reports the execution counters collected by libraries built with
+ * KOJI_OPCOUNT defined. Calls [fn] with the total of each executed opcode,
+ * then with the count of each executed instruction. Returns 0 without
+ * calling [fn] if the library was built without counters, 1 otherwise.
+ */
+KOJI_API int
+koji_stats(koji_state_t *, koji_opcount_fn_t fn, void *user);
+
+/*
+ * Resets the execution counters to zero.
+ */
+KOJI_API void
+koji_stats_reset(koji_state_t *);
+
+/*
+ * The counters of a size class of the slab allocator reported by
+ * koji_slab_stats(). A [size] of 0 reports the allocations larger than the
+ * largest class, forwarded to the host allocator.
+ */
+struct koji_slab_class {
+   int size; /* the size in bytes of the blocks of the class */
+   int pages; /* number of pages requested to the host allocator */
+   int live; /* number of blocks currently allocated */
+   unsigned long long allocs; /* number of allocations */
+   unsigned long long frees; /* number of frees */
+};
+
+typedef void (*koji_slab_fn_t) (struct koji_slab_class const *, void *user);
+
+/*
+ * Reports the counters of the slab allocator of a state opened with
+ * koji_open_slab(). Calls [fn] with each size class that has been used, then
+ * with the allocations forwarded to the host allocator. Returns 0 without
+ * calling [fn] if the state does not use the slab allocator, 1 otherwise.
+ */
+KOJI_API int
+koji_slab_stats(koji_state_t *, koji_slab_fn_t fn, void *user);
+
 #endif /* KOJI_H_ */
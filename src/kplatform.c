@@ -95,7 +95,7 @@ kintern void
 array_seq_free(void *arrayp, int32_t *size, struct koji_allocator *alloc,
    int32_t elemsize)
 {
-   alloc->free(*(void**)arrayp, array_seq_len(*size * elemsize),
+   alloc->free(*(void**)arrayp, array_seq_len(*size) * elemsize,
       alloc->user);
    *(void **)arrayp = NULL;
    *size = 0;
@@ -128,7 +128,7 @@ array_reserve(void *arrayp, int32_t *size, int32_t *len, struct koji_allocator *
 
 		/* Allocate new buffer and copy old values over */
 		*array = alloc->realloc(*array, *len * elemsize, newlen * elemsize,
-                              alloc);
+                              alloc->user);
 		if (!*array) return false;
 
 		*len = newlen;
@@ -32,11 +32,45 @@
 #define KOJI_64
 #endif
 
+/*
+ * The baseline JIT compiler is opt-in: define KOJI_JIT to enable it. It only
+ * emits x86-64 System V code, on any other target the define is ignored.
+ */
+#if defined(KOJI_JIT) && !(defined(__x86_64__) && defined(__linux__))
+#undef KOJI_JIT
+#endif
+
+/*
+ * The sampling profiler is driven by the SIGPROF timer, so it is only
+ * available on POSIX targets. Define KOJI_NO_PROFILER to leave it out.
+ */
+#if !defined(KOJI_NO_PROFILER) && (defined(__unix__) || defined(__APPLE__))
+#define KOJI_PROFILER
+#endif
+
+/*
+ * Define KOJI_OPCOUNT to build an instrumented interpreter that counts how
+ * many times each opcode and each instruction of each prototype is executed,
+ * see koji_stats(). Instructions run as native or ahead-of-time compiled code
+ * are not counted.
+ */
+
 /*
  * Platform independent language extensions.
  */
 
 #define kalignof(T) __alignof(T)
+
+/* prevents the compiler from moving memory accesses across it, used to order
+   stores observed by signal handlers */
+#if defined(__GNUC__) || defined(__clang__)
+#define kbarrier() __asm__ __volatile__("" ::: "memory")
+#elif defined(_MSC_VER)
+#define kbarrier() _ReadWriteBarrier()
+#else
+#define kbarrier() ((void)0)
+#endif
+
 #define kalloca _alloca
 
 /*
@@ -0,0 +1,248 @@
+/*
+ * koji scripting language - sampling profiler
+ *
+ * Copyright (C) 2017 Canio Massimo Tristano
+ *
+ * This source file is part of the koji scripting language, distributed under
+ * the MIT license. See koji.h for further licensing information.
+ */
+
+#include "kprofile.h"
+
+#ifdef KOJI_PROFILER
+
+#include "kvm.h"
+#include "kstring.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* the profiler SIGPROF is delivered to, NULL if none is running */
+static struct profiler *volatile profiler_running;
+
+/*
+ * SIGPROF handler, appends a sample of the frame stack of the profiled VM to
+ * the sample buffer.
+ */
+static void
+profiler_sample(int signo)
+{
+   struct profiler *p = profiler_running;
+   struct profiler_frame *header, *f;
+   struct vm *vm;
+   int32_t framesp, begin;
+
+   (void)signo;
+   if (!p)
+      return;
+   if (p->hold) {
+      ++p->ndropped;
+      return;
+   }
+
+   vm = p->vm;
+   framesp = vm->framesp;
+   begin = framesp > PROFILER_MAX_DEPTH ? framesp - PROFILER_MAX_DEPTH : 0;
+   if (framesp == 0)
+      return; /* not executing any script */
+   if (p->nframes + (framesp - begin) + 1 > KOJI_PROFILER_FRAMES) {
+      ++p->ndropped;
+      return;
+   }
+
+   /* the pc of a frame is past the instruction being executed */
+   header = p->frames + p->nframes;
+   f = header + 1;
+   for (int32_t i = begin; i < framesp; ++i) {
+      struct vm_frame *frame = vm->framestack + i;
+      if (!frame->proto->profiled)
+         continue;
+      f->proto = frame->proto;
+      f->pc = frame->pc > 0 ? frame->pc - 1 : 0;
+      ++f;
+   }
+   if (f == header + 1)
+      return;
+   header->proto = NULL;
+   header->pc = (int32_t)(f - header - 1);
+   p->nframes += header->pc + 1;
+   ++p->nsamples;
+}
+
+kintern bool
+profiler_start(struct vm *vm, int32_t interval)
+{
+   struct profiler *p;
+   struct sigaction action;
+   struct itimerval timer;
+
+   if (profiler_running || vm->profiler || interval <= 0)
+      return false;
+
+   p = kalloc(struct profiler, 1, &vm->alloc);
+   p->vm = vm;
+   p->frames = kalloc(struct profiler_frame, KOJI_PROFILER_FRAMES, &vm->alloc);
+   p->nframes = 0;
+   p->nsamples = 0;
+   p->ndropped = 0;
+   p->hold = 0;
+   p->nprotos = 0;
+   p->protoslen = 16;
+   p->protos = kalloc(struct prototype *, p->protoslen, &vm->alloc);
+   vm->profiler = p;
+
+   /* frames already on the stack will not be entered again */
+   for (int32_t i = 0; i < vm->framesp; ++i)
+      profiler_enter(p, vm->framestack[i].proto);
+
+   memset(&action, 0, sizeof action);
+   action.sa_handler = profiler_sample;
+   action.sa_flags = SA_RESTART;
+   sigemptyset(&action.sa_mask);
+   timer.it_interval.tv_sec = interval / 1000000;
+   timer.it_interval.tv_usec = interval % 1000000;
+   timer.it_value = timer.it_interval;
+
+   profiler_running = p;
+   if (sigaction(SIGPROF, &action, &p->oldaction)) {
+      profiler_running = NULL;
+      profiler_stop(vm, NULL);
+      return false;
+   }
+   if (setitimer(ITIMER_PROF, &timer, &p->oldtimer)) {
+      sigaction(SIGPROF, &p->oldaction, NULL);
+      profiler_running = NULL;
+      profiler_stop(vm, NULL);
+      return false;
+   }
+   return true;
+}
+
+kintern void
+profiler_enter(struct profiler *p, struct prototype *proto)
+{
+   if (proto->profiled)
+      return;
+   if (p->nprotos == p->protoslen) {
+      int32_t newlen = p->protoslen * 2;
+      p->protos = krealloc(p->protos, p->protoslen, newlen, &p->vm->alloc);
+      p->protoslen = newlen;
+   }
+   p->protos[p->nprotos++] = proto;
+   ++proto->refs;
+   kbarrier();
+   proto->profiled = true;
+}
+
+/*
+ * Appends the collapsed stack label of [frame] to [buf] at [*len], growing it
+ * as needed.
+ */
+static void
+append_frame(struct vm *vm, char **buf, int32_t *len, int32_t *cap,
+   struct profiler_frame const *frame)
+{
+   struct prototype *proto = frame->proto;
+   const char *source = value_isnil(proto->source) ? "?" :
+      value_string_chars(&proto->source);
+   int32_t line = prototype_line(proto, frame->pc);
+   int32_t n;
+
+   for (;;) {
+      int32_t avail = *cap - *len;
+      if (proto->line)
+         n = snprintf(*buf + *len, avail, "func@%d (%s:%d)", proto->line,
+            source, line);
+      else
+         n = snprintf(*buf + *len, avail, "main (%s:%d)", source, line);
+      if (n < avail)
+         break;
+      *buf = krealloc(*buf, *cap, *cap * 2, &vm->alloc);
+      *cap *= 2;
+   }
+   *len += n;
+}
+
+static int
+compare_stacks(const void *lhs, const void *rhs)
+{
+   return strcmp(*(char *const *)lhs, *(char *const *)rhs);
+}
+
+/*
+ * Writes the samples of [p] to [out] as collapsed stacks.
+ */
+static void
+profiler_write(struct profiler *p, FILE *out)
+{
+   struct vm *vm = p->vm;
+   int32_t cap = 4096, len = 0, nstacks = 0;
+   char *buf = kalloc(char, cap, &vm->alloc);
+   int32_t *offsets = kalloc(int32_t, p->nsamples + 1, &vm->alloc);
+   char **stacks;
+
+   /* format the stack of each sample to a null-terminated string in [buf] */
+   for (int32_t i = 0; i < p->nframes; i += p->frames[i].pc + 1) {
+      struct profiler_frame const *header = p->frames + i;
+      offsets[nstacks++] = len;
+      for (int32_t f = 1; f <= header->pc; ++f) {
+         if (f > 1) {
+            if (len + 1 >= cap) {
+               buf = krealloc(buf, cap, cap * 2, &vm->alloc);
+               cap *= 2;
+            }
+            buf[len++] = ';';
+         }
+         append_frame(vm, &buf, &len, &cap, header + f);
+      }
+      if (len + 1 >= cap) {
+         buf = krealloc(buf, cap, cap * 2, &vm->alloc);
+         cap *= 2;
+      }
+      buf[len++] = '\0';
+   }
+
+   /* sort the stacks so that equal ones are adjacent and count them */
+   stacks = kalloc(char *, nstacks + 1, &vm->alloc);
+   for (int32_t i = 0; i < nstacks; ++i)
+      stacks[i] = buf + offsets[i];
+   qsort(stacks, nstacks, sizeof *stacks, compare_stacks);
+   for (int32_t i = 0, n; i < nstacks; i += n) {
+      for (n = 1; i + n < nstacks && strcmp(stacks[i], stacks[i + n]) == 0;)
+         ++n;
+      fprintf(out, "%s %d\n", stacks[i], n);
+   }
+
+   kfree(stacks, nstacks + 1, &vm->alloc);
+   kfree(offsets, p->nsamples + 1, &vm->alloc);
+   kfree(buf, cap, &vm->alloc);
+}
+
+kintern void
+profiler_stop(struct vm *vm, FILE *out)
+{
+   struct profiler *p = vm->profiler;
+   if (!p)
+      return;
+
+   /* stop sampling before touching the sample buffer */
+   if (profiler_running == p) {
+      setitimer(ITIMER_PROF, &p->oldtimer, NULL);
+      sigaction(SIGPROF, &p->oldaction, NULL);
+      profiler_running = NULL;
+   }
+   vm->profiler = NULL;
+
+   if (out)
+      profiler_write(p, out);
+
+   for (int32_t i = 0; i < p->nprotos; ++i) {
+      p->protos[i]->profiled = false;
+      prototype_release(p->protos[i], &vm->alloc);
+   }
+   kfree(p->protos, p->protoslen, &vm->alloc);
+   kfree(p->frames, KOJI_PROFILER_FRAMES, &vm->alloc);
+   kfree(p, 1, &vm->alloc);
+}
+
+#endif
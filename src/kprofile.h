@@ -0,0 +1,94 @@
+/*
+ * koji scripting language - sampling profiler
+ *
+ * Copyright (C) 2017 Canio Massimo Tristano
+ *
+ * This source file is part of the koji scripting language, distributed under
+ * the MIT license. See koji.h for further licensing information.
+ */
+
+#pragma once
+
+#include "kplatform.h"
+#include "kbytecode.h"
+
+#ifdef KOJI_PROFILER
+
+#include <signal.h>
+#include <stdio.h>
+#include <sys/time.h>
+
+struct vm;
+
+/*
+ * Capacity in frames of the sample buffer, samples taken once it is full are
+ * dropped.
+ */
+#ifndef KOJI_PROFILER_FRAMES
+#define KOJI_PROFILER_FRAMES (1 << 18)
+#endif
+
+/*
+ * Maximum number of frames recorded per sample, the innermost are kept.
+ */
+#define PROFILER_MAX_DEPTH 128
+
+/*
+ * A frame of a sample, or the header of a sample if [proto] is NULL, in which
+ * case [pc] is the number of frames that follow.
+ */
+struct profiler_frame {
+   struct prototype *proto;
+   int32_t pc;
+};
+
+/*
+ * A sampling profiler. The SIGPROF handler copies the prototype and pc of the
+ * frames on the VM frame stack to the sample buffer; samples are resolved to
+ * source lines and aggregated when profiling stops. The VM pushes and pops
+ * frames in an order that keeps the frame stack consistent for the handler
+ * and holds off sampling while it reallocates the frame stack.
+ */
+struct profiler {
+   struct vm *vm; /* the profiled VM */
+   struct profiler_frame *frames; /* sample buffer */
+   int32_t nframes; /* number of frames in the sample buffer */
+   int32_t nsamples; /* number of samples taken */
+   int32_t ndropped; /* number of samples dropped */
+   volatile sig_atomic_t hold; /* set while sampling must not happen */
+   struct prototype **protos; /* prototypes entered while profiling */
+   int32_t nprotos; /* number of prototypes in [protos] */
+   int32_t protoslen; /* capacity of the [protos] array */
+   struct sigaction oldaction; /* SIGPROF action before profiling started */
+   struct itimerval oldtimer; /* profiling timer before profiling started */
+};
+
+/*
+ * Starts profiling [vm], sampling its frame stack every [interval]
+ * microseconds of CPU time. Only one VM per process can be profiled at a time.
+ * Returns false if profiling could not start.
+ */
+kintern bool
+profiler_start(struct vm *vm, int32_t interval);
+
+/*
+ * Stops profiling [vm] and writes the samples taken to [out] in the collapsed
+ * stack format read by flame graph tools: a line per distinct call stack with
+ * its frames from outermost to innermost, separated by ';', followed by the
+ * number of samples. Frames read "main (<source>:<line>)" for main prototypes
+ * and "func@<line> (<source>:<line>)" for functions, which are named after
+ * their definition line. [out] can be NULL to discard the samples.
+ */
+kintern void
+profiler_stop(struct vm *vm, FILE *out);
+
+/*
+ * Called by the VM when entering [proto] while profiling: the profiler holds a
+ * reference to every sampled prototype so that samples can be resolved to
+ * source lines once profiling stops. Frames of prototypes not entered yet are
+ * not sampled.
+ */
+kintern void
+profiler_enter(struct profiler *profiler, struct prototype *proto);
+
+#endif
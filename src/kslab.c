@@ -0,0 +1,165 @@
+/*
+ * koji scripting language - slab allocator
+ *
+ * Copyright (C) 2017 Canio Massimo Tristano
+ *
+ * This source file is part of the koji scripting language, distributed under
+ * the MIT license. See koji.h for further licensing information.
+ */
+
+#include "kslab.h"
+
+#include <string.h>
+
+/*
+ * Returns the size class of allocations of [size] bytes, or NULL if they are
+ * too large for the slab.
+ */
+static struct slab_class *
+slab_class(struct slab *slab, int32_t size)
+{
+   if (size > SLAB_MAX_SIZE)
+      return NULL;
+   return slab->classes + (size > 0 ? (size - 1) / SLAB_GRANULE : 0);
+}
+
+static int32_t
+slab_block_size(struct slab *slab, struct slab_class *c)
+{
+   return (int32_t)(c - slab->classes + 1) * SLAB_GRANULE;
+}
+
+/*
+ * Requests a new page of blocks for class [c] to the host allocator. Returns
+ * false if out of memory.
+ */
+static bool
+slab_grow(struct slab *slab, struct slab_class *c)
+{
+   int32_t blocksize = slab_block_size(slab, c);
+   int32_t nblocks = (KOJI_SLAB_PAGE_SIZE - SLAB_GRANULE) / blocksize;
+   struct slab_page *page =
+      slab->host.alloc(KOJI_SLAB_PAGE_SIZE, slab->host.user);
+
+   if (!page)
+      return false;
+   page->next = slab->pages;
+   slab->pages = page;
+   ++c->npages;
+
+   /* blocks follow the header at the alignment of the smallest block */
+   c->cursor = (char *)page + SLAB_GRANULE;
+   c->end = c->cursor + nblocks * blocksize;
+   return true;
+}
+
+static void *
+slab_alloc(int32_t size, void *user)
+{
+   struct slab *slab = user;
+   struct slab_class *c = slab_class(slab, size);
+   void *block;
+
+   if (!c) {
+      block = slab->host.alloc(size, slab->host.user);
+      c = &slab->large;
+   }
+   else if (c->free) {
+      block = c->free;
+      c->free = c->free->next;
+   }
+   else {
+      if (c->cursor == c->end && !slab_grow(slab, c))
+         return NULL;
+      block = c->cursor;
+      c->cursor += slab_block_size(slab, c);
+   }
+
+   if (block) {
+      ++c->nallocs;
+      ++c->nlive;
+   }
+   return block;
+}
+
+static void
+slab_free(void *ptr, int32_t size, void *user)
+{
+   struct slab *slab = user;
+   struct slab_class *c = slab_class(slab, size);
+   struct slab_block *block = ptr;
+
+   if (!ptr)
+      return;
+   if (!c) {
+      slab->host.free(ptr, size, slab->host.user);
+      c = &slab->large;
+   }
+   else {
+      block->next = c->free;
+      c->free = block;
+   }
+   ++c->nfrees;
+   --c->nlive;
+}
+
+static void *
+slab_realloc(void *ptr, int32_t oldsize, int32_t newsize, void *user)
+{
+   struct slab *slab = user;
+   struct slab_class *oldc = slab_class(slab, oldsize);
+   struct slab_class *newc = slab_class(slab, newsize);
+   void *block;
+
+   if (!ptr)
+      return slab_alloc(newsize, user);
+
+   /* the block is large enough already */
+   if (oldc && oldc == newc)
+      return ptr;
+
+   /* both sizes are served by the host */
+   if (!oldc && !newc) {
+      block = slab->host.realloc(ptr, oldsize, newsize, slab->host.user);
+      if (block) {
+         ++slab->large.nallocs;
+         ++slab->large.nfrees;
+      }
+      return block;
+   }
+
+   block = slab_alloc(newsize, user);
+   if (!block)
+      return NULL;
+   memcpy(block, ptr, min_i32(oldsize, newsize));
+   slab_free(ptr, oldsize, user);
+   return block;
+}
+
+kintern void
+slab_init(struct slab *slab, struct koji_allocator *host)
+{
+   memset(slab, 0, sizeof *slab);
+   slab->host = *host;
+}
+
+kintern void
+slab_deinit(struct slab *slab)
+{
+   while (slab->pages) {
+      struct slab_page *page = slab->pages;
+      slab->pages = page->next;
+      slab->host.free(page, KOJI_SLAB_PAGE_SIZE, slab->host.user);
+   }
+}
+
+kintern struct koji_allocator
+slab_allocator(struct slab *slab)
+{
+   struct koji_allocator alloc;
+   alloc.user = slab;
+   alloc.alloc = slab_alloc;
+   alloc.realloc = slab_realloc;
+   alloc.free = slab_free;
+   return alloc;
+}
@@ -0,0 +1,102 @@
+/*
+ * koji scripting language - slab allocator
+ *
+ * Copyright (C) 2017 Canio Massimo Tristano
+ *
+ * This source file is part of the koji scripting language, distributed under
+ * the MIT license. See koji.h for further licensing information.
+ */
+
+#pragma once
+
+#include "kplatform.h"
+
+/*
+ * Size in bytes of the blocks of the smallest size class, the blocks of class
+ * i are (i + 1) * SLAB_GRANULE bytes long.
+ */
+#define SLAB_GRANULE 16
+
+/*
+ * Number of size classes. Allocations larger than the blocks of the largest
+ * class go straight to the host allocator.
+ */
+#define SLAB_CLASSES 16
+
+/*
+ * Size in bytes of the largest allocation served by a size class.
+ */
+#define SLAB_MAX_SIZE (SLAB_GRANULE * SLAB_CLASSES)
+
+/*
+ * Size in bytes of the pages requested to the host allocator and carved into
+ * the blocks of a single size class.
+ */
+#ifndef KOJI_SLAB_PAGE_SIZE
+#define KOJI_SLAB_PAGE_SIZE (16 * 1024)
+#endif
+
+/*
+ * A free block, linked to the next free block of its class.
+ */
+struct slab_block {
+   struct slab_block *next;
+};
+
+/*
+ * A page requested to the host allocator, its header is followed by the
+ * blocks. Pages are linked to be returned to the host on slab_deinit().
+ */
+struct slab_page {
+   struct slab_page *next; /* the page allocated before this one */
+};
+
+/*
+ * A size class: the list of its free blocks and the part of its last page
+ * not handed out yet, along with the class counters. The allocations larger
+ * than the largest class are counted in a class of their own.
+ */
+struct slab_class {
+   struct slab_block *free; /* the first free block */
+   char *cursor; /* next block of the last page never handed out */
+   char *end; /* end of the blocks of the last page */
+   int32_t npages; /* number of pages of this class */
+   int32_t nlive; /* number of blocks currently allocated */
+   uint64_t nallocs; /* number of allocations */
+   uint64_t nfrees; /* number of frees */
+};
+
+/*
+ * A slab allocator. It serves the small allocations of a koji state, object
+ * headers and small arrays mostly, from pages of blocks of the same size
+ * class: freed blocks are pushed to the free list of their class and are
+ * handed out again by the next allocation of the class, without calling the
+ * host allocator. Pages are only returned to the host on slab_deinit().
+ * As the size of a block is known from the size passed to free, blocks have
+ * no header.
+ */
+struct slab {
+   struct koji_allocator host; /* the allocator pages are requested to */
+   struct slab_page *pages; /* last page allocated */
+   struct slab_class classes[SLAB_CLASSES]; /* the size classes */
+   struct slab_class large; /* counters of the allocations to the host */
+};
+
+/*
+ * Initializes [slab] to request its pages to allocator [host].
+ */
+kintern void
+slab_init(struct slab *slab, struct koji_allocator *host);
+
+/*
+ * Returns all the pages of [slab] to its host allocator. The blocks still
+ * allocated are released with them.
+ */
+kintern void
+slab_deinit(struct slab *slab);
+
+/*
+ * Returns the koji allocator interface allocating from [slab].
+ */
+kintern struct koji_allocator
+slab_allocator(struct slab *slab);
@@ -13,6 +13,9 @@
 #include "kio.h"
 #include "kvm.h"
 #include "kstring.h"
+#include "kaot.h"
+#include "kprofile.h"
+#include "kslab.h"
 
 #include <string.h>
 #include <stdio.h>
@@ -23,6 +26,7 @@
 struct koji_state {
 	struct koji_allocator alloc;  /* the allocator to use */
 	struct vm vm;                 /* the virtual machine */
+	struct slab *slab;            /* the slab [alloc] allocates from or NULL */
 };
 
 /*
@@ -36,9 +40,11 @@ handle_issue(struct sourceloc sloc, const char *message, void *user)
 	koji_push_string(state, message, (int32_t)strlen(message));
 }
 
-
-KOJI_API koji_state_t *
-koji_open(struct koji_allocator *alloc)
+/*
+ * Opens a state allocating from [alloc], through a slab allocator if [slab].
+ */
+static koji_state_t *
+state_open(struct koji_allocator *alloc, bool slab)
 {
 	alloc = alloc ? alloc : default_alloc();
 	if (!alloc)
@@ -49,23 +55,53 @@ koji_open(struct koji_allocator *alloc)
 		return NULL;
 
 	state->alloc = *alloc;
-	vm_init(&state->vm, alloc);
+	state->slab = NULL;
+	if (slab) {
+		state->slab = kalloc(struct slab, 1, alloc);
+		if (!state->slab) {
+			kfree(state, 1, alloc);
+			return NULL;
+		}
+		slab_init(state->slab, alloc);
+		state->alloc = slab_allocator(state->slab);
+	}
+	vm_init(&state->vm, &state->alloc);
 
-   /* record builtin functions */
+	return state;
+}
 
+KOJI_API koji_state_t *
+koji_open(struct koji_allocator *alloc)
+{
+	return state_open(alloc, false);
+}
 
-	return state;
+KOJI_API koji_state_t *
+koji_open_slab(struct koji_allocator *alloc)
+{
+	return state_open(alloc, true);
 }
 
 KOJI_API void
 koji_close(koji_state_t *state)
 {
+	struct koji_allocator host = state->alloc;
+
 	vm_deinit(&state->vm);
-	kfree(state, 1, &state->alloc);
+	if (state->slab) {
+		host = state->slab->host;
+		slab_deinit(state->slab);
+		kfree(state->slab, 1, &host);
+	}
+	kfree(state, 1, &host);
 }
 
-KOJI_API koji_result_t
-koji_load(koji_state_t *state, struct koji_source *source)
+/*
+ * Compiles [source] into the prototype written to [proto].
+ */
+static koji_result_t
+compile_source(koji_state_t *state, struct koji_source *source,
+   struct prototype **proto)
 {
 	struct compile_info ci;
 	ci.alloc = state->alloc;
@@ -73,16 +109,25 @@ koji_load(koji_state_t *state, struct koji_source *source)
 	ci.issue_handler.handle = handle_issue;
 	ci.issue_handler.user = state;
 	ci.cls_string = &state->vm.cls_string;
+   ci.strings = &state->vm.strings;
+   return compile(&ci, proto);
+}
 
+KOJI_API koji_result_t
+koji_load(koji_state_t *state, struct koji_source *source)
+{
 	/* compile the source into a prototype */
 	struct prototype *proto = NULL;
-   koji_result_t result = compile(&ci, &proto);
+   koji_result_t result = compile_source(state, source, &proto);
 
    /* some error occurred and the prototype could not be compiled, report the
 	 * error. */
    if (result)
       return result;
 
+   /* run the ahead-of-time compiled code of this script if linked in */
+   aot_bind(proto);
+
 	/* reset the num of references as the ref count will be increased when the
 	 * prototype is referenced by a the new frame */
 	proto->refs = 0;
@@ -116,6 +161,52 @@ koji_load_file(koji_state_t *state, const char *filename)
 	return r;
 }
 
+KOJI_API koji_result_t
+koji_emit_c(koji_state_t *state, const char *filename, const char *cfilename)
+{
+   struct koji_source src;
+   struct prototype *proto = NULL;
+   koji_result_t result;
+   const char *name, *ext;
+   char *modname;
+   int32_t len;
+   FILE *out;
+
+   if (!source_file_open(&src, filename)) {
+      koji_push_stringf(state, "cannot open file '%s'.", filename);
+      return KOJI_ERROR_COMPILE;
+   }
+   result = compile_source(state, &src, &proto);
+   source_file_close(&src);
+   if (result)
+      return result;
+
+   out = fopen(cfilename, "w");
+   if (!out) {
+      prototype_release(proto, &state->alloc);
+      koji_push_stringf(state, "cannot open file '%s'.", cfilename);
+      return KOJI_ERROR_COMPILE;
+   }
+
+   /* the module is named after the script file name without extension */
+   name = strrchr(filename, '/');
+   name = name ? name + 1 : filename;
+   ext = strrchr(name, '.');
+   len = ext ? (int32_t)(ext - name) : (int32_t)strlen(name);
+   modname = kalloca(len + 1);
+   memcpy(modname, name, len);
+   modname[len] = '\0';
+
+   if (!aot_emit(proto, modname, out, &state->alloc)) {
+      koji_push_stringf(state, "'%s' uses instructions not supported by the "
+         "virtual machine.", filename);
+      result = KOJI_ERROR_COMPILE;
+   }
+   fclose(out);
+   prototype_release(proto, &state->alloc);
+   return result;
+}
+
 KOJI_API
 koji_result_t koji_run(koji_state_t *state)
 {
@@ -125,10 +216,8 @@ koji_result_t koji_run(koji_state_t *state)
 KOJI_API void
 koji_push_string(koji_state_t *state, const char *chars, int32_t len)
 {
-	struct string *str = string_new(&state->vm.cls_string, &state->alloc, len);
-	memcpy(&str->chars, chars, len);
-	str->chars[len] = 0;
-	*vm_push(&state->vm) = value_obj(str);
+	*vm_push(&state->vm) = value_new_stringn(&state->vm.cls_string,
+      &state->alloc, chars, len);
 }
 
 KOJI_API void
@@ -136,35 +225,27 @@ koji_push_stringf(koji_state_t *state, const char *format, ...)
 {
 	va_list args;
 	va_start(args, format);
-	int32_t size = vsnprintf(0, 0, format, args);
-	struct string *str = string_new(&state->vm.cls_string, &state->alloc, size);
-	vsnprintf(str->chars, size + 1, format, args);
-	*vm_push(&state->vm) = value_obj(str);
+	*vm_push(&state->vm) = value_new_stringfv(&state->vm.cls_string,
+      &state->alloc, format, args);
 	va_end(args);
 }
 
 KOJI_API const char *
 koji_string(koji_state_t *state, int32_t offset)
 {
-	union value value = *vm_top(&state->vm, offset);
-	if (!value_isobj(value))
-		return NULL;
-	struct string *str = value_getobjv(value);
-	if (str->object.class != &state->vm.cls_string)
+	union value *value = vm_top(&state->vm, offset);
+	if (!value_isstring(*value, &state->vm.cls_string))
 		return NULL;
-	return str->chars;
+	return value_string_cstr(value);
 }
 
 KOJI_API int32_t
 koji_string_length(koji_state_t *state, int32_t offset)
 {
 	union value value = *vm_top(&state->vm, offset);
-	if (!value_isobj(value))
+	if (!value_isstring(value, &state->vm.cls_string))
 		return -1;
-	struct string *str = value_getobjv(value);
-	if (str->object.class != &state->vm.cls_string)
-		return -1;
-	return str->len;
+	return value_string_len(value);
 }
 
 KOJI_API void
@@ -172,3 +253,137 @@ koji_pop(koji_state_t *state, int32_t n)
 {
 	vm_popn(&state->vm, n);
 }
+
+KOJI_API int
+koji_collect(koji_state_t *state, int budget)
+{
+#ifdef KOJI_GC
+   return gc_collect(&state->vm, budget);
+#else
+   return collector_step(&state->vm, budget);
+#endif
+}
+
+KOJI_API void
+koji_collect_budget(koji_state_t *state, int budget)
+{
+#ifdef KOJI_GC
+   state->vm.gc.budget = max_i32(budget, 0);
+#else
+   state->vm.collector.budget = max_i32(budget, 0);
+#endif
+}
+
+KOJI_API koji_result_t
+koji_profile_start(koji_state_t *state, int32_t interval)
+{
+#ifdef KOJI_PROFILER
+   if (profiler_start(&state->vm, interval))
+      return KOJI_OK;
+   koji_push_stringf(state, "cannot start profiling.");
+#else
+   (void)interval;
+   koji_push_stringf(state, "profiling is not supported on this platform.");
+#endif
+   return KOJI_ERROR_RUNTIME;
+}
+
+KOJI_API koji_result_t
+koji_profile_stop(koji_state_t *state, const char *filename)
+{
+#ifdef KOJI_PROFILER
+   FILE *out;
+
+   if (!state->vm.profiler) {
+      koji_push_stringf(state, "no profiling is running.");
+      return KOJI_ERROR_RUNTIME;
+   }
+   out = fopen(filename, "w");
+   profiler_stop(&state->vm, out);
+   if (!out) {
+      koji_push_stringf(state, "cannot open file '%s'.", filename);
+      return KOJI_ERROR_RUNTIME;
+   }
+   fclose(out);
+   return KOJI_OK;
+#else
+   (void)filename;
+   koji_push_stringf(state, "profiling is not supported on this platform.");
+   return KOJI_ERROR_RUNTIME;
+#endif
+}
+
+KOJI_API int32_t
+koji_stats(koji_state_t *state, koji_opcount_fn_t fn, void *user)
+{
+#ifdef KOJI_OPCOUNT
+   struct vm *vm = &state->vm;
+   struct koji_opcount count;
+
+   /* opcode totals */
+   count.proto = count.pc = -1;
+   for (int32_t op = 0; op <= OP_JIT; ++op) {
+      if (!vm->opcounts[op])
+         continue;
+      count.op = OP_STRINGS[op];
+      count.count = vm->opcounts[op];
+      fn(&count, user);
+   }
+
+   /* instruction counts, reported with the opcode they have been decoded
+      to */
+   for (int32_t p = 0; p < vm->ncounted; ++p) {
+      struct prototype *proto = vm->counted[p];
+      count.proto = p;
+      for (int32_t pc = 0; pc < proto->ninstrs; ++pc) {
+         if (!proto->counts[pc])
+            continue;
+         count.op = OP_STRINGS[proto->code[pc].op];
+         count.pc = pc;
+         count.count = proto->counts[pc];
+         fn(&count, user);
+      }
+   }
+   return 1;
+#else
+   (void)state, (void)fn, (void)user;
+   return 0;
+#endif
+}
+
+KOJI_API void
+koji_stats_reset(koji_state_t *state)
+{
+#ifdef KOJI_OPCOUNT
+   struct vm *vm = &state->vm;
+   memset(vm->opcounts, 0, sizeof vm->opcounts);
+   for (int32_t p = 0; p < vm->ncounted; ++p)
+      memset(vm->counted[p]->counts, 0,
+         sizeof(uint64_t) * vm->counted[p]->ninstrs);
+#else
+   (void)state;
+#endif
+}
+
+KOJI_API int
+koji_slab_stats(koji_state_t *state, koji_slab_fn_t fn, void *user)
+{
+   struct slab *slab = state->slab;
+   struct koji_slab_class stats;
+
+   if (!slab)
+      return 0;
+   for (int32_t i = 0; i <= SLAB_CLASSES; ++i) {
+      struct slab_class *c = i < SLAB_CLASSES ? slab->classes + i :
+         &slab->large;
+      if (!c->nallocs)
+         continue;
+      stats.size = i < SLAB_CLASSES ? (i + 1) * SLAB_GRANULE : 0;
+      stats.pages = c->npages;
+      stats.live = c->nlive;
+      stats.allocs = c->nallocs;
+      stats.frees = c->nfrees;
+      fn(&stats, user);
+   }
+   return 1;
+}
@@ -21,13 +21,222 @@ string_new(struct class *cls_string, struct koji_allocator *alloc, int32_t len)
 	s->object.refs = 1;
 	s->object.class = cls_string;
 	s->len = len;
+   s->interned = false;
+   s->hashed = false;
+   s->kind = STRING_FLAT;
+   s->hash = 0;
+   s->chars = (char *)(s + 1);
+#ifdef KOJI_GC
+   gc_link(cls_string->gc, &s->object);
+#endif
 	return s;
 }
 
+/*
+ * Creates a rope of length [len] concatenating strings [left] and [right],
+ * taking over the references to them.
+ */
+static struct string *
+rope_new(struct class *cls_string, struct koji_allocator *alloc, int32_t len,
+   union value left, union value right)
+{
+	struct string *s =
+      alloc->alloc(sizeof(struct string) + sizeof(struct rope), alloc->user);
+   struct rope *rope = (struct rope *)(s + 1);
+	s->object.refs = 1;
+	s->object.class = cls_string;
+	s->len = len;
+   s->interned = false;
+   s->hashed = false;
+   s->kind = STRING_ROPE;
+   s->hash = 0;
+   s->chars = NULL;
+   rope->left = left;
+   rope->right = right;
+   rope->alloc = alloc;
+#ifdef KOJI_GC
+   gc_link(cls_string->gc, &s->object);
+#endif
+	return s;
+}
+
+/*
+ * Creates a slice of the [len] characters of flat string [parent] from
+ * [begin], taking over the reference to [parent].
+ */
+static struct string *
+slice_new(struct class *cls_string, struct koji_allocator *alloc,
+   struct string *parent, int32_t begin, int32_t len)
+{
+	struct string *s =
+      alloc->alloc(sizeof(struct string) + sizeof(struct slice), alloc->user);
+   struct slice *slice = (struct slice *)(s + 1);
+	s->object.refs = 1;
+	s->object.class = cls_string;
+	s->len = len;
+   s->interned = false;
+   s->hashed = false;
+   s->kind = STRING_SLICE;
+   s->hash = 0;
+   s->chars = parent->chars + begin;
+   slice->parent = parent;
+   slice->alloc = alloc;
+#ifdef KOJI_GC
+   gc_link(cls_string->gc, &s->object);
+#endif
+	return s;
+}
+
+/*
+ * Frees the header of string [s] and the characters a rope or a slice own.
+ */
+static void
+string_free_header(struct string *s, struct koji_allocator *alloc)
+{
+   switch (s->kind) {
+      case STRING_FLAT:
+         alloc->free(s, sizeof(*s) + s->len + 1, alloc->user);
+         break;
+      case STRING_ROPE:
+         if (s->chars)
+            alloc->free(s->chars, s->len + 1, alloc->user);
+         alloc->free(s, sizeof(*s) + sizeof(struct rope), alloc->user);
+         break;
+      case STRING_SLICE:
+         if (!((struct slice *)(s + 1))->parent)
+            alloc->free(s->chars, s->len + 1, alloc->user);
+         alloc->free(s, sizeof(*s) + sizeof(struct slice), alloc->user);
+         break;
+   }
+}
+
+/*
+ * Releases string [val], short or not. Ropes freed are walked down one part
+ * while the other waits on a stack, the part followed being the one that is
+ * not a rope if any, so that ropes built by appending or prepending are freed
+ * with a single pending part and none is freed recursively. Strings are freed
+ * by the collector instead if built with KOJI_GC.
+ */
+static void
+string_release(union value val, struct koji_allocator *alloc)
+{
+#ifdef KOJI_GC
+   (void)val, (void)alloc;
+#else
+   union value buffer[16], *pending = buffer;
+   int32_t npending = 0, pendingcap = 16;
+
+   for (;;) {
+      struct string *s = value_isobj(val) ? value_getobjv(val) : NULL;
+
+      if (s && --s->object.refs == 0) {
+         struct rope *rope = (struct rope *)(s + 1);
+         struct slice *slice = (struct slice *)(s + 1);
+         struct class *cls = s->object.class;
+
+         val = value_nil();
+         if (s->kind == STRING_ROPE && !s->chars) {
+            struct string *left = value_isobj(rope->left) ?
+               value_getobjv(rope->left) : NULL;
+            bool leftrope = left && left->kind == STRING_ROPE && !left->chars;
+            if (npending == pendingcap) {
+               union value *grown = kalloc(union value, pendingcap * 2, alloc);
+               memcpy(grown, pending, npending * sizeof *pending);
+               if (pending != buffer)
+                  kfree(pending, pendingcap, alloc);
+               pending = grown;
+               pendingcap *= 2;
+            }
+            pending[npending++] = leftrope ? rope->left : rope->right;
+            val = leftrope ? rope->right : rope->left;
+         }
+         else if (s->kind == STRING_SLICE && slice->parent) {
+            val = value_obj(slice->parent);
+         }
+         string_free_header(s, alloc);
+         --cls->object.refs;
+         continue;
+      }
+      if (npending == 0)
+         break;
+      val = pending[--npending];
+   }
+   if (pending != buffer)
+      kfree(pending, pendingcap, alloc);
+#endif
+}
+
 kintern void
 string_free(struct string *s, struct koji_allocator *alloc)
 {
-   alloc->free(s, sizeof(*s) + s->len + 1, alloc->user);
+   if (s->kind == STRING_ROPE && !s->chars) {
+      struct rope *rope = (struct rope *)(s + 1);
+      string_release(rope->right, alloc);
+      string_release(rope->left, alloc);
+   }
+   else if (s->kind == STRING_SLICE && ((struct slice *)(s + 1))->parent) {
+      string_release(value_obj(((struct slice *)(s + 1))->parent), alloc);
+   }
+   string_free_header(s, alloc);
+}
+
+kintern const char *
+string_flatten(struct string *s)
+{
+   struct rope *rope = (struct rope *)(s + 1);
+   struct koji_allocator *alloc = rope->alloc;
+   char *chars = alloc->alloc(s->len + 1, alloc->user);
+   char *end = chars + s->len;
+   union value *lefts = NULL, part = value_obj(s);
+   int32_t nlefts = 0, leftscap = 0;
+
+   /* copy the parts from the last one, ropes not flattened yet are walked
+      down their right part while their left part waits on a stack */
+   for (;;) {
+      struct string *str = value_isobj(part) ? value_getobjv(part) : NULL;
+      if (str && !str->chars) {
+         struct rope *r = (struct rope *)(str + 1);
+         if (nlefts == leftscap) {
+            int32_t newcap = leftscap ? leftscap * 2 : 16;
+            lefts = lefts ? krealloc(lefts, leftscap, newcap, alloc) :
+               kalloc(union value, newcap, alloc);
+            leftscap = newcap;
+         }
+         lefts[nlefts++] = r->left;
+         part = r->right;
+         continue;
+      }
+      end -= value_string_len(part);
+      memcpy(end, value_string_chars(&part), value_string_len(part));
+      if (nlefts == 0)
+         break;
+      part = lefts[--nlefts];
+   }
+   assert(end == chars);
+   chars[s->len] = '\0';
+   if (lefts)
+      kfree(lefts, leftscap, alloc);
+
+   string_release(rope->right, alloc);
+   string_release(rope->left, alloc);
+   rope->left = rope->right = value_nil();
+   s->chars = chars;
+   return chars;
+}
+
+kintern const char *
+string_detach(struct string *s)
+{
+   struct slice *slice = (struct slice *)(s + 1);
+   struct koji_allocator *alloc = slice->alloc;
+   char *chars = alloc->alloc(s->len + 1, alloc->user);
+
+   memcpy(chars, s->chars, s->len);
+   chars[s->len] = '\0';
+   string_release(value_obj(slice->parent), alloc);
+   slice->parent = NULL;
+   s->chars = chars;
+   return chars;
 }
 
 kintern union value
@@ -39,12 +248,61 @@ value_new_string(struct class *cls_string, struct koji_allocator *alloc,
 	return value_obj(s);
 }
 
+kintern union value
+value_new_stringn(struct class *cls_string, struct koji_allocator *alloc,
+   const char *chars, int32_t len)
+{
+   union value s;
+   if (len <= SHORTSTR_MAX)
+      return value_shortstr(chars, len);
+   s = value_new_string(cls_string, alloc, len);
+   memcpy(((struct string *)value_getobj(s))->chars, chars, len);
+   ((struct string *)value_getobj(s))->chars[len] = '\0';
+   return s;
+}
+
+kintern union value
+value_new_substring(struct class *cls_string, struct koji_allocator *alloc,
+   union value const *parent, int32_t begin, int32_t len)
+{
+   struct string *p;
+
+   assert(begin >= 0 && len >= 0 && begin + len <= value_string_len(*parent));
+   if (len <= SHORTSTR_MAX)
+      return value_shortstr(value_string_chars(parent) + begin, len);
+
+   /* slices reference a string that owns its characters, not another slice
+      still referencing its own parent */
+   p = value_getobjv(*parent);
+   string_chars(p);
+   if (p->kind == STRING_SLICE && ((struct slice *)(p + 1))->parent) {
+      begin += (int32_t)(p->chars - ((struct slice *)(p + 1))->parent->chars);
+      p = ((struct slice *)(p + 1))->parent;
+   }
+   if (begin == 0 && len == p->len) {
+      ++p->object.refs;
+      return value_obj(p);
+   }
+   ++p->object.refs;
+   ++cls_string->object.refs;
+   return value_obj(slice_new(cls_string, alloc, p, begin, len));
+}
+
 kintern union value
 value_new_stringfv(struct class *cls_string, struct koji_allocator *alloc,
    const char *format, va_list args)
 {
-	int32_t len = vsnprintf(NULL, 0, format, args);
-	union value s = value_new_string(cls_string, alloc, len);
+   char chars[SHORTSTR_MAX + 1];
+   va_list copy;
+   int32_t len;
+   union value s;
+
+   va_copy(copy, args);
+	len = vsnprintf(chars, sizeof chars, format, copy);
+   va_end(copy);
+   if (len <= SHORTSTR_MAX)
+      return value_shortstr(chars, len);
+	s = value_new_string(cls_string, alloc, len);
 	vsnprintf(((struct string*)value_getobj(s))->chars, len + 1, format, args);
 	return s;
 }
@@ -61,6 +319,138 @@ value_new_stringf(struct class *cls_string, struct koji_allocator *alloc,
 	return value;
 }
 
+/*
+ * Inserts string [s] in the free slot of [set] its hash leads to, the set
+ * must have one and not hold [s] yet.
+ */
+static void
+string_set_insert(struct string_set *set, struct string *s)
+{
+   uint32_t mask = (uint32_t)set->capacity - 1;
+   uint32_t i = (uint32_t)s->hash & mask;
+   while (set->strings[i])
+      i = (i + 1) & mask;
+   set->strings[i] = s;
+   ++set->size;
+}
+
+/*
+ * Releases the strings of [set] that only the set references and moves the
+ * others to a new slot array, twice as large if still more than half full.
+ * The set does not hold the strings if built with KOJI_GC, they are dropped
+ * by string_set_sweep() instead.
+ */
+static void
+string_set_rehash(struct string_set *set)
+{
+   struct string **old = set->strings;
+   int32_t oldcap = set->capacity, live = 0;
+
+   for (int32_t i = 0; i < oldcap; ++i) {
+      struct string *s = old[i];
+      if (!s)
+         continue;
+#ifndef KOJI_GC
+      if (s->object.refs == 1) {
+         string_free(s, &set->alloc);
+         --set->cls_string->object.refs;
+         old[i] = NULL;
+         continue;
+      }
+#endif
+      ++live;
+   }
+
+   if (live >= oldcap / 2)
+      set->capacity *= 2;
+   set->strings = kalloc(struct string *, set->capacity, &set->alloc);
+   memset(set->strings, 0, set->capacity * sizeof *set->strings);
+   set->size = 0;
+   for (int32_t i = 0; i < oldcap; ++i) {
+      if (old[i])
+         string_set_insert(set, old[i]);
+   }
+   kfree(old, oldcap, &set->alloc);
+}
+
+kintern void
+string_set_init(struct string_set *set, struct class *cls_string,
+   struct koji_allocator *alloc)
+{
+   set->size = 0;
+   set->capacity = 64;
+   set->cls_string = cls_string;
+   set->alloc = *alloc;
+   set->strings = kalloc(struct string *, set->capacity, alloc);
+   memset(set->strings, 0, set->capacity * sizeof *set->strings);
+}
+
+kintern void
+string_set_deinit(struct string_set *set)
+{
+#ifndef KOJI_GC
+   for (int32_t i = 0; i < set->capacity; ++i) {
+      struct string *s = set->strings[i];
+      if (s && --s->object.refs == 0) {
+         string_free(s, &set->alloc);
+         --set->cls_string->object.refs;
+      }
+   }
+#endif
+   kfree(set->strings, set->capacity, &set->alloc);
+}
+
+#ifdef KOJI_GC
+kintern void
+string_set_sweep(struct string_set *set, uint8_t white)
+{
+   for (int32_t i = 0; i < set->capacity; ++i) {
+      struct string *s = set->strings[i];
+      if (s && s->object.color == white) {
+         s->interned = false;
+         set->strings[i] = NULL;
+      }
+   }
+   string_set_rehash(set);
+}
+#endif
+
+kintern union value
+string_intern(struct string_set *set, const char *chars, int32_t len)
+{
+   uint64_t hash;
+   uint32_t mask = (uint32_t)set->capacity - 1;
+   struct string *s;
+
+   if (len <= SHORTSTR_MAX)
+      return value_shortstr(chars, len);
+
+   hash = murmur2(chars, len, 0);
+   for (uint32_t i = (uint32_t)hash & mask; (s = set->strings[i]);
+        i = (i + 1) & mask) {
+      if (s->hash == hash && s->len == len
+          && memcmp(s->chars, chars, len) == 0) {
+         ++s->object.refs;
+         return value_obj(s);
+      }
+   }
+
+   /* keep the set at most three quarters full */
+   if (set->size + 1 > set->capacity / 4 * 3)
+      string_set_rehash(set);
+
+   s = string_new(set->cls_string, &set->alloc, len);
+   ++set->cls_string->object.refs;
+   memcpy(s->chars, chars, len);
+   s->chars[len] = '\0';
+   s->interned = true;
+   s->hashed = true;
+   s->hash = hash;
+   ++s->object.refs; /* held by the set */
+   string_set_insert(set, s);
+   return value_obj(s);
+}
+
 /* string class related */
 
 static void
@@ -69,22 +459,112 @@ string_dtor(struct vm* vm, struct object *obj)
    string_free((struct string *)obj, &vm->alloc);
 }
 
+/*
+ * Returns a new string with the characters of string [lhs] followed by the
+ * ones of string [rhs]. Long strings are concatenated to a rope referencing
+ * them, so that appending to a string repeatedly only copies its characters
+ * once, when they are first read.
+ */
+static union value
+string_concat(struct vm *vm, union value const *lhs, union value const *rhs)
+{
+   int32_t llen = value_string_len(*lhs), rlen = value_string_len(*rhs);
+   char chars[SHORTSTR_MAX];
+   union value res;
+   struct string *str;
+
+   if (llen + rlen >= ROPE_MIN_LEN && llen > 0 && rlen > 0) {
+      if (value_isobj(*lhs))
+         ++value_getobj(*lhs)->refs;
+      if (value_isobj(*rhs))
+         ++value_getobj(*rhs)->refs;
+      ++vm->cls_string.object.refs;
+      return value_obj(rope_new(&vm->cls_string, &vm->alloc, llen + rlen, *lhs,
+         *rhs));
+   }
+   if (llen + rlen <= SHORTSTR_MAX) {
+      memcpy(chars, value_string_chars(lhs), llen);
+      memcpy(chars + llen, value_string_chars(rhs), rlen);
+      return value_shortstr(chars, llen + rlen);
+   }
+   res = value_new_string(&vm->cls_string, &vm->alloc, llen + rlen);
+   str = value_getobjv(res);
+   memcpy(str->chars, value_string_chars(lhs), llen);
+   memcpy(str->chars + llen, value_string_chars(rhs), rlen);
+   str->chars[llen + rlen] = '\0';
+   return res;
+}
+
+/*
+ * Returns a new string with the characters of string [lhs] repeated [mult]
+ * times.
+ */
+static union value
+string_repeat(struct vm *vm, union value const *lhs, int32_t mult)
+{
+   int32_t len = value_string_len(*lhs), offset = 0;
+   char buf[SHORTSTR_MAX], *chars = buf;
+   union value res = value_nil();
+
+   if (mult < 0)
+      mult = 0;
+   if (len * mult > SHORTSTR_MAX) {
+      res = value_new_string(&vm->cls_string, &vm->alloc, len * mult);
+      chars = ((struct string *)value_getobj(res))->chars;
+      chars[len * mult] = '\0';
+   }
+   for (int32_t i = 0; i < mult; ++i) {
+      memcpy(chars + offset, value_string_chars(lhs), len);
+      offset += len;
+   }
+   return chars == buf ? value_shortstr(buf, offset) : res;
+}
+
+/*
+ * Orders strings [lhs] and [rhs], short or not, by length first and then by
+ * characters.
+ */
+static int32_t
+string_compare(union value const *lhs, union value const *rhs)
+{
+   int32_t llen = value_string_len(*lhs), rlen = value_string_len(*rhs);
+   return llen < rlen ? -1 : llen > rlen ? 1 :
+      memcmp(value_string_chars(lhs), value_string_chars(rhs), llen);
+}
+
+kintern union value
+shortstr_arith(struct vm *vm, enum class_op_kind op, union value lhs,
+   union value rhs)
+{
+   static const char *OPERATOR_STR[] = {
+      "-", "+", "-", "*", "/", "%"
+   };
+
+   if (op == CLASS_OP_ADD && value_isstring(rhs, &vm->cls_string))
+      return string_concat(vm, &lhs, &rhs);
+   if (op == CLASS_OP_MUL && value_isnum(rhs))
+      return string_repeat(vm, &lhs, (int32_t)rhs.num);
+   vm_throw(vm, "cannot apply binary operator '%s' between a string and a %s.",
+      OPERATOR_STR[op], value_type_str(rhs));
+   return value_nil(); /* never executed */
+}
+
+kintern int32_t
+shortstr_compare(union value a, union value b)
+{
+   return string_compare(&a, &b);
+}
+
 static union class_op_result
 string_op_add(struct vm* vm, struct object *obj, enum class_op_kind op,
    union value *args, int32_t nargs)
 {
    assert(nargs == 1);
-   struct class *cls = obj->class;
-	struct string *lstr = (struct string *)obj; /* lhs str */
-	struct string *rstr = value_getobjv(*args); /* rhs str */
+   union value lhs = value_obj(obj);
    union class_op_result res;
 
-	if (value_isobj(*args) && rstr->object.class == cls) {
-      struct string *res_str;
-		res.value = value_new_string(cls, &vm->alloc, lstr->len + rstr->len);
-      res_str = value_getobjv(res.value);
-		memcpy(res_str->chars, &lstr->chars, lstr->len);
-		memcpy(res_str->chars + lstr->len, &rstr->chars, rstr->len + 1);
+	if (value_isstring(*args, obj->class)) {
+      res.value = string_concat(vm, &lhs, args);
 		return res;
 	}
 
@@ -96,8 +576,7 @@ string_op_mul(struct vm* vm, struct object *obj, enum class_op_kind op,
    union value *args, int32_t nargs)
 {
    assert(nargs == 1);
-   struct class *cls = obj->class;
-	struct string *lstr = (struct string *)obj;
+   union value lhs = value_obj(obj);
    union class_op_result res;
 
 	if (!value_isnum(*args)) {
@@ -106,18 +585,7 @@ string_op_mul(struct vm* vm, struct object *obj, enum class_op_kind op,
 		return res;
 	}
 
-	int32_t mult = (int32_t)args->num;
-	int32_t str_len = lstr->len;
-	res.value = value_new_string(cls, &vm->alloc, str_len * mult);
-	struct string *res_str = value_getobjv(res.value);
-
-	int32_t offset = 0;
-	for (int32_t i = 0; i < mult; ++i) {
-		memcpy(res_str->chars + offset, &lstr->chars, str_len);
-		offset += str_len;
-	}
-
-	res_str->chars[res_str->len] = 0;
+   res.value = string_repeat(vm, &lhs, (int32_t)args->num);
 	return res;
 }
 
@@ -128,13 +596,17 @@ string_op_compare(struct vm* vm, struct object *obj, enum class_op_kind op,
    assert(nargs == 1);
    struct class *cls = obj->class;
 	struct string *lstr = (struct string *)obj;
-	struct string *rstr = value_getobjv(*args);
+   union value lhs = value_obj(obj);
 
-   if (value_isobj(*args) && rstr->object.class == cls) {
+   if (value_isshortstr(*args)) {
+	   union class_op_result res;
+      res.compare = string_compare(&lhs, args);
+      return res;
+   }
+   if (value_isobj(*args) && value_getobj(*args)->class == cls) {
 	   union class_op_result res;
-      res.compare =  lstr->len < rstr->len ? -1 :
-						   lstr->len > rstr->len ? 1 :
-						   memcmp(&lstr->chars, &rstr->chars, lstr->len);
+      res.compare = string_equal(lstr, value_getobjv(*args)) ? 0 :
+                    string_compare(&lhs, args);
       return res;
    }
 
@@ -149,7 +621,7 @@ string_op_hash(struct vm* vm, struct object *obj, enum class_op_kind op,
    (void)args;
 	struct string *lstr = (struct string *)obj;
    union class_op_result res;
-   res.hash = murmur2(&lstr->chars, lstr->len, 0);
+   res.hash = string_hash(lstr);
    return res;
 }
 
@@ -160,7 +632,7 @@ string_op_get(struct vm* vm, struct object *obj, enum class_op_kind op,
    assert(nargs == 1);
 	struct string *lstr = (struct string *)obj;
    union class_op_result res;
-   res.value = value_num(lstr->chars[(uint32_t)args->num]);
+   res.value = value_num(string_chars(lstr)[(uint32_t)args->num]);
 	return res;
 }
 
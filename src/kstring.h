@@ -12,26 +12,196 @@
 #include "kvalue.h"
 #include "kclass.h"
 
+#include <string.h>
+
+/*
+ * Kinds of str objects.
+ */
+enum string_kind {
+   STRING_FLAT, /* the characters follow the header */
+   STRING_ROPE, /* the concatenation of two strings, see [struct rope] */
+   STRING_SLICE, /* a part of another string, see [struct slice] */
+};
+
 /*
- * A str object.
+ * A str object. The characters of a flat string follow the header. A rope is
+ * the concatenation of two strings, it holds them in a [struct rope] after the
+ * header until its characters are first read, then they are copied to a
+ * buffer of their own and the two strings released. A slice references the
+ * characters of a parent string in a [struct slice] after the header and
+ * only copies them when they must be null terminated.
  */
 struct string {
    struct object object; /* the object base */
    int32_t len; /* str length excluding null byte */
-   char chars[]; /* str chars */
+   bool interned; /* whether the string is in a string set */
+   bool hashed; /* whether [hash] is set */
+   uint8_t kind; /* the string kind, a [string_kind] */
+   uint64_t hash; /* murmur2 hash of [chars], set on first use */
+   char *chars; /* str chars, NULL for a rope not flattened yet, not null
+                   terminated for a slice referencing its parent */
 };
 
+/*
+ * The parts of a rope not flattened yet.
+ */
+struct rope {
+   union value left; /* the string the rope begins with */
+   union value right; /* the string the rope ends with */
+   struct koji_allocator *alloc; /* allocator of the rope and its parts */
+};
+
+/*
+ * Minimum length of the concatenation of two strings for it to be a rope
+ * instead of a copy of their characters.
+ */
+#define ROPE_MIN_LEN 128
+
+/*
+ * The parent of a slice not copied yet.
+ */
+struct slice {
+   struct string *parent; /* the string whose characters are referenced */
+   struct koji_allocator *alloc; /* allocator of the slice */
+};
+
+/*
+ * A set of interned strings. Strings with the same characters interned in the
+ * same set are the same object, so that they compare equal by pointer, and
+ * their hash is computed once. The set holds a reference to each string, the
+ * strings referenced only by the set are released when the set would grow.
+ */
+struct string_set {
+   struct string **strings; /* the strings, NULL for free slots */
+   int32_t size; /* number of strings in the set */
+   int32_t capacity; /* capacity of [strings], a power of two */
+   struct class *cls_string; /* the `str` class */
+   struct koji_allocator alloc; /* allocator of the set and its strings */
+};
+
+/*
+ * Copies the characters of rope [s] to a buffer and releases its parts.
+ * Returns the characters.
+ */
+kintern const char *
+string_flatten(struct string *s);
+
+/*
+ * Copies the characters of slice [s] to a buffer of its own, null terminated,
+ * and releases its parent. Returns the characters.
+ */
+kintern const char *
+string_detach(struct string *s);
+
+/*
+ * Returns the [s->len] characters of [s], flattening it if it is a rope not
+ * flattened yet. They are not null terminated if [s] is a slice.
+ */
+static const char *
+string_chars(struct string *s)
+{
+   return s->chars ? s->chars : string_flatten(s);
+}
+
+/*
+ * Returns the null terminated characters of [s], copying those of a slice if
+ * it still references its parent.
+ */
+static const char *
+string_cstr(struct string *s)
+{
+   if (s->kind == STRING_SLICE && ((struct slice *)(s + 1))->parent)
+      return string_detach(s);
+   return string_chars(s);
+}
+
+/*
+ * Returns the hash of string [s], computing and storing it on first use. The
+ * characters of [s] must not change after its hash is computed.
+ */
+static uint64_t
+string_hash(struct string *s)
+{
+   if (!s->hashed) {
+      s->hash = murmur2(string_chars(s), s->len, 0);
+      s->hashed = true;
+   }
+   return s->hash;
+}
+
+/*
+ * Returns whether strings [a] and [b] have the same characters. Strings of the
+ * same length are compared by hash first, so that different strings rarely
+ * compare their characters. Distinct interned strings are never equal.
+ */
+static bool
+string_equal(struct string *a, struct string *b)
+{
+   if (a == b)
+      return true;
+   if (a->len != b->len || (a->interned && b->interned))
+      return false;
+   return string_hash(a) == string_hash(b)
+       && memcmp(a->chars, b->chars, a->len) == 0; /* flattened by hash */
+}
+
+/*
+ * Returns whether [val] is a string, either short or a str object of class
+ * [cls_string].
+ */
+static bool
+value_isstring(union value val, struct class const *cls_string)
+{
+   return value_isshortstr(val) ||
+      (value_isobj(val) && value_getobj(val)->class == cls_string);
+}
+
+/*
+ * Returns the length of string [val], short or not.
+ */
+static int32_t
+value_string_len(union value val)
+{
+   return value_isshortstr(val) ? value_shortstr_len(val) :
+      ((struct string *)value_getobj(val))->len;
+}
+
+/*
+ * Returns the characters of the string [val] points to, short or not, like
+ * [string_chars]. The characters of a short string are in [val] itself.
+ */
+static const char *
+value_string_chars(union value const *val)
+{
+   return value_isshortstr(*val) ? value_shortstr_chars(val) :
+      string_chars((struct string *)value_getobj(*val));
+}
+
+/*
+ * Returns the null terminated characters of the string [val] points to, short
+ * or not, like [string_cstr].
+ */
+static const char *
+value_string_cstr(union value const *val)
+{
+   return value_isshortstr(*val) ? value_shortstr_chars(val) :
+      string_cstr((struct string *)value_getobj(*val));
+}
+
 /*
  * Allocates a str with specified length [len] using specified alloc.
- * [cls_string] is a pointer to the `str` class.
+ * [cls_string] is a pointer to the `str` class. Strings of at most
+ * SHORTSTR_MAX characters must be short strings instead, so that equal
+ * strings are always both short or both objects.
  */
 kintern struct string *
 string_new(struct class *cls_string, struct koji_allocator *, int32_t len);
 
 /*
- * Frees string using specified allocator. This function will decrement string
- * class reference count, which must be greater than one as this function
- * will not handle string class destruction.
+ * Frees string using specified allocator, releasing the parts of a rope. This
+ * function will not decrement string class reference count for [s], which
+ * must be greater than one as this function will not handle string class
+ * destruction.
  */
 kintern void
 string_free(struct string *, struct koji_allocator *);
@@ -43,19 +213,82 @@ kintern union value
 value_new_string(struct class *cls_string, struct koji_allocator *, int32_t len);
 
 /*
- * Allocates a str like [string_new] and returns an object value with it.
+ * Returns a string value of the [len] characters [chars], a short string if
+ * they fit, a new str otherwise.
+ */
+kintern union value
+value_new_stringn(struct class *cls_string, struct koji_allocator *,
+   const char *chars, int32_t len);
+
+/*
+ * Returns a string value of the [len] characters of string [parent] from
+ * [begin], a short string if they fit, a slice referencing [parent]
+ * otherwise. The range must be within [parent].
+ */
+kintern union value
+value_new_substring(struct class *cls_string, struct koji_allocator *,
+   union value const *parent, int32_t begin, int32_t len);
+
+/*
+ * Returns a string value of the formatted characters like [value_new_stringn].
  */
 kintern union value
 value_new_stringfv(struct class *cls_string, struct koji_allocator *,
    const char* format, va_list args);
 
 /*
- * Allocates a str like [string_new] and returns an object value with it.
+ * Returns a string value of the formatted characters like [value_new_stringn].
  */
 kintern union value
 value_new_stringf(struct class *cls_string, struct koji_allocator *,
    const char *format, ...);
 
+/*
+ * Initializes the empty string [set] of strings of class [cls_string].
+ */
+kintern void
+string_set_init(struct string_set *set, struct class *cls_string,
+   struct koji_allocator *alloc);
+
+/*
+ * Releases the strings in [set] and deinitializes it.
+ */
+kintern void
+string_set_deinit(struct string_set *set);
+
+#ifdef KOJI_GC
+/*
+ * Removes from [set] the strings the collector has not reached, those still of
+ * color [white] at the end of the mark phase.
+ */
+kintern void
+string_set_sweep(struct string_set *set, uint8_t white);
+#endif
+
+/*
+ * Returns a new reference to the string of [set] with the [len] characters
+ * [chars], interning a new string if not found. Short strings are not
+ * interned, they are returned as they are.
+ */
+kintern union value
+string_intern(struct string_set *set, const char *chars, int32_t len);
+
+/*
+ * Applies arithmetic operator [op] to the short string [lhs] and [rhs] and
+ * returns the new value. Short strings are not objects, so the VM calls this
+ * instead of the `str` class operators.
+ */
+kintern union value
+shortstr_arith(struct vm *, enum class_op_kind op, union value lhs,
+   union value rhs);
+
+/*
+ * Orders short strings [a] and [b] like str objects, by length first and then
+ * by characters.
+ */
+kintern int32_t
+shortstr_compare(union value a, union value b);
+
 /*
  * Initializes class [cls_string] to "str". [class_class] is the "class"
  * class.
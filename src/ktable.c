@@ -9,30 +9,125 @@
 
 #include "ktable.h"
 #include "kvm.h"
+#include "kstring.h"
 
-struct table_pair {
-	union value key;
-	union value value;
-};
+#include <string.h>
 
-static struct
-table_pair *table_find(struct vm *vm, struct table_pair *entries,
-   int32_t capacity, union value key)
+/*
+ * Returns whether table keys [a] and [b] are the same key: either the same
+ * value or two strings with the same characters.
+ */
+static bool
+table_key_equal(struct vm *vm, union value a, union value b)
 {
-	uint64_t hash = vm_value_hash(vm, key);
-	int32_t index = hash % capacity;
-	while (!value_isnil(entries[index].value)
-           && entries[index].key.bits != key.bits) {
-		index = (index + 1) % capacity;
-	}
-	return entries + index;
+   struct string *sa, *sb;
+
+   if (a.bits == b.bits)
+      return true;
+   if (!value_isobj(a) || !value_isobj(b))
+      return false;
+
+   sa = value_getobjv(a);
+   sb = value_getobjv(b);
+   return sa->object.class == &vm->cls_string
+       && sb->object.class == &vm->cls_string
+       && string_equal(sa, sb);
 }
 
-kintern void
-table_init(struct table *t, struct koji_allocator *alloc, int32_t capacity)
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define TABLE_SSE2
+#endif
+
+/*
+ * Returns the index of the lowest set bit of non-zero [bits].
+ */
+static int32_t
+lowest_bit(uint32_t bits)
 {
-	t->size = 0;
-	t->capacity = capacity;
+#if defined(__GNUC__) || defined(__clang__)
+   return __builtin_ctz(bits);
+#else
+   int32_t i = 0;
+   while (!(bits & 1)) {
+      bits >>= 1;
+      ++i;
+   }
+   return i;
+#endif
+}
+
+/*
+ * Loads the control bytes of the group of slots starting at [ctrl]. Sets bit i
+ * of [*match] if control byte i is [h2] and of [*empty] if it is free.
+ */
+static void
+group_probe(uint8_t const *ctrl, uint8_t h2, uint32_t *match, uint32_t *empty)
+{
+#ifdef TABLE_SSE2
+   __m128i group = _mm_loadu_si128((__m128i const *)ctrl);
+   *match = (uint32_t)_mm_movemask_epi8(
+      _mm_cmpeq_epi8(group, _mm_set1_epi8((char)h2)));
+   *empty = (uint32_t)_mm_movemask_epi8(group);
+#else
+   *match = *empty = 0;
+   for (int32_t i = 0; i < TABLE_GROUP; ++i) {
+      *match |= (uint32_t)(ctrl[i] == h2) << i;
+      *empty |= (uint32_t)(ctrl[i] == TABLE_EMPTY) << i;
+   }
+#endif
+}
+
+/*
+ * Sets the control byte of slot [index] of [t] to [c], along with its clone.
+ */
+static void
+set_ctrl(struct table *t, int32_t index, uint8_t c)
+{
+   t->ctrl[index] = c;
+   if (index < TABLE_GROUP)
+      t->ctrl[t->capacity + index] = c;
+}
+
+/*
+ * Returns the index of the slot of [t] holding [key] or, if not found, of the
+ * free slot where it would be inserted. [hash] is the hash of [key].
+ */
+static int32_t
+table_find(struct table *t, struct vm *vm, union value key, uint64_t hash)
+{
+   uint32_t mask = (uint32_t)t->capacity - 1;
+   uint32_t pos = (uint32_t)(hash >> 7) & mask;
+   uint8_t h2 = (uint8_t)(hash & 0x7f);
+
+   /* the load factor guarantees a free slot to stop at */
+   for (;;) {
+      uint32_t match, empty;
+      group_probe(t->ctrl + pos, h2, &match, &empty);
+
+      /* the key can only be in the slots before the first free one */
+      if (empty)
+         match &= (empty & (0 - empty)) - 1;
+      for (; match; match &= match - 1) {
+         int32_t index = (int32_t)((pos + lowest_bit(match)) & mask);
+         if (table_key_equal(vm, t->pairs[index].key, key))
+            return index;
+      }
+      if (empty)
+         return (int32_t)((pos + lowest_bit(empty)) & mask);
+      pos = (pos + TABLE_GROUP) & mask;
+   }
+}
+
+/*
+ * Allocates the slots of [t] for [capacity] pairs, all free.
+ */
+static void
+table_alloc(struct table *t, struct koji_allocator *alloc, int32_t capacity)
+{
+   t->capacity = capacity;
+   t->ctrl = kalloc(uint8_t, capacity + TABLE_GROUP, alloc);
+   memset(t->ctrl, TABLE_EMPTY, capacity + TABLE_GROUP);
 	t->pairs = kalloc(struct table_pair, capacity, alloc);
 	for (int32_t i = 0; i < capacity; ++i) {
 		t->pairs[i].key = value_nil();
@@ -40,65 +135,464 @@ table_init(struct table *t, struct koji_allocator *alloc, int32_t capacity)
 	}
 }
 
-kintern void
-table_deinit(struct table *t, struct vm *vm)
+/*
+ * Moves the pairs of [t] to [capacity] new slots.
+ */
+static void
+table_resize(struct table *t, struct vm *vm, int32_t capacity)
 {
-	for (int32_t i = 0; i < t->capacity; ++i) {
-		vm_value_destroy(vm, t->pairs[i].key);
-		vm_value_destroy(vm, t->pairs[i].value);
-	}
-	kfree(t->pairs, t->capacity, &vm->alloc);
+   struct table old = *t;
+
+   table_alloc(t, &vm->alloc, capacity);
+   for (int32_t i = 0; i < old.capacity; ++i) {
+      uint64_t hash;
+      int32_t index;
+      if (old.ctrl[i] == TABLE_EMPTY)
+         continue;
+      hash = vm_value_hash(vm, old.pairs[i].key);
+      index = table_find(t, vm, old.pairs[i].key, hash);
+      set_ctrl(t, index, (uint8_t)(hash & 0x7f));
+      t->pairs[index] = old.pairs[i];
+   }
+
+   kfree(old.ctrl, old.capacity + TABLE_GROUP, &vm->alloc);
+   kfree(old.pairs, old.capacity, &vm->alloc);
 }
 
-kintern void
-table_set(struct table *t, struct vm *vm, union value key, union value val)
+/*
+ * Frees slot [index] of [t], whose key and value have already been released,
+ * and shrinks the table if it became sparse.
+ */
+static void
+table_remove_at(struct table *t, struct vm *vm, int32_t index)
 {
-	struct table_pair *pair = table_find(vm, t->pairs, t->capacity, key);
+   uint32_t mask = (uint32_t)t->capacity - 1;
+   uint32_t hole = (uint32_t)index;
 
-	t->size += value_isnil(pair->value);
+   /* shift back the pairs following the hole in the probe sequence whose
+      home slot does not lie between the hole and them, so that no pair is
+      ever separated from its home slot by a free slot */
+   for (uint32_t j = (hole + 1) & mask; t->ctrl[j] != TABLE_EMPTY;
+        j = (j + 1) & mask) {
+      uint32_t home = (uint32_t)(vm_value_hash(vm, t->pairs[j].key) >> 7)
+         & mask;
+      if (((j - home) & mask) >= ((j - hole) & mask)) {
+         t->pairs[hole] = t->pairs[j];
+         set_ctrl(t, (int32_t)hole, t->ctrl[j]);
+         hole = j;
+      }
+   }
+   t->pairs[hole].key = value_nil();
+   t->pairs[hole].value = value_nil();
+   set_ctrl(t, (int32_t)hole, TABLE_EMPTY);
+   --t->size;
 
-	vm_value_destroy(vm, pair->key);
-	vm_value_set(vm, &pair->key, key);
+   /* shrink to half when occupancy falls below a fourth of the growth
+      threshold, so that the table is 40% full afterwards */
+   if (t->capacity > TABLE_GROUP && t->size < t->capacity * 20 / 100)
+      table_resize(t, vm, t->capacity / 2);
+}
+
+/*
+ * Sets [key] to [val] in the hash part of [t], [val] is not nil.
+ */
+static void
+table_hash_set(struct table *t, struct vm *vm, union value key,
+   union value val)
+{
+   uint64_t hash = vm_value_hash(vm, key);
+   int32_t index = table_find(t, vm, key, hash);
+	struct table_pair *pair = t->pairs + index;
+
+   if (t->ctrl[index] == TABLE_EMPTY) {
+      set_ctrl(t, index, (uint8_t)(hash & 0x7f));
+      ++t->size;
+   }
 
-	vm_value_destroy(vm, pair->value);
+	/* replaces and releases the previous key and value */
+	vm_value_set(vm, &pair->key, key);
 	vm_value_set(vm, &pair->value, val);
 
 	/* rehash? */
-	if (t->size > t->capacity * 80 / 100) {
-      int32_t newcap = t->capacity * 2;
-		struct table_pair *new_pairs = kalloc(struct table_pair,
-         newcap, &vm->alloc);
+	if (t->size > t->capacity * 80 / 100)
+      table_resize(t, vm, t->capacity * 2);
+}
 
-		for (int32_t i = 0; i < newcap; ++i)
-			new_pairs[i].key = new_pairs[i].value = value_nil();
+/*
+ * Removes [key] from the hash part of [t] if there. If [val] is not NULL, the
+ * value is moved to it instead of being released. Returns whether the key was
+ * found.
+ */
+static bool
+table_hash_remove(struct table *t, struct vm *vm, union value key,
+   union value *val)
+{
+   int32_t index;
+   if (t->size == 0)
+      return false;
+   index = table_slot(t, vm, key);
+   if (t->ctrl[index] == TABLE_EMPTY)
+      return false;
+   vm_value_destroy(vm, t->pairs[index].key);
+   if (val)
+      *val = t->pairs[index].value;
+   else
+      vm_value_destroy(vm, t->pairs[index].value);
+   table_remove_at(t, vm, index);
+   return true;
+}
 
-		for (int32_t i = 0; i < t->capacity; ++i)
-			if (!value_isnil(t->pairs[i].value))
-				*table_find(vm, new_pairs, newcap, t->pairs[i].key) = t->pairs[i];
+/*
+ * Resizes the array part of [t] to [capacity] elements.
+ */
+static void
+table_array_resize(struct table *t, struct vm *vm, int32_t capacity)
+{
+   if (capacity == 0) {
+      kfree(t->array, t->arraycap, &vm->alloc);
+      t->array = NULL;
+   }
+   else {
+      t->array = krealloc(t->array, t->arraycap, capacity, &vm->alloc);
+   }
+   t->arraycap = capacity;
+}
 
-		kfree(t->pairs, t->capacity, &vm->alloc);
+/*
+ * Appends [val], not nil, to the array part of [t] as the value of key
+ * [t->arraysize]. The key leaves the hash part if there, as do the keys
+ * following it, which move to the array part.
+ */
+static void
+table_append(struct table *t, struct vm *vm, union value val)
+{
+   union value next;
 
-		t->capacity = newcap;
-		t->pairs = new_pairs;
+   if (t->arraysize == t->arraycap)
+      table_array_resize(t, vm, t->arraycap ? t->arraycap * 2 : 4);
+   t->array[t->arraysize] = value_nil();
+   vm_value_set(vm, t->array + t->arraysize, val);
+   ++t->arraysize;
+   ++t->arraycount;
+
+   if (t->size > 0) {
+      table_hash_remove(t, vm, value_num(t->arraysize - 1), NULL);
+      while (t->arraysize < INT32_MAX &&
+             table_hash_remove(t, vm, value_num(t->arraysize), &next)) {
+         if (t->arraysize == t->arraycap)
+            table_array_resize(t, vm, t->arraycap * 2);
+         t->array[t->arraysize++] = next;
+         ++t->arraycount;
+      }
+   }
+}
+
+kintern void
+shape_init(struct shape *root)
+{
+   root->parent = NULL;
+   root->key = value_nil();
+   root->nkeys = 0;
+   root->nchildren = 0;
+   root->children = NULL;
+   root->childrenlen = 0;
+}
+
+kintern void
+shape_deinit(struct shape *root, struct vm *vm)
+{
+   for (int32_t i = 0; i < root->nchildren; ++i) {
+      shape_deinit(root->children[i], vm);
+      kfree(root->children[i], 1, &vm->alloc);
+   }
+   if (root->children)
+      kfree(root->children, root->childrenlen, &vm->alloc);
+   vm_value_destroy(vm, root->key);
+}
+
+kintern int32_t
+shape_slot(struct shape *shape, struct vm *vm, union value key)
+{
+   for (; shape->parent; shape = shape->parent) {
+      if (table_key_equal(vm, shape->key, key))
+         return shape->nkeys - 1;
+   }
+   return -1;
+}
+
+/*
+ * Returns the child of [shape] adding string [key], which [shape] does not
+ * have, creating it if needed. Returns NULL if [shape] cannot transition.
+ */
+static struct shape *
+shape_add(struct shape *shape, struct vm *vm, union value key)
+{
+   struct shape *child;
+
+   for (int32_t i = 0; i < shape->nchildren; ++i) {
+      if (table_key_equal(vm, shape->children[i]->key, key))
+         return shape->children[i];
+   }
+   if (shape->nkeys == SHAPE_MAX_KEYS
+       || shape->nchildren == SHAPE_MAX_CHILDREN)
+      return NULL;
+
+   if (shape->nchildren == shape->childrenlen) {
+      int32_t newlen = shape->childrenlen ? shape->childrenlen * 2 : 2;
+      shape->children = shape->children ?
+         krealloc(shape->children, shape->childrenlen, newlen, &vm->alloc) :
+         kalloc(struct shape *, newlen, &vm->alloc);
+      shape->childrenlen = newlen;
+   }
+   child = kalloc(struct shape, 1, &vm->alloc);
+   shape_init(child);
+   child->parent = shape;
+   vm_value_set(vm, &child->key, key);
+   child->nkeys = shape->nkeys + 1;
+   shape->children[shape->nchildren++] = child;
+   return child;
+}
+
+/*
+ * Switches [t] from shape mode to dictionary mode, moving the values of the
+ * shape keys to the hash part.
+ */
+static void
+table_to_dict(struct table *t, struct vm *vm)
+{
+   struct shape *shape = t->shape;
+   union value *slots = t->slots;
+   int32_t cap = TABLE_GROUP;
+
+   while (cap * 80 / 100 <= shape->nkeys)
+      cap *= 2;
+   table_alloc(t, &vm->alloc, cap);
+   t->shape = NULL;
+   t->slots = NULL;
+   for (; shape->parent; shape = shape->parent) {
+      table_hash_set(t, vm, shape->key, slots[shape->nkeys - 1]);
+      vm_value_destroy(vm, slots[shape->nkeys - 1]);
+   }
+   if (slots)
+      kfree(slots, t->slotscap, &vm->alloc);
+   t->slotscap = 0;
+}
+
+kintern void
+table_shape_add(struct table *t, struct vm *vm, struct shape *child,
+   union value val)
+{
+   int32_t slot = child->nkeys - 1;
+   if (slot == t->slotscap) {
+      int32_t newcap = t->slotscap ? t->slotscap * 2 : 4;
+      t->slots = t->slots ?
+         krealloc(t->slots, t->slotscap, newcap, &vm->alloc) :
+         kalloc(union value, newcap, &vm->alloc);
+      t->slotscap = newcap;
+   }
+   t->slots[slot] = value_nil();
+   vm_value_set(vm, t->slots + slot, val);
+   t->shape = child;
+}
+
+/*
+ * Returns whether [key] can be added to a shape: short strings and interned
+ * ones, the keys written in scripts. Shapes live as long as the VM and
+ * reference their keys, so strings built at runtime, slices pinning their
+ * parent and ropes included, would accumulate.
+ */
+static bool
+shape_key(struct vm *vm, union value key)
+{
+   struct string *s;
+
+   if (value_isshortstr(key))
+      return true;
+   if (!value_isstring(key, &vm->cls_string))
+      return false;
+   s = value_getobjv(key);
+   return s->interned;
+}
+
+/*
+ * Sets [key] to [val], not nil, in the slots of [t] in shape mode, adding it
+ * to the shape if needed. Returns false if [key] cannot be in a shape or the
+ * shape cannot transition.
+ */
+static bool
+table_shape_set(struct table *t, struct vm *vm, union value key,
+   union value val)
+{
+   struct shape *shape;
+   int32_t slot = shape_slot(t->shape, vm, key);
+
+   if (slot >= 0) {
+      vm_value_set(vm, t->slots + slot, val);
+      return true;
+   }
+   if (!shape_key(vm, key) || !(shape = shape_add(t->shape, vm, key)))
+      return false;
+
+   table_shape_add(t, vm, shape, val);
+   return true;
+}
+
+/*
+ * Drops the trailing nils of the array part of [t]. If then less than half of
+ * its elements are set, they all move to the hash part, as the keys of a
+ * sparse array part are better hashed.
+ */
+static void
+table_array_trim(struct table *t, struct vm *vm)
+{
+   while (t->arraysize > 0 && value_isnil(t->array[t->arraysize - 1]))
+      --t->arraysize;
+
+   if (t->arraycount < t->arraysize / 2) {
+      int32_t n = t->arraysize;
+      if (t->shape)
+         table_to_dict(t, vm);
+      t->arraysize = t->arraycount = 0;
+      for (int32_t i = 0; i < n; ++i) {
+         if (!value_isnil(t->array[i])) {
+            table_hash_set(t, vm, value_num(i), t->array[i]);
+            vm_value_destroy(vm, t->array[i]);
+         }
+      }
+   }
+
+   if (t->arraysize <= t->arraycap / 4)
+      table_array_resize(t, vm, t->arraysize ? t->arraycap / 2 : 0);
+}
+
+kintern void
+table_init(struct table *t, struct koji_allocator *alloc, int32_t capacity)
+{
+   int32_t cap = TABLE_GROUP;
+   while (cap < capacity)
+      cap *= 2;
+	t->size = 0;
+   table_alloc(t, alloc, cap);
+   t->array = NULL;
+   t->arraysize = 0;
+   t->arraycount = 0;
+   t->arraycap = 0;
+   t->shape = NULL;
+   t->slots = NULL;
+   t->slotscap = 0;
+}
+
+kintern void
+table_init_shape(struct table *t, struct shape *root)
+{
+   t->size = 0;
+   t->capacity = 0;
+   t->ctrl = NULL;
+   t->pairs = NULL;
+   t->array = NULL;
+   t->arraysize = 0;
+   t->arraycount = 0;
+   t->arraycap = 0;
+   t->shape = root;
+   t->slots = NULL;
+   t->slotscap = 0;
+}
+
+kintern void
+table_deinit(struct table *t, struct vm *vm)
+{
+	for (int32_t i = 0; i < t->capacity; ++i) {
+		vm_value_destroy(vm, t->pairs[i].key);
+		vm_value_destroy(vm, t->pairs[i].value);
 	}
+   if (t->pairs) {
+      kfree(t->ctrl, t->capacity + TABLE_GROUP, &vm->alloc);
+      kfree(t->pairs, t->capacity, &vm->alloc);
+   }
+   if (t->shape) {
+      for (int32_t i = 0; i < t->shape->nkeys; ++i)
+         vm_value_destroy(vm, t->slots[i]);
+      if (t->slots)
+         kfree(t->slots, t->slotscap, &vm->alloc);
+   }
+   for (int32_t i = 0; i < t->arraysize; ++i)
+      vm_value_destroy(vm, t->array[i]);
+   if (t->array)
+      kfree(t->array, t->arraycap, &vm->alloc);
+}
+
+kintern void
+table_set(struct table *t, struct vm *vm, union value key, union value val)
+{
+   int32_t index = table_array_index(key, t->arraysize + 1);
+
+   if (index >= 0 && index < t->arraysize) {
+      union value *elem = t->array + index;
+      t->arraycount += !value_isnil(val) - !value_isnil(*elem);
+      vm_value_set(vm, elem, val);
+      if (value_isnil(val))
+         table_array_trim(t, vm);
+   }
+   else if (value_isnil(val)) {
+      if (t->shape && shape_slot(t->shape, vm, key) >= 0)
+         table_to_dict(t, vm); /* shapes never lose keys */
+      table_hash_remove(t, vm, key, NULL);
+   }
+   else if (index >= 0 && index < INT32_MAX) {
+      table_append(t, vm, val);
+   }
+   else if (!t->shape) {
+      table_hash_set(t, vm, key, val);
+   }
+   else if (!table_shape_set(t, vm, key, val)) {
+      table_to_dict(t, vm);
+      table_hash_set(t, vm, key, val);
+   }
+}
+
+kintern void
+table_remove(struct table *t, struct vm *vm, union value key)
+{
+   table_set(t, vm, key, value_nil());
 }
 
 kintern union value
-table_get(struct table *table, struct vm *vm, union value key)
+table_get(struct table *t, struct vm *vm, union value key)
+{
+   int32_t index = table_array_index(key, t->arraysize);
+   if (index >= 0)
+      return t->array[index];
+   if (t->shape) {
+      index = shape_slot(t->shape, vm, key);
+      return index >= 0 ? t->slots[index] : value_nil();
+   }
+   if (t->size == 0)
+      return value_nil();
+	return t->pairs[table_find(t, vm, key, vm_value_hash(vm, key))].value;
+}
+
+kintern int32_t
+table_slot(struct table *t, struct vm *vm, union value key)
 {
-	return table_find(vm, table->pairs, table->capacity, key)->value;
+	return table_find(t, vm, key, vm_value_hash(vm, key));
 }
 
 kintern union value 
-value_new_table(struct class *cls_table, struct koji_allocator *alloc,
-   int32_t capacity)
+value_new_table(struct class *cls_table, struct shape *root,
+   struct koji_allocator *alloc)
 {
 	struct object_table *object_table = kalloc(struct object_table, 1, alloc);
 	if (!object_table) return value_nil(); /* fixme */
 	++cls_table->object.refs;
 	object_table->object.refs = 1;
 	object_table->object.class = cls_table;
-	table_init(&object_table->table, alloc, capacity);
+	table_init_shape(&object_table->table, root);
+   object_table->root = -1;
+   object_table->color = COLLECT_BLACK;
+   object_table->counted = false;
+#ifdef KOJI_GC
+   gc_link(cls_table->gc, &object_table->object);
+#endif
 	return value_obj(object_table);
 }
 
@@ -106,6 +600,7 @@ static void
 table_dtor(struct vm *vm, struct object *obj)
 {
    struct object_table *tbl = (struct object_table *)obj;
+   collector_forget(vm, tbl);
 	table_deinit(&tbl->table, vm);
    kfree(tbl, 1, &vm->alloc);
 }
@@ -128,6 +623,11 @@ table_op_set(struct vm *vm, struct object *obj, enum class_op_kind op,
    assert(nargs == 2);
 	struct object_table *tbl = (struct object_table*)obj;
    union class_op_result res;
+#ifdef KOJI_GC
+   gc_barrier(&vm->gc, obj);
+#else
+   collector_barrier(vm, tbl);
+#endif
 	table_set(&tbl->table, vm, args[0], args[1]);
    res.value = args[1];
 	return res;
@@ -13,16 +13,107 @@
 
 #define TABLE_DEFAULT_CAPACITY 16
 
+/*
+ * Number of slots whose control bytes are probed at once.
+ */
+#define TABLE_GROUP 16
+
+/*
+ * A key-value pair in a table. Free pairs have a nil key and value.
+ */
+struct table_pair {
+	union value key;
+	union value value;
+};
+
+/*
+ * Maximum number of keys of a shape. Tables in shape mode switch to
+ * dictionary mode when adding more.
+ */
+#define SHAPE_MAX_KEYS 16
+
+/*
+ * Maximum number of transitions from a shape. Tables in shape mode switch to
+ * dictionary mode when adding a key that would need more, which bounds the
+ * shapes created by tables used as dictionaries.
+ */
+#define SHAPE_MAX_CHILDREN 32
+
+/*
+ * Describes the string keys of tables in shape mode and the slot holding the
+ * value of each. Shapes form a transition tree rooted in the empty shape of
+ * the VM: the child of a shape for a key is the shape of tables that add the
+ * key next, whose value goes in the slot following those of the parent keys.
+ * Tables adding the same keys in the same order thus share their shape.
+ * Shapes never change and live as long as the VM, so that the slot of a key
+ * in a shape can be cached.
+ */
+struct shape {
+   struct shape *parent; /* shape this transitions from, NULL for the root */
+   union value key; /* the key added by the transition, a string */
+   int32_t nkeys; /* number of keys, the slot of [key] is nkeys - 1 */
+   int32_t nchildren; /* number of transitions to child shapes */
+   struct shape **children; /* child shapes, [childrenlen] capacity */
+   int32_t childrenlen; /* capacity of the [children] array */
+};
+
 /*
  * Data structure used to efficiently map keys to values, implemented with
- * a hash map.
+ * an open addressing hash map. Each slot has a control byte that is either
+ * TABLE_EMPTY or the low 7 bits of the hash of the key it holds, so that a
+ * probe compares the control bytes of a group of TABLE_GROUP slots at once
+ * and only the keys whose hash bits match. Slots are probed linearly from
+ * the one indexed by the high bits of the key hash; the capacity is a power
+ * of two so that indices wrap around with a mask. The control bytes of the
+ * first TABLE_GROUP slots are cloned past the last one, so that groups
+ * starting near the end can be loaded contiguously.
+ * Keys are removed by setting them to nil: following pairs are shifted back
+ * into the freed slot, so no tombstones are needed, and the table shrinks when
+ * it becomes sparse.
+ * Integer keys 0, 1, 2... set in order live in a dense array part instead,
+ * indexed by the key itself. Setting the key that follows the array part
+ * appends it, moving the keys after it from the hash part if there; when less
+ * than half of the array part is set, it moves to the hash part. Keys below
+ * [arraysize] are never in the hash part.
+ * Tables created by scripts start in shape mode, for they are mostly records
+ * with the same few string keys: the hash part is not allocated and string
+ * keys map to [slots] through the table [shape] instead. A table switches to
+ * dictionary mode, with a NULL [shape], when a key is removed or a key that
+ * is not a short or interned string or too many keys are added; this does not
+ * affect the array part.
  */
 struct table {
-	int32_t size;   /* number of elements in the table */
-	int32_t capacity;   /* capacity of the key-value array */
+	int32_t size;   /* number of elements in the hash part */
+	int32_t capacity;   /* capacity of the key-value array, a power of two */
+	uint8_t *ctrl; /* control byte of each slot, followed by the clones */
 	struct table_pair *pairs; /* key-value pairs */
+   union value *array; /* array part, the values of keys 0 to [arraysize) */
+   int32_t arraysize; /* number of keys in the array part */
+   int32_t arraycount; /* number of non-nil values in the array part */
+   int32_t arraycap; /* capacity of the array part */
+   struct shape *shape; /* shape of the string keys, NULL in dictionary mode */
+   union value *slots; /* values of the shape keys, by slot */
+   int32_t slotscap; /* capacity of the [slots] array */
 };
 
+/* control byte of free slots, full slots have the high bit clear */
+#define TABLE_EMPTY 0x80
+
+/*
+ * Returns [key] as an index of an array part of [size] elements, or -1 if it
+ * is not an integer in [0, size).
+ */
+static int32_t
+table_array_index(union value key, int32_t size)
+{
+   if (value_isnum(key) && key.num >= 0 && key.num < size) {
+      int32_t index = (int32_t)key.num;
+      if (index == key.num)
+         return index;
+   }
+   return -1;
+}
+
 /*
  * A koji table object.
  */
@@ -30,15 +121,46 @@ struct object_table
 {
 	struct object object;
 	struct table table;
+   int32_t root; /* index in the collector candidates, -1 if not there */
+   int32_t index; /* index in the tables of the running collection */
+   int32_t internal; /* references counted by the running collection */
+   uint8_t color; /* the collector color, a [collect_color] */
+   uint8_t counted; /* whether its references are counted by the collection */
 };
 
 /*
- * Initializes the table with specified allocator and the key-value array
- * with length [capacity].
+ * Initializes [root] as the empty shape at the root of a transition tree.
+ */
+kintern void
+shape_init(struct shape *root);
+
+/*
+ * Destroys the shapes of the transition tree of [root], which must not be in
+ * use by any table.
+ */
+kintern void
+shape_deinit(struct shape *root, struct vm*);
+
+/*
+ * Returns the slot of [key] in [shape] or -1 if [shape] does not have it.
+ */
+kintern int32_t
+shape_slot(struct shape*, struct vm*, union value key);
+
+/*
+ * Initializes the table in dictionary mode with specified allocator and the
+ * key-value array with length [capacity], rounded up to a power of two of at
+ * least TABLE_GROUP.
  */
 kintern void
 table_init(struct table*, struct koji_allocator *alloc, int32_t capacity);
 
+/*
+ * Initializes the table empty and in shape mode, with shape [root].
+ */
+kintern void
+table_init_shape(struct table*, struct shape *root);
+
 /*
  * Deinitializes specified table, destroying every key and value in it and
  * deallocating the used memory.
@@ -47,11 +169,26 @@ kintern void
 table_deinit(struct table*, struct vm*);
 
 /*
- * Adds the mapping between [key] and [value] in specified table.
+ * Adds the mapping between [key] and [value] in specified table. A nil
+ * [value] removes [key].
  */
 kintern void
 table_set(struct table*, struct vm*, union value key, union value val);
 
+/*
+ * Transitions the table in shape mode to [child], a child of its shape, and
+ * sets the key added by [child] to [val], not nil.
+ */
+kintern void
+table_shape_add(struct table*, struct vm*, struct shape *child,
+   union value val);
+
+/*
+ * Removes [key] and its value from the table, if there.
+ */
+kintern void
+table_remove(struct table*, struct vm*, union value key);
+
 /*
  * Returns the value associated to specified [key] or nil if not found.
  */
@@ -59,11 +196,21 @@ kintern union value
 table_get(struct table*, struct vm *vm, union value key);
 
 /*
- * Creates a new table object and returns it in a value.
+ * Returns the index of the pair holding [key] in the hash part or, if not
+ * found, of the free pair where the key would be inserted. Keys in the array
+ * part are never found. Indices are only valid until the table
+ * is next modified. The table must be in dictionary mode.
+ */
+kintern int32_t
+table_slot(struct table*, struct vm *vm, union value key);
+
+/*
+ * Creates a new empty table object in shape mode with shape [root] and
+ * returns it in a value.
  */
 kintern union value
-value_new_table(struct class *cls_table, struct koji_allocator *alloc,
-   int32_t capacity);
+value_new_table(struct class *cls_table, struct shape *root,
+   struct koji_allocator *alloc);
 
 /*
  * Initializes the table class.
@@ -12,14 +12,18 @@
 #include "ktable.h"
 #include "kstring.h"
 #include "kbytecode.h"
+#include "kclosure.h"
+#include "kjit.h"
 
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #ifndef KOJI_AMALGAMATE
 struct koji_state {
 	struct koji_allocator alloc;
 	struct vm vm;
+	struct slab *slab;
 };
 #endif
 
@@ -36,9 +40,196 @@ test_string(koji_state_t *state)
    assert(str->len == 12);
    assert(strcmp(str->chars, "hello world!") == 0);
 
+   /* the hash is computed on first use and stored */
+   assert(!str->hashed);
+   assert(string_hash(str) == murmur2("hello world!", 12, 0) && str->hashed);
+
+   union value other = value_new_stringf(&state->vm.cls_string,
+      &state->vm.alloc, "hello %s?", "world");
+   union value same = value_new_stringf(&state->vm.cls_string,
+      &state->vm.alloc, "hello %s!", "world");
+   assert(!string_equal(str, value_getobjv(other)));
+   assert(string_equal(str, value_getobjv(same)));
+
+   vm_value_destroy(&state->vm, same);
+   vm_value_destroy(&state->vm, other);
    vm_value_destroy(&state->vm, val);
 }
 
+static void
+test_shortstr(koji_state_t *state)
+{
+   struct vm *vm = &state->vm;
+   union value a = value_new_stringf(&vm->cls_string, &vm->alloc, "%s", "abc");
+   union value b = string_intern(&vm->strings, "abc", 3);
+   union value c = value_new_stringf(&vm->cls_string, &vm->alloc, "%s", "abcdef");
+
+   /* strings up to SHORTSTR_MAX characters are values equal by bits */
+   assert(value_isshortstr(a) && a.bits == b.bits);
+   assert(value_string_len(a) == 3 && strcmp(value_string_chars(&a), "abc") == 0);
+   assert(value_isobj(c) && value_string_len(c) == 6);
+
+   /* operators accept both forms */
+   koji_result_t res = koji_load_string(state,
+      "var s = \"ab\" + \"c\"\n"
+      "var t = { [s]: 1, [s + \"def\"]: 2 }\n"
+      "assert(s == \"abc\")\n"
+      "assert(s + \"def\" == \"abcdef\")\n"
+      "assert(s > \"ab\")\n"
+      "assert(s < \"abd\")\n"
+      "assert(\"x\" * 3 == \"xxx\")\n"
+      "assert(t.abc == 1)\n"
+      "assert(t.abcdef == 2)\n");
+   assert(res == KOJI_OK && koji_run(state) == KOJI_OK);
+   koji_push_string(state, "hi", 2);
+   assert(strcmp(koji_string(state, -1), "hi") == 0);
+   assert(koji_string_length(state, -1) == 2);
+   koji_pop(state, 1);
+   vm_value_destroy(vm, c);
+}
+
+static void
+test_rope(koji_state_t *state)
+{
+   /* long concatenations are ropes, flattened when their characters are
+      read, and equal to flat strings with the same characters */
+   koji_result_t res = koji_load_string(state,
+      "build = func (s, piece, n) {\n"
+      "   if (n == 0) { return s }\n"
+      "   return build(s + piece, piece, n - 1)\n"
+      "}\n"
+      "ropea = build(\"\", \"0123456789abcdef\", 4096)\n"
+      "ropeb = build(\"0123456789abcdef\", \"0123456789abcdef\", 4095)\n"
+      "assert(ropea == ropeb)\n"
+      "assert(ropea + \"!\" > ropeb)\n"
+      "ropec = build(\"\", \"xy\", 100)\n");
+   assert(res == KOJI_OK && koji_run(state) == KOJI_OK);
+
+   struct vm *vm = &state->vm;
+   union value names[3], ropes[3];
+   struct string *str;
+   struct table t;
+   for (int32_t i = 0; i < 3; ++i) {
+      names[i] = value_new_stringf(&vm->cls_string, &vm->alloc, "rope%c",
+         'a' + i);
+      ropes[i] = vm->globalvals[vm_global_slot(vm, names[i])];
+      vm_value_destroy(vm, names[i]);
+   }
+
+   /* a rope key finds the equal flat string key */
+   table_init(&t, &vm->alloc, TABLE_DEFAULT_CAPACITY);
+   table_set(&t, vm, ropes[0], value_num(1));
+   assert(table_get(&t, vm, ropes[1]).num == 1);
+   table_deinit(&t, vm);
+
+   str = value_getobjv(ropes[2]);
+   *vm_push(vm) = ropes[2];
+   ++str->object.refs;
+   assert(str->kind == STRING_ROPE && !str->chars && str->len == 200);
+   assert(koji_string_length(state, -1) == 200);
+   assert(strncmp(koji_string(state, -1), "xyxyxy", 6) == 0 && str->chars);
+   assert(str->chars[199] == 'y' && str->chars[200] == '\0');
+   koji_pop(state, 1);
+
+   /* deep ropes built by prepending or appending are released in constant
+      stack space */
+   res = koji_load_string(state,
+      "prepend = func (s, n) {\n"
+      "   if (n == 0) { return s }\n"
+      "   return prepend(\"ab\" + s, n - 1)\n"
+      "}\n"
+      "deep = prepend(\"0123456789\", 1000000)\n"
+      "assert(len(deep) == 2000010)\n"
+      "deep = build(\"\", \"0123456789\", 1000000)\n"
+      "deep = nil\n");
+   assert(res == KOJI_OK && koji_run(state) == KOJI_OK);
+}
+
+static void
+test_slice(koji_state_t *state)
+{
+   /* substrings reference the characters of their parent */
+   koji_result_t res = koji_load_string(state,
+      "var text = \"first line of the text|second line of the text\"\n"
+      "var nl = find(text, \"|\")\n"
+      "assert(nl == 22)\n"
+      "assert(find(text, \"line\", nl) == 30)\n"
+      "assert(find(text, \"none\") == -1)\n"
+      "first = sub(text, 0, nl)\n"
+      "second = sub(text, nl + 1)\n"
+      "word = sub(second, 7, 11)\n"
+      "assert(first == \"first line of the text\")\n"
+      "assert(len(second) == 23)\n"
+      "assert(word == \"line\")\n"
+      "assert(sub(second, 0, 6) + \"!\" == \"second!\")\n"
+      "tail = sub(second, 7)\n"
+      "assert(tail == \"line of the text\")\n"
+      "var z = 0\n"
+      "assert(find(text, \"line\", z / z) == 6)\n"
+      "assert(find(text, \"text\", 1000) == -1)\n"
+      "assert(sub(text, z / z, 5) == \"first\")\n"
+      "assert(sub(text, 30, z / z) == \"line of the text\")\n"
+      "assert(sub(text, 6.9, 10.2) == \"line\")\n"
+      "assert(sub(text, -3, 5) == \"first\")\n"
+      "assert(sub(text, 38, 1000) == \"the text\")\n"
+      "assert(sub(text, 10, 5) == \"\")\n");
+   assert(res == KOJI_OK && koji_run(state) == KOJI_OK);
+
+   struct vm *vm = &state->vm;
+   union value names[2], slices[2];
+   struct string *first, *tail;
+   names[0] = value_new_stringf(&vm->cls_string, &vm->alloc, "first");
+   names[1] = value_new_stringf(&vm->cls_string, &vm->alloc, "tail");
+   for (int32_t i = 0; i < 2; ++i) {
+      slices[i] = vm->globalvals[vm_global_slot(vm, names[i])];
+      vm_value_destroy(vm, names[i]);
+   }
+   first = value_getobjv(slices[0]);
+   tail = value_getobjv(slices[1]);
+
+   /* a slice of a slice references the first parent */
+   assert(first->kind == STRING_SLICE && tail->kind == STRING_SLICE);
+   assert(((struct slice *)(tail + 1))->parent ==
+          ((struct slice *)(first + 1))->parent);
+   assert(tail->chars == ((struct slice *)(tail + 1))->parent->chars + 30);
+
+   /* characters are copied when they must be null terminated */
+   *vm_push(vm) = slices[1];
+   ++tail->object.refs;
+   assert(strcmp(koji_string(state, -1), "line of the text") == 0);
+   assert(!((struct slice *)(tail + 1))->parent);
+   koji_pop(state, 1);
+}
+
+static void
+test_intern(koji_state_t *state)
+{
+   struct vm *vm = &state->vm;
+   union value a = string_intern(&vm->strings, "longkey", 7);
+   union value b = string_intern(&vm->strings, "longkey", 7);
+   struct string *str = value_getobjv(a);
+
+   /* equal strings are interned once with their hash */
+   assert(a.bits == b.bits && str->object.refs == 3 && str->interned);
+   assert(str->hash == murmur2("longkey", 7, 0));
+   vm_value_destroy(vm, a);
+   vm_value_destroy(vm, b);
+
+   /* strings only the set references are released as it fills up */
+   for (int32_t i = 0; i < 1000; ++i) {
+      char chars[16];
+      int32_t len = snprintf(chars, sizeof chars, "string%d", i);
+      vm_value_destroy(vm, string_intern(&vm->strings, chars, len));
+   }
+#ifdef KOJI_GC
+   /* the collector drops them once it finds them unreachable */
+   koji_collect(state, 0);
+   assert(vm->strings.size < 16);
+#else
+   assert(vm->strings.capacity <= 128);
+#endif
+}
+
 static void
 test_table(koji_state_t *state)
 {
@@ -57,7 +248,612 @@ test_table(koji_state_t *state)
 	for (int32_t i = 0; i < 100; ++i)
 		assert(table_get( &t, &state->vm, value_num(i)).num == i * 1000);
 
+   /* a slot holds its key, or is free if the key is not in the table */
+   table_set(&t, &state->vm, value_num(42.5), value_num(1));
+   int32_t slot = table_slot(&t, &state->vm, value_num(42.5));
+   assert(t.pairs[slot].key.bits == value_num(42.5).bits);
+   slot = table_slot(&t, &state->vm, value_num(1000));
+   assert(value_isnil(t.pairs[slot].value));
+
+	table_deinit(&t, &state->vm);
+
+   /* keys 0, 1, 2... set in order live in the array part, keys following
+      them move there from the hash part */
+   table_init(&t, &state->vm.alloc, TABLE_DEFAULT_CAPACITY);
+   table_set(&t, &state->vm, value_num(5), value_num(-5));
+	for (int32_t i = 0; i < 5; ++i)
+		table_set(&t, &state->vm, value_num(i), value_num(i));
+   table_set(&t, &state->vm, value_num(0.5), value_num(0.5));
+   assert(t.arraysize == 6 && t.size == 1);
+	for (int32_t i = 0; i < 5; ++i)
+		assert(table_get(&t, &state->vm, value_num(i)).num == i);
+   assert(table_get(&t, &state->vm, value_num(5)).num == -5);
+   assert(table_get(&t, &state->vm, value_num(0.5)).num == 0.5);
+
+   /* a mostly nil array part moves to the hash part */
+	for (int32_t i = 0; i < 4; ++i)
+		table_set(&t, &state->vm, value_num(i), value_nil());
+   assert(t.arraysize == 0 && t.size == 3);
+   assert(table_get(&t, &state->vm, value_num(4)).num == 4);
+   assert(value_isnil(table_get(&t, &state->vm, value_num(0))));
 	table_deinit(&t, &state->vm);
+
+   /* removed keys leave no holes in the probe sequences of the others and the
+      table shrinks back as it empties */
+   table_init(&t, &state->vm.alloc, TABLE_DEFAULT_CAPACITY);
+	for (int32_t i = 0; i < 1000; ++i)
+		table_set(&t, &state->vm, value_num(i + 0.5), value_num(i));
+	for (int32_t i = 0; i < 1000; i += 2)
+		table_remove(&t, &state->vm, value_num(i + 0.5));
+   assert(t.size == 500);
+	for (int32_t i = 0; i < 1000; ++i) {
+      union value v = table_get(&t, &state->vm, value_num(i + 0.5));
+		assert(i % 2 ? v.num == i : value_isnil(v));
+   }
+	for (int32_t i = 1; i < 1000; i += 2)
+		table_remove(&t, &state->vm, value_num(i + 0.5));
+   assert(t.size == 0 && t.capacity == TABLE_GROUP);
+	table_deinit(&t, &state->vm);
+
+   /* tables adding the same string keys in the same order share a shape,
+      removing a key or adding a non-string one switches to dictionary mode */
+   struct vm *vm = &state->vm;
+   struct table u;
+   union value x = value_new_stringf(&vm->cls_string, &vm->alloc, "x");
+   union value y = value_new_stringf(&vm->cls_string, &vm->alloc, "y");
+   table_init_shape(&t, &vm->shape_root);
+   table_init_shape(&u, &vm->shape_root);
+   table_set(&t, vm, x, value_num(1));
+   table_set(&t, vm, y, value_num(2));
+   table_set(&t, vm, value_num(0), value_num(3));
+   table_set(&u, vm, x, value_num(4));
+   table_set(&u, vm, y, value_num(5));
+   assert(t.shape == u.shape && t.shape->nkeys == 2 && t.arraysize == 1);
+   assert(shape_slot(t.shape, vm, y) == 1);
+   assert(table_get(&t, vm, y).num == 2 && table_get(&u, vm, x).num == 4);
+   table_remove(&t, vm, x);
+   assert(!t.shape && t.size == 1 && table_get(&t, vm, y).num == 2);
+   assert(value_isnil(table_get(&t, vm, x)) && t.arraysize == 1);
+   table_set(&u, vm, value_num(0.5), value_num(6));
+   assert(!u.shape && u.size == 3 && table_get(&u, vm, x).num == 4);
+	table_deinit(&t, vm);
+	table_deinit(&u, vm);
+   vm_value_destroy(vm, x);
+   vm_value_destroy(vm, y);
+
+   /* only short and interned keys transition shapes, strings built at runtime
+      switch to dictionary mode and are not kept by a shape */
+   x = string_intern(&vm->strings, "interned", 8);
+   y = value_new_stringf(&vm->cls_string, &vm->alloc, "built %d", 1);
+   table_init_shape(&t, &vm->shape_root);
+   table_set(&t, vm, x, value_num(1));
+   struct shape *shape = t.shape;
+   assert(shape && shape->nkeys == 1 && shape->key.bits == x.bits);
+   int32_t nchildren = shape->nchildren;
+   table_set(&t, vm, y, value_num(2));
+   assert(!t.shape && t.size == 2 && table_get(&t, vm, y).num == 2);
+   assert(shape->nchildren == nchildren);
+   table_deinit(&t, vm);
+   assert(((struct string *)value_getobjv(y))->object.refs == 1);
+   vm_value_destroy(vm, x);
+   vm_value_destroy(vm, y);
+}
+
+static void
+test_table_probe(koji_state_t *state)
+{
+   /* keys with the same home slot in the last one of tables of up to 64
+      slots wrap around past the end of the group, which is probed through
+      the cloned control bytes, before and after the table grows */
+   struct vm *vm = &state->vm;
+   union value keys[48];
+   int32_t nkeys = 0;
+   struct table t;
+
+   for (int32_t i = 0; nkeys < 48; ++i) {
+      union value key = value_num(i + 0.25);
+      if (((vm_value_hash(vm, key) >> 7) & 63) == 63)
+         keys[nkeys++] = key;
+   }
+
+   table_init(&t, &vm->alloc, TABLE_DEFAULT_CAPACITY);
+   for (int32_t n = 0; n < 40; ++n) {
+      table_set(&t, vm, keys[n], value_num(n));
+      assert(memcmp(t.ctrl, t.ctrl + t.capacity, TABLE_GROUP) == 0);
+      for (int32_t i = 0; i < 48; ++i) {
+         union value v = table_get(&t, vm, keys[i]);
+         assert(i <= n ? v.num == i : value_isnil(v));
+      }
+   }
+   assert(t.capacity == 64 && t.size == 40);
+   assert(t.ctrl[63] != TABLE_EMPTY && t.ctrl[38] != TABLE_EMPTY);
+   assert(t.ctrl[39] == TABLE_EMPTY);
+
+   /* removed keys shift the following ones back across the end */
+   for (int32_t i = 0; i < 40; i += 3)
+      table_remove(&t, vm, keys[i]);
+   assert(memcmp(t.ctrl, t.ctrl + t.capacity, TABLE_GROUP) == 0);
+   for (int32_t i = 0; i < 48; ++i) {
+      union value v = table_get(&t, vm, keys[i]);
+      assert(i < 40 && i % 3 ? v.num == i : value_isnil(v));
+   }
+   table_deinit(&t, vm);
+}
+
+static void
+test_globals(koji_state_t *state)
+{
+   /* globals defined by a script are visible to scripts loaded later */
+   koji_result_t res = koji_load_string(state, "answer = 41");
+   assert(res == KOJI_OK && koji_run(state) == KOJI_OK);
+   res = koji_load_string(state, "answer = answer + 1");
+   assert(res == KOJI_OK && koji_run(state) == KOJI_OK);
+
+   union value name = value_new_stringf(&state->vm.cls_string,
+      &state->vm.alloc, "answer");
+   union value answer = state->vm.globalvals[vm_global_slot(&state->vm, name)];
+   assert(value_isnum(answer) && answer.num == 42.0);
+   vm_value_destroy(&state->vm, name);
+}
+
+static void
+test_tailcalls(void)
+{
+   /* mutually recursive tail calls run in constant stack space */
+   koji_state_t *state = koji_open(NULL);
+   koji_result_t res = koji_load_string(state,
+      "even = func (n) { if (n == 0) { return true } return odd(n - 1) }\n"
+      "odd = func (n) { if (n == 0) { return false } return even(n - 1) }\n"
+      "assert(even(100000))\n");
+   assert(res == KOJI_OK && koji_run(state) == KOJI_OK);
+   assert(state->vm.frameslen <= 16 && state->vm.valueslen <= 16);
+
+   /* missing arguments are nil even where the callee registers overlap
+      temporaries the caller left past its own */
+   res = koji_load_string(state,
+      "g = func (a, b, c, d) { if (d) { throw \"missing argument is not nil\" } }\n"
+      "f = func () { return g(1) }\n"
+      "var t = { a: { b: { c: { d: { e: {} } } } } }\n"
+      "f()\n");
+   assert(res == KOJI_OK && koji_run(state) == KOJI_OK);
+   koji_close(state);
+}
+
+static void
+test_lines(void)
+{
+   /* instructions map to the line they were compiled from */
+   koji_state_t *state = koji_open(NULL);
+   struct prototype *main, *fn;
+   koji_result_t res = koji_load_string(state,
+      "x = 1\n"
+      "f = func (n) {\n"
+      "   if (n < 2) { return n }\n"
+      "   return f(n - 1)\n"
+      "}\n"
+      "f(x)\n");
+   assert(res == KOJI_OK);
+   main = state->vm.framestack[0].proto;
+   fn = main->protos[0];
+   assert(main->line == 0 && fn->line == 2);
+   assert(prototype_line(main, 0) == 1);
+   assert(prototype_line(main, main->ninstrs - 1) == 6);
+   assert(prototype_line(fn, 0) == 3);
+   assert(prototype_line(fn, fn->ninstrs - 1) == 4);
+   koji_close(state);
+}
+
+#ifdef KOJI_PROFILER
+static void
+test_profile(void)
+{
+   /* samples of a running script are written as collapsed stacks of the
+      function definition and source lines */
+   koji_state_t *state = koji_open(NULL);
+   char line[4096]; /* fib(25) stacks are 26 frames deep at most */
+   int32_t nsamples = 0, n;
+   bool nested = false;
+   FILE *in;
+   koji_result_t res = koji_load_string(state,
+      "fib = func (n) {\n"
+      "   if (n < 2) { return n }\n"
+      "   return fib(n - 1) + fib(n - 2)\n"
+      "}\n"
+      "assert(fib(25) == 75025)\n");
+   assert(res == KOJI_OK);
+   assert(koji_profile_stop(state, "profile.folded") != KOJI_OK);
+   koji_pop(state, 1);
+   assert(koji_profile_start(state, 100) == KOJI_OK);
+   assert(koji_run(state) == KOJI_OK);
+   assert(koji_profile_stop(state, "profile.folded") == KOJI_OK);
+
+   in = fopen("profile.folded", "r");
+   assert(in);
+   while (fgets(line, sizeof line, in)) {
+      char *count = strrchr(line, ' ');
+      assert(strncmp(line, "main (<string>:", 15) == 0 && count);
+      nested |= strstr(line, ";func@1 (<string>:") != NULL;
+      n = atoi(count + 1);
+      assert(n > 0);
+      nsamples += n;
+   }
+   fclose(in);
+   remove("profile.folded");
+   assert(nsamples > 0 && nested);
+   koji_close(state);
+}
+#endif
+
+/*
+ * Returns whether files [a] and [b] exist and have the same contents.
+ */
+static bool
+same_file(const char *a, const char *b)
+{
+   FILE *fa = fopen(a, "rb"), *fb = fopen(b, "rb");
+   bool same = fa && fb;
+   int ca, cb;
+
+   while (same) {
+      ca = fgetc(fa);
+      cb = fgetc(fb);
+      same = ca == cb;
+      if (ca == EOF)
+         break;
+   }
+   if (fa) fclose(fa);
+   if (fb) fclose(fb);
+   return same;
+}
+
+#if !defined(__GNUC__) && !defined(__clang__)
+void koji_aot_register_aot(void);
+#endif
+
+static void
+test_aot(void)
+{
+   /* the C emitted for aot.kj is the one linked into kojitests */
+   koji_state_t *state = koji_open(NULL);
+   struct vm *vm = &state->vm;
+   struct prototype *main;
+   struct table *results;
+   union value name;
+   koji_result_t res;
+
+   res = koji_emit_c(state, "../tests/aot.kj", "aot.emitted.c");
+   assert(res == KOJI_OK);
+   if (!same_file("aot.emitted.c", "../tests/aot.c"))
+      fprintf(stderr, "tests/aot.c is out of date, regenerate it with "
+         "kojic --emit-c aot.kj aot.c\n");
+   assert(same_file("aot.emitted.c", "../tests/aot.c"));
+   remove("aot.emitted.c");
+
+#if !defined(__GNUC__) && !defined(__clang__)
+   koji_aot_register_aot();
+#endif
+
+   /* loading the script binds all its prototypes to the compiled functions,
+      which run calls, tail calls, tables and comparisons like the vm */
+   res = koji_load_file(state, "../tests/aot.kj");
+   main = vm->framestack[0].proto;
+   assert(res == KOJI_OK && main->aot);
+   for (int32_t i = 0; i < main->nprotos; ++i)
+      assert(main->protos[i]->aot);
+   assert(koji_run(state) == KOJI_OK);
+
+   name = value_new_stringf(&vm->cls_string, &vm->alloc, "results");
+   results = &((struct object_table *)value_getobj(
+      vm->globalvals[vm_global_slot(vm, name)]))->table;
+   vm_value_destroy(vm, name);
+   assert(table_get(results, vm, value_shortstr("fib", 3)).num == 55);
+   assert(table_get(results, vm, value_shortstr("count", 5)).num == 105);
+   assert(table_get(results, vm, value_shortstr("y", 1)).num == 4);
+   assert(table_get(results, vm, value_shortstr("name", 4)).bits ==
+      value_shortstr("koji", 4).bits);
+   koji_close(state);
+}
+
+#ifdef KOJI_JIT
+static void
+test_jit(void)
+{
+   /* hot functions run compiled and agree with the interpreter, including
+      operands that take the slow paths */
+   koji_state_t *state = koji_open(NULL);
+   koji_result_t res = koji_load_string(state,
+      "sum = func (n) { if (n == 0) { return 0 } return n + sum(n - 1) }\n"
+      "fib = func (n) { if (n < 2) { return n } return fib(n - 1) + fib(n - 2) }\n"
+      "mix = func (n, a) { if (n <= 0) { return a / 4 - 1 } return mix(n - 1, a * 3) }\n"
+      "cat = func (a, b) { if (b) { return a + \"!\" } return a }\n"
+      "rep = func (n) {\n"
+      "   if (n == 0) { return cat(\"x\", true) }\n"
+      "   assert(cat(n, false) == n)\n"
+      "   return rep(n - 1)\n"
+      "}\n"
+      "assert(sum(1000) == 500500)\n"
+      "assert(fib(20) == 6765)\n"
+      "assert(mix(100, 1) == mix(100, 1))\n"
+      "assert(mix(3, 2) == 54 / 4 - 1)\n"
+      "assert(rep(200) == \"x!\")\n");
+   assert(res == KOJI_OK && koji_run(state) == KOJI_OK);
+
+   /* functions with runs of numeric instructions have been compiled */
+   {
+      struct vm *vm = &state->vm;
+      union value name = value_new_stringf(&vm->cls_string, &vm->alloc, "mix");
+      union value mix = vm->globalvals[vm_global_slot(vm, name)];
+      vm_value_destroy(vm, name);
+      assert(((struct closure *)value_getobj(mix))->proto->jit);
+   }
+   koji_close(state);
+}
+#endif
+
+#ifdef KOJI_OPCOUNT
+static void
+count_op(struct koji_opcount const *count, void *user)
+{
+   unsigned long long *counts = user;
+   if (count->pc < 0 && strcmp(count->op, "tailcall") == 0)
+      counts[0] += count->count;
+   else if (count->proto == 1 && count->pc == 0)
+      counts[1] += count->count;
+}
+
+static void
+test_opcount(void)
+{
+   /* opcodes and instructions are counted once per execution */
+   koji_state_t *state = koji_open(NULL);
+   unsigned long long counts[2] = { 0, 0 };
+   koji_result_t res = koji_load_string(state,
+      "down = func (n) { if (n == 0) { return 0 } return down(n - 1) }\n"
+      "down(10)\n");
+   assert(res == KOJI_OK && koji_run(state) == KOJI_OK);
+   assert(koji_stats(state, count_op, counts));
+   assert(counts[0] == 10 && counts[1] == 11);
+
+   koji_stats_reset(state);
+   counts[0] = counts[1] = 0;
+   koji_stats(state, count_op, counts);
+   assert(counts[0] == 0 && counts[1] == 0);
+   koji_close(state);
+}
+#endif
+
+/*
+ * Creates [n] pairs of parent and child tables referencing each other and [n]
+ * tables referencing themselves, all unreachable.
+ */
+static void
+make_cycles(struct vm *vm, int32_t n)
+{
+   for (int32_t i = 0; i < n; ++i) {
+      union value p = value_new_table(&vm->cls_table, &vm->shape_root,
+         &vm->alloc);
+      union value c = value_new_table(&vm->cls_table, &vm->shape_root,
+         &vm->alloc);
+      union value s = value_new_table(&vm->cls_table, &vm->shape_root,
+         &vm->alloc);
+      table_set(&((struct object_table *)value_getobjv(p))->table, vm,
+         value_shortstr("child", 5), c);
+      table_set(&((struct object_table *)value_getobjv(c))->table, vm,
+         value_shortstr("up", 2), p);
+      table_set(&((struct object_table *)value_getobjv(s))->table, vm,
+         value_shortstr("self", 4), s);
+      vm_value_destroy(vm, p);
+      vm_value_destroy(vm, c);
+      vm_value_destroy(vm, s);
+   }
+}
+
+#ifndef KOJI_GC
+static void
+test_collect(void)
+{
+   koji_state_t *state = koji_open(NULL);
+   struct vm *vm = &state->vm;
+   int32_t tables = vm->cls_table.object.refs;
+   union value keep, l, a, b, args[2];
+   struct object_table *t, *tl, *ta, *tb;
+   int32_t freed, steps;
+   uint64_t nvisited;
+
+   /* a live cycle is left alone */
+   keep = value_new_table(&vm->cls_table, &vm->shape_root, &vm->alloc);
+   t = value_getobjv(keep);
+   table_set(&t->table, vm, value_shortstr("self", 4), keep);
+   *vm_push(vm) = keep;
+
+   /* collections run in steps of about their budget of tables visited and
+      free the garbage they find once complete */
+   make_cycles(vm, 100);
+   assert(vm->cls_table.object.refs == tables + 301);
+   freed = koji_collect(state, 10);
+   assert(freed == 0 && vm->collector.phase == COLLECT_MARK);
+   assert(vm->collector.nvisited == 10);
+   for (steps = 1; vm->collector.phase != COLLECT_IDLE; ++steps)
+      freed += koji_collect(state, 10);
+   assert(freed == 300 && steps > 100 && vm->collector.nroots == 0);
+   assert(vm->cls_table.object.refs == tables + 1 && t->object.refs == 2);
+   assert(table_get(&t->table, vm, value_shortstr("self", 4)).bits ==
+      keep.bits);
+   koji_pop(state, 1);
+   assert(koji_collect(state, 0) == 1);
+
+   /* tables the VM takes a reference to while the collection runs are live:
+      l, on the stack, references the cycle of a and b, a is moved from l to
+      the stack after the scan found it only referenced by l and b */
+   l = value_new_table(&vm->cls_table, &vm->shape_root, &vm->alloc);
+   a = value_new_table(&vm->cls_table, &vm->shape_root, &vm->alloc);
+   b = value_new_table(&vm->cls_table, &vm->shape_root, &vm->alloc);
+   tl = value_getobjv(l), ta = value_getobjv(a), tb = value_getobjv(b);
+   table_set(&tl->table, vm, value_shortstr("x", 1), a);
+   table_set(&ta->table, vm, value_shortstr("y", 1), b);
+   table_set(&tb->table, vm, value_shortstr("z", 1), a);
+   *vm_push(vm) = l;
+   ++tl->object.refs;
+   vm_value_destroy(vm, l);
+   vm_value_destroy(vm, a);
+   vm_value_destroy(vm, b);
+   assert(vm->collector.nroots == 3);
+   while (vm->collector.phase != COLLECT_SCAN
+      || vm->collector.cursor <= max_i32(ta->index, tb->index))
+      koji_collect(state, 1);
+   assert(vm->collector.cursor <= tl->index);
+   assert(ta->color == COLLECT_GRAY && tb->color == COLLECT_GRAY);
+   *vm_push(vm) = a;
+   ++ta->object.refs;
+   args[0] = value_shortstr("x", 1);
+   args[1] = value_nil();
+   vm->cls_table.operator[CLASS_OP_SET](vm, &tl->object, CLASS_OP_SET, args,
+      2);
+   while (vm->collector.phase != COLLECT_LIST)
+      koji_collect(state, 1);
+   assert(tl->color == COLLECT_LIVE && ta->color == COLLECT_GRAY);
+   freed = koji_collect(state, 0);
+   assert(freed == 0 && vm->collector.phase == COLLECT_IDLE);
+   assert(table_get(&ta->table, vm, value_shortstr("y", 1)).bits == b.bits);
+   assert(table_get(&tb->table, vm, value_shortstr("z", 1)).bits == a.bits);
+   koji_pop(state, 1);
+   koji_pop(state, 1);
+   assert(koji_collect(state, 0) == 2);
+   assert(vm->cls_table.object.refs == tables);
+
+   /* scripts creating tables run steps once enough candidates are buffered */
+   make_cycles(vm, COLLECT_THRESHOLD);
+   assert(koji_load_string(state,
+      "make = func (n) {\n"
+      "   if (n == 0) { return 0 }\n"
+      "   var t = { x: n }\n"
+      "   return make(n - 1)\n"
+      "}\n"
+      "make(1000)\n") == KOJI_OK);
+   assert(koji_run(state) == KOJI_OK);
+   assert(vm->collector.nfreed >= 300 + 2 + COLLECT_THRESHOLD * 3);
+
+   /* the tables collections visit stay proportional to the candidates taken
+      when walking a large live list, a candidate for each table walked,
+      rather than the rest of the list being visited for each */
+   nvisited = vm->collector.nvisited;
+   assert(koji_load_string(state,
+      "make = func (n, l) {\n"
+      "   if (n == 0) { return l }\n"
+      "   return make(n - 1, { next: l })\n"
+      "}\n"
+      "walk = func (l, n) {\n"
+      "   if (!l) { return n }\n"
+      "   var t = { x: n }\n"
+      "   return walk(l.next, n + 1)\n"
+      "}\n"
+      "var list = make(20000, nil)\n"
+      "assert(walk(list, 0) == 20000)\n"
+      "assert(walk(list, 0) == 20000)\n") == KOJI_OK);
+   assert(koji_run(state) == KOJI_OK);
+   assert(vm->collector.nvisited - nvisited < 20 * 2 * 20000);
+
+   /* the rest is freed as the state is closed */
+   koji_close(state);
+}
+#else
+static void
+test_gc(void)
+{
+   koji_state_t *state = koji_open(NULL);
+   struct vm *vm = &state->vm;
+   union value keep, args[2];
+   struct object_table *t;
+   int32_t freed;
+
+   /* a table marked black by a running cycle is marked again once stored
+      into, along with the new value */
+   keep = value_new_table(&vm->cls_table, &vm->shape_root, &vm->alloc);
+   t = value_getobjv(keep);
+   for (int32_t i = 0; i < 1000; ++i) {
+      table_set(&t->table, vm, value_num(i),
+         value_new_table(&vm->cls_table, &vm->shape_root, &vm->alloc));
+   }
+   *vm_push(vm) = keep;
+   while (t->object.color != GC_BLACK) {
+      koji_collect(state, 1);
+      assert(vm->gc.phase == GC_MARK);
+   }
+   args[0] = value_shortstr("name", 4);
+   args[1] = value_new_stringf(&vm->cls_string, &vm->alloc, "%s", "a name");
+   vm->cls_table.operator[CLASS_OP_SET](vm, &t->object, CLASS_OP_SET, args, 2);
+   assert(t->object.color == GC_GRAY);
+   freed = koji_collect(state, 0);
+   assert(freed == 0 && vm->gc.phase == GC_PAUSE);
+   args[1] = table_get(&t->table, vm, args[0]);
+   assert(strcmp(value_string_cstr(args + 1), "a name") == 0);
+
+   /* cycles are freed like any other unreachable object */
+   make_cycles(vm, 100);
+   freed = koji_collect(state, 0);
+   assert(freed == 300);
+   assert(table_get(&t->table, vm, value_num(999)).bits != value_nil().bits);
+   koji_pop(state, 1);
+   freed = koji_collect(state, 0);
+   assert(freed == 1002);
+
+   /* scripts run steps as they create objects */
+   assert(koji_load_string(state,
+      "make = func (n) {\n"
+      "   if (n == 0) { return 0 }\n"
+      "   t = { x: n, name: \"a long key\" + \" of a table\", y: { z: n } }\n"
+      "   return make(n - 1)\n"
+      "}\n"
+      "make(5000)\n") == KOJI_OK);
+   assert(koji_run(state) == KOJI_OK);
+   assert(vm->gc.nfreed > 1302 && vm->gc.nobjects < 10000);
+
+   /* the rest is freed as the state is closed */
+   koji_close(state);
+}
+#endif
+
+static void
+count_slab(struct koji_slab_class const *c, void *user)
+{
+   struct koji_slab_class *total = user;
+   assert(c->live == (int)(c->allocs - c->frees));
+   total->pages += c->pages;
+   total->allocs += c->allocs;
+   total->frees += c->frees;
+}
+
+static void
+test_slab(koji_state_t *plain)
+{
+   /* small allocations are served by the size classes of the slab */
+   koji_state_t *state = koji_open_slab(NULL);
+   struct koji_slab_class total = { 0 };
+   koji_result_t res = koji_load_string(state,
+      "make = func (n) {\n"
+      "   if (n == 0) { return 0 }\n"
+      "   t = { x: n, name: \"a long key\" + \" of a table\", y: { z: n } }\n"
+      "   return make(n - 1)\n"
+      "}\n"
+      "make(100)\n");
+   assert(res == KOJI_OK && koji_run(state) == KOJI_OK);
+   assert(koji_slab_stats(state, count_slab, &total));
+   assert(total.pages > 0 && total.frees > 0 && total.allocs > total.frees);
+
+#ifndef KOJI_GC
+   /* freed blocks are handed out again by the next allocation of the class */
+   struct vm *vm = &state->vm;
+   union value a = value_new_stringf(&vm->cls_string, &vm->alloc, "slab %d", 1);
+   struct string *s = value_getobjv(a);
+   vm_value_destroy(vm, a);
+   a = value_new_stringf(&vm->cls_string, &vm->alloc, "slab %d", 2);
+   assert(value_getobjv(a) == s);
+   vm_value_destroy(vm, a);
+#endif
+   koji_close(state);
+
+   /* states opened with koji_open() do not use the slab */
+   assert(!koji_slab_stats(plain, count_slab, &total));
 }
 
 static bool
@@ -89,7 +885,31 @@ int32_t main()
    koji_state_t *state = koji_open(NULL);
 
    test_string(state);
+   test_shortstr(state);
+   test_rope(state);
+   test_slice(state);
+   test_intern(state);
    test_table(state);
+   test_table_probe(state);
+   test_globals(state);
+   test_slab(state);
+#ifdef KOJI_GC
+   test_gc();
+#else
+   test_collect();
+#endif
+   test_tailcalls();
+   test_lines();
+#ifdef KOJI_PROFILER
+   test_profile();
+#endif
+   test_aot();
+#ifdef KOJI_JIT
+   test_jit();
+#endif
+#ifdef KOJI_OPCOUNT
+   test_opcount();
+#endif
 
    koji_close(state);
 
@@ -97,9 +917,10 @@ int32_t main()
    static const char *simple_tests[] = {
       //DIR "empty.kj",
       DIR "assert.kj",
-      //DIR "numbers.kj",
+      DIR "numbers.kj",
       //DIR "booleans.kj",
-      //DIR "closures.kj",
+      DIR "closures.kj",
+      DIR "tables.kj",
       NULL
    };
 
@@ -16,18 +16,29 @@ value_type_str(union value val)
 	if (value_isnil(val)) return "nil";
 	if (value_isbool(val)) return "bool";
 	if (value_isnum(val)) return "number";
+	if (value_isshortstr(val)) return "string";
 	return "object";
 }
 
 kintern void
 const_destroy(union value c, struct koji_allocator *alloc)
 {
+#ifdef KOJI_GC
+   /* constants are marked through the prototypes of the frames and closures,
+      the collector frees them once unreachable */
+   (void)c, (void)alloc;
+#else
 	if (value_isobj(c)) {
-      /* the only allowed objects as constants are strings */
+      /* the only allowed objects as constants are strings. They may still
+         be referenced by VM values (e.g. globals) outliving the prototype,
+         in which case the last of those frees the string */
       struct string *s = value_getobjv(c);
       struct class *cls_str = s->object.class;
+      if (--s->object.refs > 0)
+         return;
       string_free(s, alloc);
       assert(cls_str->object.refs > 1);
       --cls_str->object.refs;
 	}
+#endif
 }
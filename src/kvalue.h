@@ -26,11 +26,18 @@ union value {
 
 /*
  * Base of all object values, holding a reference counter and the class this
- * object belongs to.
+ * object belongs to. Built with KOJI_GC, objects are instead linked in the
+ * list of the tracing collector, see [struct gc].
  */
 struct object {
    int32_t            refs;
+#ifdef KOJI_GC
+   uint8_t color; /* the collector color, a [gc_color] */
+#endif
    struct class*  class;
+#ifdef KOJI_GC
+   struct object *gcnext; /* the object created before this one */
+#endif
 };
 
 #define BITS_NAN_MASK      ((uint64_t)(0x7ff4000000000000))
@@ -38,6 +45,22 @@ struct object {
 #define BITS_TAG_PAYLOAD   ~BITS_TAG_MASK
 #define BITS_TAG_BOOLEAN   ((uint64_t)(0x7ffc000000000000))
 #define BITS_TAG_OBJECT    ((uint64_t)(0xfffc000000000000))
+#define BITS_TAG_SHORTSTR  ((uint64_t)(0xfff4000000000000))
+
+/*
+ * Maximum length of a short string. Short strings store their characters in
+ * the value payload instead of a str object, see [value_shortstr].
+ */
+#define SHORTSTR_MAX 5
+
+/*
+ * Short strings are read in place as null terminated strings, which only
+ * holds with the characters in the lowest payload bytes coming first in
+ * memory.
+ */
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#error "short strings require a little endian target"
+#endif
 
 /*
  */
@@ -81,6 +104,24 @@ value_obj(void const *obj)
    return v;
 }
 
+/*
+ * Returns a short string value of the [len] characters [chars], at most
+ * SHORTSTR_MAX. The characters are stored in the lowest payload bytes, the
+ * next byte holds SHORTSTR_MAX - [len] and the other ones are zero, so that
+ * the value bytes are a null terminated string and equal short strings have
+ * the same bits.
+ */
+static union value
+value_shortstr(const char *chars, int32_t len)
+{
+   union value v;
+   assert(len >= 0 && len <= SHORTSTR_MAX);
+   v.bits = BITS_TAG_SHORTSTR | (uint64_t)(SHORTSTR_MAX - len) << 40;
+   for (int32_t i = 0; i < len; ++i)
+      v.bits |= (uint64_t)(uint8_t)chars[i] << (i * 8);
+   return v;
+}
+
 /*
  */
 static bool
@@ -113,6 +154,14 @@ value_isobj(union value val)
    return (val.bits & BITS_TAG_MASK) == BITS_TAG_OBJECT;
 }
 
+/*
+ */
+static bool
+value_isshortstr(union value val)
+{
+   return (val.bits & BITS_TAG_MASK) == BITS_TAG_SHORTSTR;
+}
+
 /*
  */
 static bool
@@ -144,6 +193,27 @@ value_getobj(union value val)
 
 #define value_getobjv(val) ((void *)value_getobj(val))
 
+/*
+ * Returns the length of short string [val].
+ */
+static int32_t
+value_shortstr_len(union value val)
+{
+   assert(value_isshortstr(val));
+   return SHORTSTR_MAX - (int32_t)((val.bits >> 40) & 0xff);
+}
+
+/*
+ * Returns the null terminated characters of the short string [val] points to,
+ * which are stored in [val] itself.
+ */
+static const char *
+value_shortstr_chars(union value const *val)
+{
+   assert(value_isshortstr(*val));
+   return (const char *)&val->bits;
+}
+
 /*
  * Returns a str with the type of [value].
  */
@@ -152,3 +222,13 @@ value_type_str(union value val);
 
 kintern void
 const_destroy(union value c, struct koji_allocator *alloc);
+
+/*
+ * Returns whether constant [c] is a string, either short or a str object.
+ * Constants are only numbers and strings.
+ */
+static bool
+const_isstring(union value c)
+{
+   return value_isobj(c) || value_isshortstr(c);
+}
@@ -11,8 +11,38 @@
 #include "kbytecode.h"
 #include "kstring.h"
 #include "kclass.h"
+#include "kclosure.h"
+#include "kjit.h"
+#include "kaot.h"
+#include "kprofile.h"
 
 #include <stdio.h> /* temp */
+#include <string.h>
+#include <math.h>
+
+/*
+ * Instruction dispatch. Compilers that support taking the address of a label
+ * (GCC and Clang) get a threaded interpreter: every opcode handler ends with
+ * its own copy of the indirect jump to the next handler, so the branch
+ * predictor sees one jump site per opcode rather than the single, hard to
+ * predict one of a switch. Define KOJI_NO_COMPUTED_GOTO to force the portable
+ * switch based loop.
+ */
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(KOJI_NO_COMPUTED_GOTO)
+#define KOJI_COMPUTED_GOTO
+#endif
+
+#ifdef KOJI_COMPUTED_GOTO
+#define vm_dispatch() vm_fetch(); goto *dispatch_table[i->op];
+#define vm_case(op) label_##op
+#define vm_default label_default
+#define vm_break do { vm_fetch(); goto *dispatch_table[i->op]; } while (0)
+#else
+#define vm_dispatch() vm_fetch(); switch (i->op)
+#define vm_case(op) case op
+#define vm_default default
+#define vm_break break
+#endif
 
 static void
 vm_value_setnil(struct vm *vm, union value *val)
@@ -35,22 +65,601 @@ vm_value_setnum(struct vm *vm, union value *val, koji_number_t num)
 	*val = value_num(num);
 }
 
-static union value *
-vm_register(struct vm *vm, struct vm_frame *frame, int32_t loc)
+/*
+ * Safe point of the tracing collector, where every object in use is
+ * reachable from its roots: runs a step of the collector once enough objects
+ * have been created since the last one. Does nothing without KOJI_GC.
+ */
+static void
+vm_gc_check(struct vm *vm)
+{
+#ifdef KOJI_GC
+   if (vm->gc.debt >= GC_STEP_ALLOCS)
+      gc_check(vm);
+#else
+   (void)vm;
+#endif
+}
+
+/*
+ * Write barrier, called before storing a value into table object [obj]: the
+ * barrier of the tracing collector with KOJI_GC, of the cycle collector
+ * otherwise.
+ */
+static void
+vm_barrier(struct vm *vm, union value obj)
+{
+#ifdef KOJI_GC
+   gc_barrier(&vm->gc, value_getobj(obj));
+#else
+   collector_barrier(vm, value_getobjv(obj));
+#endif
+}
+
+/*
+ * Runs a step of the cycle collector if a collection is running or enough
+ * candidates are buffered to start one, see collector_due(). It is called
+ * before creating tables, where every reference to a table is counted.
+ * Built with KOJI_GC, where tables are traced instead, it is a safe point of
+ * the tracing collector.
+ */
+static void
+vm_collect_auto(struct vm *vm)
+{
+#ifdef KOJI_GC
+   vm_gc_check(vm);
+#else
+   if (vm->collector.budget > 0
+      && collector_due(&vm->collector, vm->cls_table.object.refs))
+      collector_step(vm, vm->collector.budget);
+#endif
+}
+
+/*
+ * Slow path of arithmetic operator [classop] between [lhs] and [rhs] when
+ * they are not both numbers. If [lhs] is an object its class operator is
+ * invoked and the result moved into [dest], as the one of a short string,
+ * otherwise an error is thrown.
+ */
+static void
+vm_arith_object(struct vm *vm, union value *dest, enum class_op_kind classop,
+   union value lhs, union value rhs)
+{
+   static const char *OPERATOR_STR[] = {
+      "unm", "add", "sub", "mul", "div", "mod"
+   };
+
+   vm_gc_check(vm);
+   if (value_isobj(lhs)) {
+      struct object *obj = value_getobj(lhs);
+      union value old = *dest;
+      /* the operator returns a new reference, move it in place */
+      *dest = obj->class->operator[classop](vm, obj, classop, &rhs, 1).value;
+      vm_value_destroy(vm, old);
+   }
+   else if (value_isshortstr(lhs)) {
+      union value old = *dest;
+      *dest = shortstr_arith(vm, classop, lhs, rhs);
+      vm_value_destroy(vm, old);
+   }
+   else {
+      vm_throw(vm, "cannot apply binary operator %s between a %s and a %s.",
+         OPERATOR_STR[classop], value_type_str(lhs), value_type_str(rhs));
+   }
+}
+
+/*
+ * Generic path of get operation [obj][key] which writes the result into
+ * [dest].
+ */
+static void
+vm_get(struct vm *vm, union value *dest, union value obj, union value key)
+{
+   if (value_isobj(obj)) {
+      struct object *o = value_getobj(obj);
+      vm_value_set(vm, dest, o->class->operator[CLASS_OP_GET](vm, o,
+         CLASS_OP_GET, &key, 1).value);
+   }
+   else {
+      vm_throw(vm, "primitive type %s does not support `get` operator.",
+         value_type_str(obj));
+   }
+}
+
+/*
+ * Generic path of set operation [obj][key] = [val].
+ */
+static void
+vm_set(struct vm *vm, union value obj, union value key, union value val)
+{
+   if (value_isobj(obj)) {
+      struct object *o = value_getobj(obj);
+      union value args[2] = { key, val };
+      o->class->operator[CLASS_OP_SET](vm, o, CLASS_OP_SET, args, 2);
+   }
+   else {
+      vm_throw(vm, "primitive type %s does not support `set` operator.",
+         value_type_str(obj));
+   }
+}
+
+/*
+ * Returns the table of [val] if it is a table object, NULL otherwise.
+ */
+static struct table *
+vm_totable(struct vm *vm, union value val)
+{
+   if (value_isobj(val) && value_getobj(val)->class == &vm->cls_table)
+      return &((struct object_table *)value_getobj(val))->table;
+   return NULL;
+}
+
+/*
+ * Points inline [cache] at the slot of [key] in the shape of [t] in shape
+ * mode, or at the pair index of [key] in [t] in dictionary mode.
+ */
+static void
+vm_cache_key(struct vm *vm, struct inline_cache *cache, struct table *t,
+   union value key)
+{
+   cache->shape = t->shape;
+   cache->slot = t->shape ? shape_slot(t->shape, vm, key) :
+      table_slot(t, vm, key);
+}
+
+/*
+ * Calls function [fn] with [nargs] arguments in the value stack starting at
+ * [argbase]. If [fn] is a closure, its frame is pushed with [argbase] as stack
+ * base and missing arguments are set to nil. If it is a native function, it
+ * is executed immediately and its result written at [argbase].
+ */
+static void
+vm_call(struct vm *vm, union value fn, int32_t argbase, int32_t nargs)
+{
+   struct object *obj = value_isobj(fn) ? value_getobj(fn) : NULL;
+
+   if (obj && obj->class == &vm->cls_closure) {
+      struct prototype *proto = ((struct closure *)obj)->proto;
+      vm_push_frame(vm, proto, argbase);
+      for (int32_t i = nargs; i < proto->nargs; ++i)
+         vm_value_setnil(vm, vm->valuestack + argbase + i);
+   }
+   else if (obj && obj->class == &vm->cls_native) {
+      union value *args = vm->valuestack + argbase;
+      union value res = ((struct native *)obj)->fn(vm, args, nargs);
+      union value old = *args;
+      *args = res; /* move the owned result in place */
+      vm_value_destroy(vm, old);
+   }
+   else {
+      vm_throw(vm, "cannot call a %s value.", value_type_str(fn));
+   }
+}
+
+/*
+ * Tail calls function [fn] with [nargs] arguments starting from register [a]
+ * of the top frame. If [fn] is a closure, the top frame is reused to execute
+ * it: arguments are moved to its first registers, other registers cleared and
+ * the frame restarted with the callee prototype, so neither the frame stack
+ * nor the value stack grow. Native functions are simply called. Returns
+ * whether the top frame was replaced.
+ */
+static bool
+vm_tailcall(struct vm *vm, union value fn, int32_t a, int32_t nargs)
+{
+   struct vm_frame *frame = vm->framestack + (vm->framesp - 1);
+   union value *regs = vm->valuestack + frame->stackbase;
+   struct object *obj = value_isobj(fn) ? value_getobj(fn) : NULL;
+   struct prototype *proto;
+   int32_t i, n;
+
+   if (!obj || obj->class != &vm->cls_closure) {
+      vm_call(vm, fn, frame->stackbase + a, nargs);
+      return false;
+   }
+
+   /* hold the callee prototype as its closure may be in a register cleared
+      below */
+   proto = ((struct closure *)obj)->proto;
+   ++proto->refs;
+
+   /* move arguments down to the first registers */
+   if (a > 0) {
+      for (i = 0; i < nargs; ++i) {
+         union value old = regs[i];
+         regs[i] = regs[a + i];
+         regs[a + i] = value_nil();
+         vm_value_destroy(vm, old);
+      }
+   }
+
+   /* make sure the value stack covers the callee registers */
+   for (i = vm->valuesp, n = frame->stackbase + proto->nregs; i < n; ++i)
+      *vm_push(vm) = value_nil();
+   regs = vm->valuestack + frame->stackbase;
+
+   /* clear all other registers of both frames, the callee ones may overlap
+      stale temporaries of the caller so missing arguments must be set to nil
+      as vm_call does */
+   n = max_i32(frame->proto->nregs, proto->nregs);
+   for (i = nargs; i < n; ++i)
+      vm_value_setnil(vm, regs + i);
+
+   /* the frame must never reference a released prototype, the profiler may
+      be reading it */
+   {
+      struct prototype *old = frame->proto;
+      frame->proto = proto;
+      frame->pc = 0;
+      kbarrier();
+      prototype_release(old, &vm->alloc);
+   }
+   return true;
+}
+
+/*
+ * Builtin function `assert(cond)`: throws an error if [cond] is false.
+ */
+static union value
+builtin_assert(struct vm *vm, union value *args, int32_t nargs)
 {
-	assert(frame->stackbase + loc < (int32_t)vm->valueslen);
-	return vm->valuestack + frame->stackbase + loc;
+   if (nargs < 1 || !value_tobool(args[0]))
+      vm_throw(vm, "assertion failed.");
+   return value_nil();
 }
 
+/*
+ * Throws an error unless the [nargs] arguments [args] of builtin string
+ * function [name] are at least [min], the first a string.
+ */
+static void
+vm_check_string_args(struct vm *vm, const char *name, union value *args,
+   int32_t nargs, int32_t min)
+{
+   if (nargs < min || !value_isstring(args[0], &vm->cls_string))
+      vm_throw(vm, "%s expects a string argument.", name);
+}
+
+/*
+ * Returns number argument [i] of [args] floored and clamped to [0, len], or
+ * [def] if it is not passed or is NaN.
+ */
+static int32_t
+vm_index_arg(union value *args, int32_t nargs, int32_t i, int32_t def,
+   int32_t len)
+{
+   koji_number_t index;
+   if (i >= nargs || !value_isnum(args[i]) || args[i].num != args[i].num)
+      return def;
+   index = floor(args[i].num);
+   return index < 0 ? 0 : index > len ? len : (int32_t)index;
+}
+
+/*
+ * Builtin function `len(s)`: returns the number of characters of string [s].
+ */
+static union value
+builtin_len(struct vm *vm, union value *args, int32_t nargs)
+{
+   vm_check_string_args(vm, "len", args, nargs, 1);
+   return value_num(value_string_len(args[0]));
+}
+
+/*
+ * Builtin function `find(s, what, from)`: returns the index of the first
+ * occurrence of string [what] in string [s] from index [from] (0 by default)
+ * on, -1 if not found.
+ */
 static union value
-vm_value(struct vm *vm, struct vm_frame *frame, int32_t loc)
+builtin_find(struct vm *vm, union value *args, int32_t nargs)
 {
-	return *(loc >= 0
-		? vm_register(vm, frame, loc)
-		: (assert(-loc - 1 < (int32_t)frame->proto->nconsts),
-         frame->proto->consts - (loc + 1)));
+   int32_t len, wlen, from;
+   const char *chars, *what;
+
+   vm_check_string_args(vm, "find", args, nargs, 2);
+   if (!value_isstring(args[1], &vm->cls_string))
+      vm_throw(vm, "find expects a string to find.");
+   len = value_string_len(args[0]);
+   wlen = value_string_len(args[1]);
+   from = vm_index_arg(args, nargs, 2, 0, len);
+   chars = value_string_chars(args + 0);
+   what = value_string_chars(args + 1);
+   for (int32_t i = from; i + wlen <= len; ++i) {
+      if (memcmp(chars + i, what, wlen) == 0)
+         return value_num(i);
+   }
+   return value_num(-1);
+}
+
+/*
+ * Builtin function `sub(s, begin, end)`: returns the characters of string [s]
+ * from index [begin] to index [end] excluded (the length of [s] by default).
+ * The result references the characters of [s] instead of copying them.
+ */
+static union value
+builtin_sub(struct vm *vm, union value *args, int32_t nargs)
+{
+   int32_t len, begin, end;
+
+   vm_check_string_args(vm, "sub", args, nargs, 2);
+   len = value_string_len(args[0]);
+   begin = vm_index_arg(args, nargs, 1, 0, len);
+   end = vm_index_arg(args, nargs, 2, len, len);
+   return value_new_substring(&vm->cls_string, &vm->alloc, args, begin,
+      max_i32(end - begin, 0));
+}
+
+/*
+ * Defines the global [name] to a new native function object of [fn].
+ */
+static void
+vm_define_native(struct vm *vm, const char *name, native_fn_t fn)
+{
+   union value namestr = value_new_stringf(&vm->cls_string, &vm->alloc, "%s",
+      name);
+   int32_t slot = vm_global_slot(vm, namestr);
+   vm_value_destroy(vm, namestr); /* now referenced by the table of globals */
+   vm_value_destroy(vm, vm->globalvals[slot]);
+   vm->globalvals[slot] = value_new_native(&vm->cls_native, &vm->alloc, fn);
+}
+
+/*
+ * Returns the [n] values from register [a] of the top frame to the caller and
+ * pops the frame.
+ */
+static void
+vm_return(struct vm *vm, int32_t a, int32_t n)
+{
+   struct vm_frame *frame = vm->framestack + (vm->framesp - 1);
+   union value *dest = vm->valuestack + frame->stackbase;
+   union value *dest_end = dest + frame->proto->nregs;
+   union value *src = dest + a;
+   union value *src_end = src + n;
+
+   /* move return values to the first registers of this frame which are the
+      caller result registers */
+   for (; src < src_end; ++src, ++dest) {
+      if (src == dest)
+         continue;
+      vm_value_destroy(vm, *dest); /* make return reg nil */
+      *dest = *src; /* move value over */
+      *src = value_nil();
+   }
+
+   /* set all other current locals to nil */
+   for (; dest < dest_end; ++dest) {
+      vm_value_destroy(vm, *dest);
+      *dest = value_nil();
+   }
+
+   /* pop the frame, release the prototype reference and shrink the value
+      stack back to the caller registers */
+   vm->framesp -= 1;
+   if (vm->framesp > 0) {
+      struct vm_frame *caller = frame - 1;
+      vm->valuesp = caller->stackbase + caller->proto->nregs;
+   }
+   else {
+      vm->valuesp = frame->stackbase;
+   }
+
+   kbarrier();
+   prototype_release(frame->proto, &vm->alloc);
+}
+
+/*
+ * Prints the [n] values from [ra] and sets [ra] to nil.
+ */
+static void
+vm_debug(struct vm *vm, union value *ra, int32_t n)
+{
+   printf("debug: ");
+   for (union value *r = ra, *rend = ra + n; r < rend; ++r) {
+      if (value_isnil(*r))
+         printf("nil");
+      else if (value_isbool(*r))
+         printf("%s", value_getbool(*r) ? "true" : "false");
+      else if (value_isnum(*r))
+         printf("%f", r->num);
+      else if (value_isstring(*r, &vm->cls_string))
+         printf("%s", value_string_cstr(r));
+      else
+         printf("<object:%p>", value_getobj(*r));
+      printf(", ");
+      vm_value_setnil(vm, ra);
+   }
+   printf("\n");
+}
+
+kintern void
+vm_aot_arith(struct vm *vm, union value *dest, enum class_op_kind classop,
+   union value lhs, union value rhs)
+{
+   vm_arith_object(vm, dest, classop, lhs, rhs);
 }
 
+kintern void
+vm_aot_unm(struct vm *vm, union value *dest, union value val)
+{
+   if (value_isnum(val)) {
+      vm_value_setnum(vm, dest, -val.num);
+   }
+   else if (value_isobj(val)) {
+      struct object *obj = value_getobj(val);
+      vm_value_destroy(vm, *dest);
+      vm_value_set(vm, dest, obj->class->operator[CLASS_OP_UNM](vm, obj,
+         CLASS_OP_UNM, &val, 1).value);
+   }
+   else {
+      vm_throw(vm, "cannot apply unary minus operation to a %s value.",
+         value_type_str(val));
+   }
+}
+
+/*
+ * Returns the result of comparison [op] of object [obj] with [rhs]. Strings
+ * are tested for equality without ordering them, so that their stored hashes
+ * can tell most different strings apart.
+ */
+static bool
+vm_compare_object(struct vm *vm, enum opcode op, struct object *obj,
+   union value rhs)
+{
+   int32_t cmp;
+   if (op == OP_EQ && obj->class == &vm->cls_string && value_isobj(rhs)
+       && value_getobj(rhs)->class == &vm->cls_string)
+      return string_equal((struct string *)obj, value_getobjv(rhs));
+   cmp = obj->class->operator[CLASS_OP_COMPARE](vm, obj, CLASS_OP_COMPARE,
+      &rhs, 1).compare;
+   return op == OP_EQ ? cmp == 0 : op == OP_LT ? cmp < 0 : cmp <= 0;
+}
+
+kintern bool
+vm_aot_compare(struct vm *vm, enum opcode op, union value lhs,
+   union value rhs)
+{
+   int32_t cmp;
+   if (value_isnum(lhs) && value_isnum(rhs)) {
+      return op == OP_EQ ? lhs.num == rhs.num :
+             op == OP_LT ? lhs.num < rhs.num : lhs.num <= rhs.num;
+   }
+   else if (value_isobj(lhs)) {
+      return vm_compare_object(vm, op, value_getobj(lhs), rhs);
+   }
+   else if (value_isshortstr(lhs) && value_isshortstr(rhs)) {
+      cmp = shortstr_compare(lhs, rhs);
+   }
+   else {
+      cmp = lhs.bits < rhs.bits ? -1 : lhs.bits > rhs.bits;
+   }
+   return op == OP_EQ ? cmp == 0 : op == OP_LT ? cmp < 0 : cmp <= 0;
+}
+
+kintern void
+vm_aot_get(struct vm *vm, union value *dest, union value obj, union value key)
+{
+   vm_get(vm, dest, obj, key);
+}
+
+kintern void
+vm_aot_set(struct vm *vm, union value obj, union value key, union value val)
+{
+   vm_set(vm, obj, key, val);
+}
+
+kintern void
+vm_aot_newtable(struct vm *vm, union value *dest)
+{
+   union value old;
+   vm_collect_auto(vm);
+   old = *dest;
+   *dest = value_new_table(&vm->cls_table, &vm->shape_root, &vm->alloc);
+   vm_value_destroy(vm, old);
+}
+
+kintern void
+vm_aot_closure(struct vm *vm, union value *dest, struct prototype *proto)
+{
+   union value old;
+   vm_gc_check(vm);
+   old = *dest;
+   *dest = value_new_closure(&vm->cls_closure, &vm->alloc, proto);
+   vm_value_destroy(vm, old);
+}
+
+kintern bool
+vm_aot_call(struct vm *vm, union value fn, int32_t argbase, int32_t nargs)
+{
+   int32_t framesp = vm->framesp;
+   vm_gc_check(vm);
+   vm_call(vm, fn, argbase, nargs);
+   return vm->framesp != framesp;
+}
+
+kintern bool
+vm_aot_mcall(struct vm *vm, struct vm_frame *frame, int32_t a,
+   union value key, int32_t nargs)
+{
+   union value method = value_nil();
+   int32_t framesp = vm->framesp;
+   vm_gc_check(vm);
+   vm_get(vm, &method, vm->valuestack[frame->stackbase + a - 1], key);
+   vm_call(vm, method, frame->stackbase + a, nargs);
+   vm_value_destroy(vm, method);
+   return vm->framesp != framesp;
+}
+
+kintern bool
+vm_aot_tailcall(struct vm *vm, union value fn, int32_t a, int32_t nargs)
+{
+   vm_gc_check(vm);
+   return vm_tailcall(vm, fn, a, nargs);
+}
+
+kintern void
+vm_aot_return(struct vm *vm, int32_t a, int32_t n)
+{
+   vm_return(vm, a, n);
+}
+
+kintern void
+vm_aot_throw(struct vm *vm, union value val)
+{
+   if (value_isstring(val, &vm->cls_string))
+      vm_throw(vm, value_string_cstr(&val));
+   else
+      vm_throw(vm, "throw argument must be a string.");
+}
+
+kintern void
+vm_aot_debug(struct vm *vm, union value *ra, int32_t n)
+{
+   vm_debug(vm, ra, n);
+}
+
+#ifdef KOJI_JIT
+kintern void
+vm_jit_arith(struct vm *vm, union value *regs, union value *consts,
+   struct decoded_instr const *i, int32_t op)
+{
+   union value lhs = i->bk ? consts[i->b] : regs[i->b];
+   union value rhs = i->ck ? consts[i->c] : regs[i->c];
+   int32_t kind = op >= OP_KADD ? op - OP_KADD :
+                  op >= OP_ADDK ? op - OP_ADDK : op - OP_ADD;
+
+   if (value_isnum(lhs) && value_isnum(rhs)) {
+      koji_number_t num;
+      switch (kind) {
+         case 0: num = lhs.num + rhs.num; break;
+         case 1: num = lhs.num - rhs.num; break;
+         case 2: num = lhs.num * rhs.num; break;
+         case 3: num = lhs.num / rhs.num; break;
+         default:
+            num = (koji_number_t)((int64_t)lhs.num % (int64_t)rhs.num);
+            break;
+      }
+      vm_value_setnum(vm, regs + i->a, num);
+   }
+   else {
+      vm_arith_object(vm, regs + i->a, CLASS_OP_ADD + kind, lhs, rhs);
+   }
+}
+
+kintern int32_t
+vm_jit_compare(struct vm *vm, union value *regs, union value *consts,
+   struct decoded_instr const *i, int32_t op)
+{
+   return vm_aot_compare(vm, op, regs[i->a],
+      i->bk ? consts[i->b] : regs[i->b]);
+}
+
+kintern int32_t
+vm_jit_tobool(union value const *val)
+{
+   return value_tobool(*val);
+}
+#endif
+
 kintern void
 vm_init(struct vm *vm, struct koji_allocator *alloc)
 {
@@ -61,9 +670,33 @@ vm_init(struct vm *vm, struct koji_allocator *alloc)
    class_builtin_init(&vm->cls_builtin);
    class_string_init(&vm->cls_string, &vm->cls_builtin);
    class_table_init(&vm->cls_table, &vm->cls_builtin);
-
-   /* init table of globals */
+   class_closure_init(&vm->cls_closure, &vm->cls_builtin);
+   class_native_init(&vm->cls_native, &vm->cls_builtin);
+
+#ifdef KOJI_GC
+   /* link the instances of the classes to the collector */
+   gc_init(&vm->gc, alloc);
+   vm->cls_string.gc = &vm->gc;
+   vm->cls_table.gc = &vm->gc;
+   vm->cls_closure.gc = &vm->gc;
+   vm->cls_native.gc = &vm->gc;
+#endif
+
+   string_set_init(&vm->strings, &vm->cls_string, alloc);
+   shape_init(&vm->shape_root);
+   collector_init(&vm->collector);
+
+   /* init table of globals and their values */
    table_init(&vm->globals, alloc, 64);
+   vm->nglobals = 0;
+   vm->globalslen = 64;
+   vm->globalvals = kalloc(union value, vm->globalslen, &vm->alloc);
+
+   /* define builtin functions */
+   vm_define_native(vm, "assert", builtin_assert);
+   vm_define_native(vm, "len", builtin_len);
+   vm_define_native(vm, "find", builtin_find);
+   vm_define_native(vm, "sub", builtin_sub);
 
 	/* init frame stack */
 	vm->framesp = 0;
@@ -74,6 +707,18 @@ vm_init(struct vm *vm, struct koji_allocator *alloc)
 	vm->valuesp = 0;
 	vm->valueslen = 16;
 	vm->valuestack = kalloc(union value, vm->valueslen, &vm->alloc);
+
+#ifdef KOJI_PROFILER
+   vm->profiler = NULL;
+#endif
+
+#ifdef KOJI_OPCOUNT
+   /* init execution counters */
+   memset(vm->opcounts, 0, sizeof vm->opcounts);
+   vm->ncounted = 0;
+   vm->countedlen = 16;
+   vm->counted = kalloc(struct prototype *, vm->countedlen, &vm->alloc);
+#endif
 }
 
 kintern void
@@ -81,6 +726,10 @@ vm_deinit(struct vm *vm)
 {
    int32_t i;
 
+#ifdef KOJI_PROFILER
+   profiler_stop(vm, NULL);
+#endif
+
 	/* destroy all values on the stack */
 	for (i = 0; i < vm->valuesp; ++i) {
 		vm_value_destroy(vm, vm->valuestack[i]);
@@ -93,15 +742,100 @@ vm_deinit(struct vm *vm)
 	}
 	kfree(vm->framestack, vm->frameslen, &vm->alloc);
 
-   /* release table of globals */
+   /* release table of globals and their values */
    table_deinit(&vm->globals, vm);
+   for (i = 0; i < vm->nglobals; ++i)
+      vm_value_destroy(vm, vm->globalvals[i]);
+   kfree(vm->globalvals, vm->globalslen, &vm->alloc);
+
+   /* free the cycles of tables left */
+   collector_step(vm, 0);
+   collector_deinit(vm);
+
+#ifdef KOJI_GC
+   /* free all objects, tables before their shapes */
+   gc_deinit(vm);
+#endif
+
+   /* all tables are gone, destroy their shapes */
+   shape_deinit(&vm->shape_root, vm);
+
+#ifdef KOJI_OPCOUNT
+   /* release executed prototypes, kept alive for their counters */
+   for (i = 0; i < vm->ncounted; ++i)
+      prototype_release(vm->counted[i], &vm->alloc);
+   kfree(vm->counted, vm->countedlen, &vm->alloc);
+#endif
 
+   string_set_deinit(&vm->strings);
+
+#ifndef KOJI_GC
    /* release builtin classes */
-   assert(vm->cls_builtin.object.refs == 4);
+   assert(vm->cls_builtin.object.refs == 6);
    assert(vm->cls_string.object.refs == 1);
    assert(vm->cls_table.object.refs == 1);
+   assert(vm->cls_closure.object.refs == 1);
+   assert(vm->cls_native.object.refs == 1);
+#endif
 }
 
+kintern int32_t
+vm_global_slot(struct vm *vm, union value name)
+{
+   union value slot = table_get(&vm->globals, vm, name);
+   if (!value_isnil(slot))
+      return (int32_t)slot.num;
+
+   /* first reference to this global, reserve a new slot for it */
+   if (vm->nglobals == vm->globalslen) {
+      int32_t newlen = vm->globalslen * 2;
+      vm->globalvals = krealloc(vm->globalvals, vm->globalslen, newlen,
+         &vm->alloc);
+      vm->globalslen = newlen;
+   }
+   vm->globalvals[vm->nglobals] = value_nil();
+   table_set(&vm->globals, vm, name, value_num(vm->nglobals));
+   return vm->nglobals++;
+}
+
+/*
+ * Rewrites the global accesses of decoded prototype [proto] to index the
+ * global values array directly.
+ */
+static void
+vm_resolve_globals(struct vm *vm, struct prototype *proto)
+{
+   for (int32_t i = 0; i < proto->ninstrs; ++i) {
+      struct decoded_instr *d = proto->code + i;
+      if (d->op != OP_GETGLOB && d->op != OP_SETGLOB)
+         continue;
+      assert(d->bk); /* the name is always a constant */
+      d->op = d->op == OP_GETGLOB ? OP_GETGSLOT : OP_SETGSLOT;
+      d->b = vm_global_slot(vm, proto->consts[d->b]);
+      d->bk = 0;
+   }
+}
+
+#ifdef KOJI_OPCOUNT
+/*
+ * Allocates the instruction counters of [proto], executed for the first time.
+ * The VM keeps a reference to it so that its counters survive the script.
+ */
+static void
+vm_count_proto(struct vm *vm, struct prototype *proto)
+{
+   if (vm->ncounted == vm->countedlen) {
+      int32_t newlen = vm->countedlen * 2;
+      vm->counted = krealloc(vm->counted, vm->countedlen, newlen, &vm->alloc);
+      vm->countedlen = newlen;
+   }
+   vm->counted[vm->ncounted++] = proto;
+   ++proto->refs;
+   proto->counts = kalloc(uint64_t, proto->ninstrs, &vm->alloc);
+   memset(proto->counts, 0, sizeof(uint64_t) * proto->ninstrs);
+}
+#endif
+
 kintern void
 vm_push_frame(struct vm *vm, struct prototype *proto, int32_t stackbase)
 {
@@ -111,25 +845,36 @@ vm_push_frame(struct vm *vm, struct prototype *proto, int32_t stackbase)
 	 * new frame */
 	++proto->refs;
 
-	/* bump up the frame stack pointer */
-	const int32_t frame_ptr = vm->framesp++;
-
-	/* resize the array if needed */
-	if (vm->framesp > vm->frameslen) {
+	/* resize the array if needed, the profiler must not sample the frame stack
+      while it moves */
+	if (vm->framesp == vm->frameslen) {
 		int32_t newframeslen = vm->frameslen * 2;
+#ifdef KOJI_PROFILER
+      if (vm->profiler)
+         vm->profiler->hold = 1;
+#endif
 		vm->framestack = krealloc(vm->framestack, vm->frameslen, newframeslen,
          &vm->alloc);
 		vm->frameslen = newframeslen;
+#ifdef KOJI_PROFILER
+      if (vm->profiler)
+         vm->profiler->hold = 0;
+#endif
 	}
 
-	/* set the new frame data */
-	struct vm_frame *frame = &vm->framestack[frame_ptr];
+	/* set the new frame data, then bump up the frame stack pointer so that
+      the frame is complete when the profiler sees it */
+	struct vm_frame *frame = &vm->framestack[vm->framesp];
 	frame->proto = proto;
 	frame->pc = 0;
 	frame->stackbase = stackbase;
+   kbarrier();
+   ++vm->framesp;
 
-	/* push required locals in the value stack */
-	for (i = 0, n = proto->nregs; i < n; ++i)
+	/* frame registers overlap the ones of the caller from [stackbase] on (the
+      caller places call arguments there), only push the registers past the
+      top of the value stack */
+	for (i = vm->valuesp, n = stackbase + proto->nregs; i < n; ++i)
 		*vm_push(vm) = value_nil();
 }
 
@@ -191,13 +936,81 @@ kintern koji_result_t
 vm_resume(struct vm *vm)
 {
 	/* helper-shortcut macros */
-#define RA vm_register(vm, frame, decode_A(instr))
-#define ARG(x) vm_value(vm, frame, decode_##x(instr))
+#define RA (regs + i->a)
+#define RB (base[i->bk][i->b])
+#define RC (base[i->ck][i->c])
+#ifdef KOJI_OPCOUNT
+#define vm_fetch()\
+   (i = code + frame->pc, ++vm->opcounts[i->op], ++counts[frame->pc++])
+#else
+#define vm_fetch() (i = code + frame->pc++)
+#endif
+
+#ifdef KOJI_COMPUTED_GOTO
+   /* handler address of each opcode, indexed by [enum opcode] */
+   static void *const dispatch_table[] = {
+      [OP_LOADNIL]  = &&label_OP_LOADNIL,
+      [OP_LOADBOOL] = &&label_OP_LOADBOOL,
+      [OP_MOV]      = &&label_OP_MOV,
+      [OP_NEG]      = &&label_OP_NEG,
+      [OP_UNM]      = &&label_OP_UNM,
+      [OP_ADD]      = &&label_OP_ADD,
+      [OP_SUB]      = &&label_OP_SUB,
+      [OP_MUL]      = &&label_OP_MUL,
+      [OP_DIV]      = &&label_OP_DIV,
+      [OP_MOD]      = &&label_OP_MOD,
+      [OP_POW]      = &&label_default,
+      [OP_ADDK]     = &&label_OP_ADDK,
+      [OP_SUBK]     = &&label_OP_SUBK,
+      [OP_MULK]     = &&label_OP_MULK,
+      [OP_DIVK]     = &&label_OP_DIVK,
+      [OP_MODK]     = &&label_OP_MODK,
+      [OP_KADD]     = &&label_OP_KADD,
+      [OP_KSUB]     = &&label_OP_KSUB,
+      [OP_KMUL]     = &&label_OP_KMUL,
+      [OP_KDIV]     = &&label_OP_KDIV,
+      [OP_KMOD]     = &&label_OP_KMOD,
+      [OP_TESTSET]  = &&label_OP_TESTSET,
+      [OP_CLOSURE]  = &&label_OP_CLOSURE,
+      [OP_GETGLOB]  = &&label_default,
+      [OP_NEWTABLE] = &&label_OP_NEWTABLE,
+      [OP_GET]      = &&label_OP_GET,
+      [OP_THIS]     = &&label_default,
+      [OP_TEST]     = &&label_OP_TEST,
+      [OP_JUMP]     = &&label_OP_JUMP,
+      [OP_EQ]       = &&label_OP_EQ,
+      [OP_LT]       = &&label_OP_LT,
+      [OP_LTE]      = &&label_OP_LTE,
+      [OP_CALL]     = &&label_OP_CALL,
+      [OP_MCALL]    = &&label_OP_MCALL,
+      [OP_TAILCALL] = &&label_OP_TAILCALL,
+      [OP_SETGLOB]  = &&label_default,
+      [OP_SET]      = &&label_OP_SET,
+      [OP_RET]      = &&label_OP_RET,
+      [OP_THROW]    = &&label_OP_THROW,
+      [OP_DEBUG]    = &&label_OP_DEBUG,
+      [OP_TGETK]    = &&label_OP_TGETK,
+      [OP_TSETK]    = &&label_OP_TSETK,
+      [OP_GETGSLOT] = &&label_OP_GETGSLOT,
+      [OP_SETGSLOT] = &&label_OP_SETGSLOT,
+#ifdef KOJI_JIT
+      [OP_JIT]      = &&label_OP_JIT,
+#else
+      [OP_JIT]      = &&label_default,
+#endif
+   };
+#endif
 
    /* declare important bookkeeping variable*/
    struct koji_allocator *alloc = &vm->alloc;
    struct vm_frame *frame;
-   instr_t const *instrs;
+   struct decoded_instr *code;
+   struct inline_cache *caches; /* inline caches of the current prototype */
+#ifdef KOJI_OPCOUNT
+   uint64_t *counts; /* instruction counters of the current prototype */
+#endif
+   union value *regs; /* first register of the current frame */
+   union value *base[2]; /* operand bases: registers and constants */
 
 	/* set the error handler so that if any runtime error occurs, we can cleanly
 	 * return KOJI_ERROR from this function */
@@ -218,41 +1031,73 @@ new_frame: /* jumped to when a new frame is pushed onto the stack */
 		return KOJI_OK;
 
 	frame = vm->framestack + (vm->framesp - 1);
-	instrs = frame->proto->instrs;
+
+   /* decode the prototype instructions the first time it is executed */
+   if (!frame->proto->code) {
+      prototype_decode(frame->proto, alloc);
+      vm_resolve_globals(vm, frame->proto);
+   }
+#ifdef KOJI_PROFILER
+   if (vm->profiler)
+      profiler_enter(vm->profiler, frame->proto);
+#endif
+#ifdef KOJI_OPCOUNT
+   if (!frame->proto->counts)
+      vm_count_proto(vm, frame->proto);
+   counts = frame->proto->counts;
+#endif
+
+   /* ahead-of-time compiled prototypes run their own C function, which
+      returns after pushing or popping a frame */
+   if (frame->proto->aot) {
+      frame->proto->aot(vm, frame);
+      goto new_frame;
+   }
+
+#ifdef KOJI_JIT
+   /* compile the prototype to native code when it becomes hot */
+   if (frame->pc == 0 && frame->proto->hotness < KOJI_JIT_THRESHOLD &&
+       ++frame->proto->hotness == KOJI_JIT_THRESHOLD)
+      jit_compile(vm, frame->proto);
+#endif
+	code = frame->proto->code;
+   caches = frame->proto->caches;
+
+   /* the value stack only moves when a frame is pushed, cache the operand
+      bases for this frame */
+   assert(frame->stackbase + frame->proto->nregs <= vm->valueslen);
+   regs = vm->valuestack + frame->stackbase;
+   base[0] = regs;
+   base[1] = frame->proto->consts;
 
 	for (;;) {
-      int32_t compare, newpc, reg, to_reg;
-      union value *ra;
+      int32_t compare;
+      union value *ra, *r, *rend;
       union value arg1, arg2;
-		instr_t instr = instrs[frame->pc++];
-      enum opcode op = decode_op(instr);
-
-		switch (op) {
-			case OP_LOADNIL:
-            reg = decode_A(instr);
-            to_reg = reg + decode_Bx(instr);
-				for (; reg < to_reg; ++reg)
-					vm_value_setnil(vm, vm_register(vm, frame, reg));
-				break;
-
-			case OP_LOADBOOL:
-				vm_value_setbool(vm, RA, (bool)decode_B(instr));
-				frame->pc += decode_C(instr);
-				break;
-
-			case OP_MOV:
-				vm_value_set(vm, RA, ARG(Bx));
-				break;
-
-			case OP_NEG:
-				ra = RA;
-				arg1 = ARG(Bx);
-				vm_value_setbool(vm, ra, !value_tobool(ARG(Bx)));
-				break;
+		struct decoded_instr *i;
+
+		vm_dispatch() {
+			vm_case(OP_LOADNIL):
+				for (r = RA, rend = r + i->b; r < rend; ++r)
+					vm_value_setnil(vm, r);
+				vm_break;
 
-			case OP_UNM:
+			vm_case(OP_LOADBOOL):
+				vm_value_setbool(vm, RA, (bool)i->b);
+				frame->pc += i->c;
+				vm_break;
+
+			vm_case(OP_MOV):
+				vm_value_set(vm, RA, RB);
+				vm_break;
+
+			vm_case(OP_NEG):
+				vm_value_setbool(vm, RA, !value_tobool(RB));
+				vm_break;
+
+			vm_case(OP_UNM):
 				ra = RA;
-				arg1 = ARG(Bx);
+				arg1 = RB;
 				if (value_isnum(arg1)) {
 					vm_value_setnum(vm, ra, -arg1.num);
 				}
@@ -266,101 +1111,172 @@ new_frame: /* jumped to when a new frame is pushed onto the stack */
 					vm_throw(vm, "cannot apply unary minus operation to a %s value.",
                   value_type_str(arg1));
 				}
-				break;
+				vm_break;
 
 				/* binary operators */
-#define BINARY_OPERATOR(case_, op_, name_, classop, NUMBER_MODIFIER)\
-				case case_:\
-					ra = RA;\
-					arg1 = ARG(B);\
-					arg2 = ARG(C);\
+#define BINARY_OPERATOR(case_, op_, classop, NUMBER_MODIFIER)\
+				vm_case(case_):\
+					arg1 = RB;\
+					arg2 = RC;\
 					if (value_isnum(arg1) && value_isnum(arg2)) {\
                   koji_number_t num = (koji_number_t)(\
                      NUMBER_MODIFIER(arg1.num) op_ NUMBER_MODIFIER(arg2.num));\
-						vm_value_setnum(vm, ra, num);\
+						vm_value_setnum(vm, RA, num);\
 					}\
-					else if (value_isobj(arg1)) {\
-						struct object *obj = value_getobj(arg1);\
-						vm_value_destroy(vm, *ra);\
-						vm_value_set(vm, ra, obj->class->operator[classop](vm, obj,\
-                     classop, &arg1, 2).value);\
+					else {\
+						vm_arith_object(vm, RA, classop, arg1, arg2);\
+					}\
+					vm_break;
+
+            /* binary operators with a number constant operand: only the
+               register operand [reg_] needs checking and if the target is the
+               register operand itself (flag), it is known to hold a number
+               and is overwritten without destroying it */
+#define BINARY_OPERATOR_K(case_, op_, classop, NUMBER_MODIFIER, reg_)\
+				vm_case(case_):\
+					arg1 = RB;\
+					arg2 = RC;\
+					if (value_isnum(reg_)) {\
+                  koji_number_t num = (koji_number_t)(\
+                     NUMBER_MODIFIER(arg1.num) op_ NUMBER_MODIFIER(arg2.num));\
+                  if (i->flag)\
+                     RA->num = num;\
+                  else\
+                     vm_value_setnum(vm, RA, num);\
 					}\
 					else {\
-						vm_throw(vm, "cannot apply binary operator " name_ " between a %s and a %s.", value_type_str(arg1), value_type_str(arg2));\
+						vm_arith_object(vm, RA, classop, arg1, arg2);\
 					}\
-					break;
+					vm_break;
 
 #define PASSTHROUGH(x) x
 #define CAST_TO_INT(x) ((int64_t)x)
 
-				BINARY_OPERATOR(OP_ADD, +, "add", CLASS_OP_ADD, PASSTHROUGH)
-				BINARY_OPERATOR(OP_SUB, -, "sub", CLASS_OP_SUB, PASSTHROUGH)
-				BINARY_OPERATOR(OP_MUL, *, "mul", CLASS_OP_MUL, PASSTHROUGH)
-				BINARY_OPERATOR(OP_DIV, / , "div", CLASS_OP_DIV, PASSTHROUGH)
-				BINARY_OPERATOR(OP_MOD, %, "mod", CLASS_OP_MOD, CAST_TO_INT)
+				BINARY_OPERATOR(OP_ADD, +, CLASS_OP_ADD, PASSTHROUGH)
+				BINARY_OPERATOR(OP_SUB, -, CLASS_OP_SUB, PASSTHROUGH)
+				BINARY_OPERATOR(OP_MUL, *, CLASS_OP_MUL, PASSTHROUGH)
+				BINARY_OPERATOR(OP_DIV, / , CLASS_OP_DIV, PASSTHROUGH)
+				BINARY_OPERATOR(OP_MOD, %, CLASS_OP_MOD, CAST_TO_INT)
+
+				BINARY_OPERATOR_K(OP_ADDK, +, CLASS_OP_ADD, PASSTHROUGH, arg1)
+				BINARY_OPERATOR_K(OP_SUBK, -, CLASS_OP_SUB, PASSTHROUGH, arg1)
+				BINARY_OPERATOR_K(OP_MULK, *, CLASS_OP_MUL, PASSTHROUGH, arg1)
+				BINARY_OPERATOR_K(OP_DIVK, / , CLASS_OP_DIV, PASSTHROUGH, arg1)
+				BINARY_OPERATOR_K(OP_MODK, %, CLASS_OP_MOD, CAST_TO_INT, arg1)
+
+				BINARY_OPERATOR_K(OP_KADD, +, CLASS_OP_ADD, PASSTHROUGH, arg2)
+				BINARY_OPERATOR_K(OP_KSUB, -, CLASS_OP_SUB, PASSTHROUGH, arg2)
+				BINARY_OPERATOR_K(OP_KMUL, *, CLASS_OP_MUL, PASSTHROUGH, arg2)
+				BINARY_OPERATOR_K(OP_KDIV, / , CLASS_OP_DIV, PASSTHROUGH, arg2)
+				BINARY_OPERATOR_K(OP_KMOD, %, CLASS_OP_MOD, CAST_TO_INT, arg2)
 
 #undef PASSTHROUGH
 #undef CAST_TO_INT
+#undef BINARY_OPERATOR_K
 #undef BINARY_OPERATOR
 
-			case OP_TESTSET:
-				/* if arg B to bool matches the boole value in C, make the jump
-               otherwise skip it */
-				newpc = frame->pc + 1;
-				union value const arg = ARG(B);
-				if (value_tobool(arg) == decode_C(instr)) {
-					vm_value_set(vm, RA, arg);
-					newpc += decode_Bx(instrs[frame->pc]);
-				}
-				frame->pc = newpc;
-				break;
-
-         case OP_GETGLOB:
-            *RA = table_get(&vm->globals, vm, ARG(Bx));
-            break;
-
-			case OP_NEWTABLE:
-				*RA = value_new_table(&vm->cls_table, &vm->alloc,
-               TABLE_DEFAULT_CAPACITY);
-				break;
-
-			case OP_GET:
-				arg1 = ARG(B);
-				if (value_isobj(arg1)) {
-               arg2 = ARG(C);
-					struct object *obj = value_getobj(arg1);
-					vm_value_set(vm, RA, obj->class->operator[CLASS_OP_GET](vm, obj,
-                  CLASS_OP_GET, &arg2, 1).value);
+			vm_case(OP_TESTSET):
+				/* if arg B to bool matches the test value, set R(A) and take the
+               branch, otherwise skip the fused jump */
+				arg1 = RB;
+				if (value_tobool(arg1) == i->flag) {
+					vm_value_set(vm, RA, arg1);
+					frame->pc += i->c;
 				}
 				else {
-					vm_throw(vm, "primitive type %s does not support `get` "
-                  "operator.", value_type_str(arg1));
+					frame->pc += 1;
 				}
-				break;
+				vm_break;
+
+         vm_case(OP_GETGSLOT):
+            vm_value_set(vm, RA, vm->globalvals[i->b]);
+            vm_break;
+
+         vm_case(OP_CLOSURE):
+            vm_gc_check(vm);
+            arg1 = *RA;
+            *RA = value_new_closure(&vm->cls_closure, alloc,
+               frame->proto->protos[i->b]);
+            vm_value_destroy(vm, arg1);
+            vm_break;
+
+			vm_case(OP_NEWTABLE):
+            vm_collect_auto(vm);
+            arg1 = *RA;
+				*RA = value_new_table(&vm->cls_table, &vm->shape_root,
+               &vm->alloc);
+            vm_value_destroy(vm, arg1);
+				vm_break;
+
+			vm_case(OP_GET):
+         {
+            struct table *t = vm_totable(vm, RB);
+            if (t) {
+               int32_t index;
+               arg2 = RC;
+               /* quicken the instruction if indexing a table with a constant
+                  string, index the array part directly with integers */
+               if (i->ck && const_isstring(arg2))
+                  i->op = OP_TGETK;
+               else if ((index = table_array_index(arg2, t->arraysize)) >= 0) {
+                  vm_value_set(vm, RA, t->array[index]);
+                  vm_break;
+               }
+               vm_value_set(vm, RA, table_get(t, vm, arg2));
+            }
+            else {
+               vm_get(vm, RA, RB, RC);
+            }
+				vm_break;
+         }
 
-			case OP_TEST:
-				newpc = frame->pc + 1;
-				if (value_tobool(*RA) == decode_Bx(instr)) {
-					newpc += decode_Bx(instrs[frame->pc]);
-				}
-				frame->pc = newpc;
-				break;
+         vm_case(OP_TGETK):
+         {
+            struct table *t = vm_totable(vm, RB);
+            if (t) {
+               struct inline_cache *cache = caches + (i - code);
+               arg2 = RC;
+               if (t->shape) {
+                  /* tables of the same shape have the key in the same slot */
+                  if (cache->shape != t->shape)
+                     vm_cache_key(vm, cache, t, arg2); /* cache miss */
+                  vm_value_set(vm, RA, cache->slot >= 0 ?
+                     t->slots[cache->slot] : value_nil());
+               }
+               else {
+                  if (cache->shape || cache->slot >= t->capacity
+                      || t->pairs[cache->slot].key.bits != arg2.bits)
+                     vm_cache_key(vm, cache, t, arg2); /* cache miss */
+                  vm_value_set(vm, RA, t->pairs[cache->slot].value);
+               }
+            }
+            else {
+               vm_get(vm, RA, RB, RC);
+            }
+            vm_break;
+         }
 
-			case OP_JUMP:
-				frame->pc += decode_Bx(instr);
-				break;
+			vm_case(OP_TEST):
+				frame->pc += value_tobool(*RA) == i->flag ? i->c : 1;
+				vm_break;
+
+			vm_case(OP_JUMP):
+				frame->pc += i->b;
+				vm_break;
 
 #define COMPARISON_OPERATOR(case_, op_)\
-				case case_:\
+				vm_case(case_):\
 					ra = RA;\
-					arg1 = ARG(B);\
+					arg1 = RB;\
 					if (value_isnum(*ra) && value_isnum(arg1)) {\
 						compare = ra->num op_ arg1.num;\
 					}\
 					else if (value_isobj(*ra)) {\
-						struct object *obj = value_getobj(*ra);\
-						compare = (obj->class->operator[CLASS_OP_COMPARE](vm,\
-                     obj, CLASS_OP_COMPARE, &arg1, 1).compare op_ 0);\
+						compare = vm_compare_object(vm, case_, value_getobj(*ra),\
+                     arg1);\
+					}\
+					else if (value_isshortstr(*ra) && value_isshortstr(arg1)) {\
+						compare = shortstr_compare(*ra, arg1) op_ 0;\
 					}\
 					else {\
 						compare = ra->bits op_ arg1.bits;\
@@ -372,113 +1288,141 @@ new_frame: /* jumped to when a new frame is pushed onto the stack */
 				COMPARISON_OPERATOR(OP_LTE, <=);
 
          compare_done:
-            	newpc = frame->pc + 1;
-					if (compare == decode_C(instr)) {
-						newpc += decode_Bx(instrs[frame->pc]);
-					}
-					frame->pc = newpc;
-               break;
+					frame->pc += compare == i->flag ? i->c : 1;
+               vm_break;
 
 #undef COMPARISON_OPERATOR
 
-         case OP_CALL:
-            ra = RA;
-            arg1 = ARG(C);
-            /*if (value_isobj(arg1)) {
-               struct object *obj = value_getobj(arg1);
-               obj->class->operator[CLASS_OP_CALL](vm, obj, CLASS_OP_CALL, arg1, value_nil())
-            }
-            break;*/
+         vm_case(OP_CALL):
+            vm_gc_check(vm);
+            vm_call(vm, RC, frame->stackbase + i->a, i->b);
+            goto new_frame;
 
-         case OP_SETGLOB:
-            table_set(&vm->globals, vm, ARG(Bx), *RA);
-            break;
+         vm_case(OP_TAILCALL):
+            vm_gc_check(vm);
+            if (vm_tailcall(vm, RC, i->a, i->b))
+               goto new_frame;
+            vm_break; /* native call, the following ret returns the result */
 
-         case OP_SET:
-            ra = RA;
-            arg1 = ARG(B);
-            arg2 = ARG(C);
-            if (value_isobj(*ra)) {
-               struct object *obj = value_getobj(*ra);
-               obj->class->operator[CLASS_OP_SET](vm, obj, CLASS_OP_SET, &arg1,
-                  2);
+         vm_case(OP_MCALL):
+         {
+            /* fetch the method first, the callee frame will overwrite the
+               registers from R(A) on */
+            union value method = value_nil();
+            vm_gc_check(vm);
+            vm_get(vm, &method, regs[i->a - 1], RB);
+            vm_call(vm, method, frame->stackbase + i->a, i->c);
+            vm_value_destroy(vm, method); /* the frame holds the prototype */
+            goto new_frame;
+         }
+
+         vm_case(OP_SETGSLOT):
+            vm_value_set(vm, vm->globalvals + i->b, *RA);
+            vm_break;
+
+         vm_case(OP_SET):
+         {
+            struct table *t = vm_totable(vm, *RA);
+            if (t) {
+               int32_t index;
+               vm_barrier(vm, *RA);
+               arg1 = RB;
+               /* quicken the instruction if indexing a table with a constant
+                  string, index the array part directly with integers */
+               if (i->bk && const_isstring(arg1))
+                  i->op = OP_TSETK;
+               else if ((index = table_array_index(arg1, t->arraysize)) >= 0
+                  && !value_isnil(RC) && !value_isnil(t->array[index])) {
+                  /* replacing a value keeps the array part shape */
+                  vm_value_set(vm, t->array + index, RC);
+                  vm_break;
+               }
+               table_set(t, vm, arg1, RC);
             }
             else {
-               vm_throw(vm, "primitive type %s does not support `set` "
-                  "operator.", value_type_str(arg1));
+               vm_set(vm, *RA, RB, RC);
             }
-            break;
+            vm_break;
+         }
 
-			case OP_RET:
+         vm_case(OP_TSETK):
          {
-            union value *dest = vm_register(vm, frame, 0);
-            union value* dest_end = dest + frame->proto->nregs;
-            union value* src = vm_register(vm, frame, decode_A(instr));
-            union value* src_end = src + decode_Bx(instr);
-
-				/* copy locals from starting from 0 from the current frame to the
-               previous frame result locals */
-            for (; src < src_end; ++src, ++dest) {
-               vm_value_destroy(vm, *dest); /* make return reg nil */
-               *dest = *src; /* move value over */
-               *src = value_nil();
+            struct table *t = vm_totable(vm, *RA);
+            if (t) {
+               struct inline_cache *cache = caches + (i - code);
+               vm_barrier(vm, *RA);
+               arg1 = RB;
+               /* on a hit the key is already in the table and only the value
+                  is replaced, so neither its shape nor its size and capacity
+                  can change; nil values remove the key */
+               if (t->shape && cache->shape == t->shape && cache->slot >= 0
+                  && !value_isnil(RC)) {
+                  vm_value_set(vm, t->slots + cache->slot, RC);
+               }
+               else if (t->shape && cache->shape
+                  && cache->shape->parent == t->shape
+                  && cache->slot == cache->shape->nkeys - 1
+                  && !value_isnil(RC)) {
+                  /* the cached shape was reached by adding the key to the
+                     shape of this table, take the same transition */
+                  table_shape_add(t, vm, cache->shape, RC);
+               }
+               else if (!t->shape && !cache->shape
+                  && cache->slot < t->capacity
+                  && t->pairs[cache->slot].key.bits == arg1.bits
+                  && !value_isnil(t->pairs[cache->slot].value)
+                  && !value_isnil(RC)) {
+                  vm_value_set(vm, &t->pairs[cache->slot].value, RC);
+               }
+               else {
+                  table_set(t, vm, arg1, RC);
+                  vm_cache_key(vm, cache, t, arg1); /* cache miss */
+               }
             }
-            
-				/* set all other current locals to nil */
-				for (; dest < dest_end; ++dest) {
-					vm_value_destroy(vm, *dest);
-					*dest = value_nil();
-				}
-
-				/* pop the frame, release the prototype reference */
-				vm->framesp -= 1;
-				vm->valuesp -= frame->proto->nregs;
+            else {
+               vm_set(vm, *RA, RB, RC);
+            }
+            vm_break;
+         }
 
-				prototype_release(frame->proto, alloc);
+			vm_case(OP_RET):
+            vm_return(vm, i->a, i->b);
 				goto new_frame;
-         }
 
-         case OP_THROW:
+         vm_case(OP_THROW):
          {
-            arg1 = ARG(Bx);
-            struct string *str = value_getobjv(arg1);
-            if (value_isobj(arg1) && str->object.class == &vm->cls_string)
-               vm_throw(vm, str->chars);
+            arg1 = RB;
+            if (value_isstring(arg1, &vm->cls_string))
+               vm_throw(vm, value_string_cstr(&arg1));
             else
                vm_throw(vm, "throw argument must be a string.");
-            break;
+            vm_break;
          }
             
-			case OP_DEBUG:
-				printf("debug: ");
-				for (union value *r = RA, *e = r + decode_Bx(instr); r < e; ++r) {
-					if (value_isnil(*r))
-                  printf("nil");
-					else if (value_isbool(*r))
-                  printf("%s", value_getbool(*r) ? "true" : "false");
-					else if (value_isnum(*r))
-                  printf("%f", r->num);
-					else if (value_getobj(*r)->class == &vm->cls_string)
-						printf("%s", &((struct string*)value_getobj(*r))->chars);
-					else
-						printf("<object:%p>", value_getobj(*r));
-					printf(", ");
-					vm_value_setnil(vm, RA);
-				}
-				printf("\n");
-
-				break;
-
-			default:
+			vm_case(OP_DEBUG):
+            vm_debug(vm, RA, i->b);
+				vm_break;
+
+#ifdef KOJI_JIT
+         vm_case(OP_JIT):
+            /* run native code up to the next instruction not compiled */
+            frame->pc = frame->proto->jit->fn(regs, base[1], frame->pc - 1, vm);
+            vm_break;
+#endif
+
+			vm_default:
 				assert(!"Opcode not implemented.");
-				break;
+				vm_break;
 		}
 	}
 
 #undef RA
-#undef ARG
+#undef RB
+#undef RC
+#undef vm_fetch
 }
 
+#ifndef KOJI_GC
 kintern void
 vm_value_set(struct vm *vm, union value *dest, union value src)
 {
@@ -491,10 +1435,15 @@ vm_value_set(struct vm *vm, union value *dest, union value src)
 
 	vm_value_destroy(vm, old_dest);
 }
+#endif
 
 kintern void
 vm_object_unref(struct vm *vm, struct object *obj)
 {
+#ifdef KOJI_GC
+   /* freed by the collector once unreachable */
+   (void)vm, (void)obj;
+#else
 entry:
 	assert(obj && obj->refs > 0);
    if (--obj->refs == 0) {
@@ -503,6 +1452,9 @@ entry:
       obj = cls_obj; 
       goto entry;
    }
+   if (obj->class == &vm->cls_table)
+      collector_candidate(vm, (struct object_table *)obj);
+#endif
 }
 
 kintern uint64_t
@@ -510,6 +1462,8 @@ vm_value_hash(struct vm *vm, union value val)
 {
 	if (value_isobj(val)) {
 		struct object *obj = value_getobj(val);
+      if (obj->class == &vm->cls_string)
+         return string_hash((struct string *)obj);
 		return obj->class->operator[CLASS_OP_HASH](vm, obj, CLASS_OP_HASH,
          NULL, 0).hash;
 	}
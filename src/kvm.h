@@ -13,6 +13,10 @@
 #include "kvalue.h"
 #include "kclass.h"
 #include "ktable.h"
+#include "kstring.h"
+#include "kbytecode.h"
+#include "kcollect.h"
+#include "kgc.h"
 #include <setjmp.h>
 #include <stdarg.h>
 
@@ -44,7 +48,18 @@ struct vm {
    struct class cls_builtin; /* the `builtin class` class */
    struct class cls_string;  /* the `string` class */
    struct class cls_table;   /* the `table` class */
-   struct table globals;     /* table of globals */
+   struct class cls_closure; /* the `closure` class */
+   struct class cls_native;  /* the `native` function class */
+   struct string_set strings; /* interned strings */
+   struct shape shape_root;  /* the empty shape new tables start with */
+   struct table globals;     /* maps global names to their slots */
+   union value *globalvals;  /* global values, indexed by slot */
+   int32_t nglobals;         /* number of global slots in use */
+   int32_t globalslen;       /* capacity of the global values array */
+   struct collector collector; /* the cycle collector of tables */
+#ifdef KOJI_GC
+   struct gc gc; /* the tracing collector, in place of reference counting */
+#endif
 	enum vm_state validstate; /* whether the VM is in a valid state for exec. */
 	struct vm_frame *framestack; /* stack of activation frames */
 	int32_t framesp; /* frame stack pointer */
@@ -53,6 +68,15 @@ struct vm {
    int32_t valuesp; /* stack pointer */
 	int32_t valueslen; /* maximum elements capacity of the current value stack */
 	jmp_buf errorjmpbuf; /* #documentation */
+#ifdef KOJI_PROFILER
+   struct profiler *profiler; /* the running profiler, NULL if none */
+#endif
+#ifdef KOJI_OPCOUNT
+   uint64_t opcounts[OP_JIT + 1]; /* executions of each opcode */
+   struct prototype **counted; /* executed prototypes, in order of execution */
+   int32_t ncounted; /* number of executed prototypes */
+   int32_t countedlen; /* capacity of the executed prototypes array */
+#endif
 };
 
 /*
@@ -75,6 +99,14 @@ vm_deinit(struct vm*);
 kintern void
 vm_push_frame(struct vm*, struct prototype *proto, int32_t stack_base);
 
+/*
+ * Returns the slot of the global with name [name], reserving a new slot with
+ * nil value if no global with that name has been referenced yet. Slots are
+ * stable for the lifetime of the VM.
+ */
+kintern int32_t
+vm_global_slot(struct vm*, union value name);
+
 kintern void
 vm_throwv(struct vm*, const char *format, va_list args);
 
@@ -102,15 +134,36 @@ vm_popn(struct vm*, int32_t n);
 kintern koji_result_t
 vm_resume(struct vm*);
 
-kintern void
-vm_value_set(struct vm *vm, union value *dest, union value src);
-
 kintern void
 vm_object_unref(struct vm*, struct object*);
 
 kintern uint64_t
 vm_value_hash(struct vm*, union value val);
 
+#ifdef KOJI_GC
+
+/*
+ * Objects are freed by the collector, which traces the values in use: values
+ * are copied and overwritten without touching the objects they point to.
+ */
+static void
+vm_value_set(struct vm *vm, union value *dest, union value src)
+{
+   (void)vm;
+   *dest = src;
+}
+
+static void
+vm_value_destroy(struct vm *vm, union value val)
+{
+   (void)vm, (void)val;
+}
+
+#else
+
+kintern void
+vm_value_set(struct vm *vm, union value *dest, union value src);
+
 static void
 vm_value_destroy(struct vm *vm, union value val)
 {
@@ -119,3 +172,5 @@ vm_value_destroy(struct vm *vm, union value val)
 		vm_object_unref(vm, object);
 	}
 }
+
+#endif
@@ -0,0 +1,293 @@
+/* generated by kojic --emit-c, do not edit */
+
+#include "kaot.h"
+
+static void
+proto_0(struct vm *vm, struct vm_frame *frame)
+{
+   struct decoded_instr const *code = frame->proto->code;
+   union value *k = frame->proto->consts;
+   union value *r = vm->valuestack + frame->stackbase;
+   (void)code; (void)k; (void)r;
+
+   switch (frame->pc) {
+      case 0: goto L0;
+      case 12: goto L12;
+      case 15: goto L15;
+      case 16: goto L16;
+      case 17: goto L17;
+      case 19: goto L19;
+      case 23: goto L23;
+      case 26: goto L26;
+      case 30: goto L30;
+      case 31: goto L31;
+      case 32: goto L32;
+      case 34: goto L34;
+      case 37: goto L37;
+      case 40: goto L40;
+      case 41: goto L41;
+      case 42: goto L42;
+      case 44: goto L44;
+      case 47: goto L47;
+      case 49: goto L49;
+      case 50: goto L50;
+      case 51: goto L51;
+      case 53: goto L53;
+      case 57: goto L57;
+      case 59: goto L59;
+      case 60: goto L60;
+      case 61: goto L61;
+      case 63: goto L63;
+      case 67: goto L67;
+      case 69: goto L69;
+      case 70: goto L70;
+      case 71: goto L71;
+      case 73: goto L73;
+      case 77: goto L77;
+      case 82: goto L82;
+   }
+
+L0:
+   /* closure */ vm_aot_closure(vm, r + 0, frame->proto->protos[0]);
+   /* setglob */ vm_value_set(vm, vm->globalvals + code[1].b, r[0]);
+   /* closure */ vm_aot_closure(vm, r + 0, frame->proto->protos[1]);
+   /* setglob */ vm_value_set(vm, vm->globalvals + code[3].b, r[0]);
+   /* closure */ vm_aot_closure(vm, r + 0, frame->proto->protos[2]);
+   /* setglob */ vm_value_set(vm, vm->globalvals + code[5].b, r[0]);
+   /* closure */ vm_aot_closure(vm, r + 0, frame->proto->protos[3]);
+   /* setglob */ vm_value_set(vm, vm->globalvals + code[7].b, r[0]);
+   /* mov */ vm_value_set(vm, r + 0, value_num(0x1.8p+1));
+   /* mov */ vm_value_set(vm, r + 1, value_num(0x1p+2));
+   /* getglob */ vm_value_set(vm, r + 2, vm->globalvals[code[10].b]);
+   /* call */ frame->pc = 12; if (vm_aot_call(vm, r[2], frame->stackbase + 0, 2)) return; r = vm->valuestack + frame->stackbase;
+L12:
+   /* get */ vm_aot_get(vm, r + 2, r[0], k[7]);
+   /* eq */ if (aot_compare(OP_EQ, ==, r[2], value_num(0x1.9p+4)) == 1) goto L16; goto L15;
+   /* jump */ goto L16;
+L15:
+   /* loadbool */ aot_setbool(vm, r + 1, false); goto L17;
+L16:
+   /* loadbool */ aot_setbool(vm, r + 1, true);
+L17:
+   /* getglob */ vm_value_set(vm, r + 2, vm->globalvals[code[17].b]);
+   /* call */ frame->pc = 19; if (vm_aot_call(vm, r[2], frame->stackbase + 1, 1)) return; r = vm->valuestack + frame->stackbase;
+L19:
+   /* get */ vm_aot_get(vm, r + 2, r[0], k[9]);
+   /* get */ vm_aot_get(vm, r + 3, r[0], k[10]);
+   /* lte */ if (aot_compare(OP_LTE, <=, r[2], r[3]) == 0) goto L30; goto L23;
+   /* jump */ goto L30;
+L23:
+   /* get */ vm_aot_get(vm, r + 2, r[0], k[10]);
+   /* lte */ if (aot_compare(OP_LTE, <=, r[2], value_num(0x1p+1)) == 1) goto L30; goto L26;
+   /* jump */ goto L30;
+L26:
+   /* get */ vm_aot_get(vm, r + 2, r[0], k[9]);
+   /* get */ vm_aot_get(vm, r + 3, r[0], k[10]);
+   /* eq */ if (aot_compare(OP_EQ, ==, r[2], r[3]) == 0) goto L31; goto L30;
+   /* jump */ goto L31;
+L30:
+   /* loadbool */ aot_setbool(vm, r + 1, false); goto L32;
+L31:
+   /* loadbool */ aot_setbool(vm, r + 1, true);
+L32:
+   /* getglob */ vm_value_set(vm, r + 2, vm->globalvals[code[32].b]);
+   /* call */ frame->pc = 34; if (vm_aot_call(vm, r[2], frame->stackbase + 1, 1)) return; r = vm->valuestack + frame->stackbase;
+L34:
+   /* mov */ vm_value_set(vm, r + 1, k[12]);
+   /* lt */ if (aot_compare(OP_LT, <, r[1], k[13]) == 0) goto L40; goto L37;
+   /* jump */ goto L40;
+L37:
+   /* add */ aot_arith(r + 3, r[1], k[14], +, CLASS_OP_ADD);
+   /* eq */ if (aot_compare(OP_EQ, ==, r[3], k[15]) == 1) goto L41; goto L40;
+   /* jump */ goto L41;
+L40:
+   /* loadbool */ aot_setbool(vm, r + 2, false); goto L42;
+L41:
+   /* loadbool */ aot_setbool(vm, r + 2, true);
+L42:
+   /* getglob */ vm_value_set(vm, r + 3, vm->globalvals[code[42].b]);
+   /* call */ frame->pc = 44; if (vm_aot_call(vm, r[3], frame->stackbase + 2, 1)) return; r = vm->valuestack + frame->stackbase;
+L44:
+   /* mov */ vm_value_set(vm, r + 3, value_num(0x1.ep+3));
+   /* getglob */ vm_value_set(vm, r + 4, vm->globalvals[code[45].b]);
+   /* call */ frame->pc = 47; if (vm_aot_call(vm, r[4], frame->stackbase + 3, 1)) return; r = vm->valuestack + frame->stackbase;
+L47:
+   /* eq */ if (aot_compare(OP_EQ, ==, r[3], value_num(0x1.31p+9)) == 1) goto L50; goto L49;
+   /* jump */ goto L50;
+L49:
+   /* loadbool */ aot_setbool(vm, r + 2, false); goto L51;
+L50:
+   /* loadbool */ aot_setbool(vm, r + 2, true);
+L51:
+   /* getglob */ vm_value_set(vm, r + 3, vm->globalvals[code[51].b]);
+   /* call */ frame->pc = 53; if (vm_aot_call(vm, r[3], frame->stackbase + 2, 1)) return; r = vm->valuestack + frame->stackbase;
+L53:
+   /* mov */ vm_value_set(vm, r + 3, value_num(0x1.388p+13));
+   /* mov */ vm_value_set(vm, r + 4, value_num(0x0p+0));
+   /* getglob */ vm_value_set(vm, r + 5, vm->globalvals[code[55].b]);
+   /* call */ frame->pc = 57; if (vm_aot_call(vm, r[5], frame->stackbase + 3, 2)) return; r = vm->valuestack + frame->stackbase;
+L57:
+   /* eq */ if (aot_compare(OP_EQ, ==, r[3], value_num(0x1.388p+13)) == 1) goto L60; goto L59;
+   /* jump */ goto L60;
+L59:
+   /* loadbool */ aot_setbool(vm, r + 2, false); goto L61;
+L60:
+   /* loadbool */ aot_setbool(vm, r + 2, true);
+L61:
+   /* getglob */ vm_value_set(vm, r + 3, vm->globalvals[code[61].b]);
+   /* call */ frame->pc = 63; if (vm_aot_call(vm, r[3], frame->stackbase + 2, 1)) return; r = vm->valuestack + frame->stackbase;
+L63:
+   /* mov */ vm_value_set(vm, r + 3, value_num(0x1p+0));
+   /* mov */ vm_value_set(vm, r + 4, value_num(0x1p+1));
+   /* getglob */ vm_value_set(vm, r + 5, vm->globalvals[code[65].b]);
+   /* call */ frame->pc = 67; if (vm_aot_call(vm, r[5], frame->stackbase + 3, 2)) return; r = vm->valuestack + frame->stackbase;
+L67:
+   /* eq */ if (aot_compare(OP_EQ, ==, r[3], value_num(0x1p+0)) == 1) goto L70; goto L69;
+   /* jump */ goto L70;
+L69:
+   /* loadbool */ aot_setbool(vm, r + 2, false); goto L71;
+L70:
+   /* loadbool */ aot_setbool(vm, r + 2, true);
+L71:
+   /* getglob */ vm_value_set(vm, r + 3, vm->globalvals[code[71].b]);
+   /* call */ frame->pc = 73; if (vm_aot_call(vm, r[3], frame->stackbase + 2, 1)) return; r = vm->valuestack + frame->stackbase;
+L73:
+   /* newtable */ vm_aot_newtable(vm, r + 2);
+   /* mov */ vm_value_set(vm, r + 3, value_num(0x1.4p+3));
+   /* getglob */ vm_value_set(vm, r + 4, vm->globalvals[code[75].b]);
+   /* call */ frame->pc = 77; if (vm_aot_call(vm, r[4], frame->stackbase + 3, 1)) return; r = vm->valuestack + frame->stackbase;
+L77:
+   /* set */ vm_aot_set(vm, r[2], k[0], r[3]);
+   /* mov */ vm_value_set(vm, r + 3, value_num(0x1.9p+6));
+   /* mov */ vm_value_set(vm, r + 4, value_num(0x1.4p+2));
+   /* getglob */ vm_value_set(vm, r + 5, vm->globalvals[code[80].b]);
+   /* call */ frame->pc = 82; if (vm_aot_call(vm, r[5], frame->stackbase + 3, 2)) return; r = vm->valuestack + frame->stackbase;
+L82:
+   /* set */ vm_aot_set(vm, r[2], k[1], r[3]);
+   /* add */ aot_arith(r + 3, k[26], k[27], +, CLASS_OP_ADD);
+   /* set */ vm_aot_set(vm, r[2], k[25], r[3]);
+   /* get */ vm_aot_get(vm, r + 3, r[0], k[10]);
+   /* set */ vm_aot_set(vm, r[2], k[10], r[3]);
+   /* setglob */ vm_value_set(vm, vm->globalvals + code[87].b, r[2]);
+   /* ret */ vm_aot_return(vm, 0, 0); return;
+}
+
+static void
+proto_1(struct vm *vm, struct vm_frame *frame)
+{
+   struct decoded_instr const *code = frame->proto->code;
+   union value *k = frame->proto->consts;
+   union value *r = vm->valuestack + frame->stackbase;
+   (void)code; (void)k; (void)r;
+
+   switch (frame->pc) {
+      case 0: goto L0;
+      case 2: goto L2;
+      case 3: goto L3;
+      case 6: goto L6;
+      case 9: goto L9;
+   }
+
+L0:
+   /* lt */ if (aot_compare(OP_LT, <, r[0], value_num(0x1p+1)) == 0) goto L3; goto L2;
+   /* jump */ goto L3;
+L2:
+   /* ret */ vm_aot_return(vm, 0, 1); return;
+L3:
+   /* subk */ aot_arith(r + 1, r[0], value_num(0x1p+0), -, CLASS_OP_SUB);
+   /* getglob */ vm_value_set(vm, r + 2, vm->globalvals[code[4].b]);
+   /* call */ frame->pc = 6; if (vm_aot_call(vm, r[2], frame->stackbase + 1, 1)) return; r = vm->valuestack + frame->stackbase;
+L6:
+   /* subk */ aot_arith(r + 2, r[0], value_num(0x1p+1), -, CLASS_OP_SUB);
+   /* getglob */ vm_value_set(vm, r + 3, vm->globalvals[code[7].b]);
+   /* call */ frame->pc = 9; if (vm_aot_call(vm, r[3], frame->stackbase + 2, 1)) return; r = vm->valuestack + frame->stackbase;
+L9:
+   /* add */ aot_arith(r + 1, r[1], r[2], +, CLASS_OP_ADD);
+   /* ret */ vm_aot_return(vm, 1, 1); return;
+}
+
+static void
+proto_2(struct vm *vm, struct vm_frame *frame)
+{
+   struct decoded_instr const *code = frame->proto->code;
+   union value *k = frame->proto->consts;
+   union value *r = vm->valuestack + frame->stackbase;
+   (void)code; (void)k; (void)r;
+
+   switch (frame->pc) {
+      case 0: goto L0;
+      case 2: goto L2;
+      case 3: goto L3;
+   }
+
+L0:
+   /* eq */ if (aot_compare(OP_EQ, ==, r[0], value_num(0x0p+0)) == 0) goto L3; goto L2;
+   /* jump */ goto L3;
+L2:
+   /* ret */ vm_aot_return(vm, 1, 1); return;
+L3:
+   /* subk */ aot_arith(r + 2, r[0], value_num(0x1p+0), -, CLASS_OP_SUB);
+   /* addk */ aot_arith(r + 3, r[1], value_num(0x1p+0), +, CLASS_OP_ADD);
+   /* getglob */ vm_value_set(vm, r + 4, vm->globalvals[code[5].b]);
+   /* tailcall */ if (vm_aot_tailcall(vm, r[4], 2, 2)) return; r = vm->valuestack + frame->stackbase;
+   /* ret */ vm_aot_return(vm, 2, 1); return;
+}
+
+static void
+proto_3(struct vm *vm, struct vm_frame *frame)
+{
+   struct decoded_instr const *code = frame->proto->code;
+   union value *k = frame->proto->consts;
+   union value *r = vm->valuestack + frame->stackbase;
+   (void)code; (void)k; (void)r;
+
+   switch (frame->pc) {
+      case 0: goto L0;
+   }
+
+L0:
+   /* newtable */ vm_aot_newtable(vm, r + 2);
+   /* set */ vm_aot_set(vm, r[2], k[0], r[0]);
+   /* set */ vm_aot_set(vm, r[2], k[1], r[1]);
+   /* mul */ aot_arith(r + 3, r[0], r[0], *, CLASS_OP_MUL);
+   /* mul */ aot_arith(r + 4, r[1], r[1], *, CLASS_OP_MUL);
+   /* add */ aot_arith(r + 3, r[3], r[4], +, CLASS_OP_ADD);
+   /* set */ vm_aot_set(vm, r[2], k[2], r[3]);
+   /* ret */ vm_aot_return(vm, 2, 1); return;
+}
+
+static void
+proto_4(struct vm *vm, struct vm_frame *frame)
+{
+   struct decoded_instr const *code = frame->proto->code;
+   union value *k = frame->proto->consts;
+   union value *r = vm->valuestack + frame->stackbase;
+   (void)code; (void)k; (void)r;
+
+   switch (frame->pc) {
+      case 0: goto L0;
+   }
+
+L0:
+   /* ret */ vm_aot_return(vm, 0, 1); return;
+}
+
+static aot_fn_t const fns[] = { proto_0, proto_1, proto_2, proto_3, proto_4 };
+
+static struct aot_module module = {
+   0x126812e05aab5b9eull, 5, fns, NULL
+};
+
+void
+koji_aot_register_aot(void)
+{
+   aot_register(&module);
+}
+
+#if defined(__GNUC__) || defined(__clang__)
+__attribute__((constructor)) static void
+register_module(void)
+{
+   aot_register(&module);
+}
+#endif